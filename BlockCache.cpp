@@ -0,0 +1,191 @@
+#include "BlockCache.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <algorithm>
+
+BlockCache::BlockCache(const CachePolicy& policy) : budget(policy.budget), attrTimeoutNs(policy.attrTimeoutMs * 1000000UL), sizes(), target(0UL), sweepAt(SWEEP_FILES), hits(0UL), misses(0UL), invalidations(0UL) {}
+
+bool BlockCache::find(const FileId& file, uint32_t blockSize, uint64_t index, Block& block) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto state = files.find(file);
+	if (state != files.end()) {
+		auto found = state->second.blocks.find(BlockKey(blockSize, index));
+		if (found != state->second.blocks.end() && (found->second.list == LIST::T1 || found->second.list == LIST::T2)) {
+			// Used again, it moves to the front of T2
+			auto& entry = found->second;
+			unlink(entry);
+			link(state->second, found->first, entry, LIST::T2);
+			block = entry.block;
+			hits.fetch_add(1UL, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	misses.fetch_add(1UL, std::memory_order_relaxed);
+	return false;
+}
+
+void BlockCache::insert(const FileId& file, uint32_t blockSize, uint64_t index, const Block& block) {
+	uint64_t bytes = block.data ? block.data->capacity() : 0;
+	if (bytes == 0 || bytes > budget) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto& state = track(file);
+	BlockKey key(blockSize, index);
+	auto found = state.blocks.find(key);
+	LIST list = LIST::T1;
+	bool fromB2 = false;
+	if (found != state.blocks.end()) {
+		auto& entry = found->second;
+		if (entry.list == LIST::B1) {
+			// Evicted from T1 too early, T1 gets more room
+			uint64_t delta = std::max(entry.bytes, entry.bytes * sizes[static_cast<uint32_t>(LIST::B2)] / sizes[static_cast<uint32_t>(LIST::B1)]);
+			target = std::min(budget, target + delta);
+		} else if (entry.list == LIST::B2) {
+			// Evicted from T2 too early, T2 gets more room
+			uint64_t delta = std::max(entry.bytes, entry.bytes * sizes[static_cast<uint32_t>(LIST::B1)] / sizes[static_cast<uint32_t>(LIST::B2)]);
+			target -= std::min(target, delta);
+			fromB2 = true;
+		}
+		list = LIST::T2; // Seen before
+		unlink(entry);
+		state.blocks.erase(found);
+	}
+
+	while (sizes[static_cast<uint32_t>(LIST::T1)] + sizes[static_cast<uint32_t>(LIST::T2)] + bytes > budget) {
+		replace(fromB2);
+	}
+	auto& entry = state.blocks[key];
+	entry.block = block;
+	entry.bytes = bytes;
+	link(state, key, entry, list);
+
+	// B1 is kept to the budget together with T1, and all four lists to twice the budget
+	while (sizes[static_cast<uint32_t>(LIST::T1)] + sizes[static_cast<uint32_t>(LIST::B1)] > budget && sizes[static_cast<uint32_t>(LIST::B1)]) {
+		dropLru(LIST::B1);
+	}
+	while (sizes[static_cast<uint32_t>(LIST::T1)] + sizes[static_cast<uint32_t>(LIST::T2)] + sizes[static_cast<uint32_t>(LIST::B1)] + sizes[static_cast<uint32_t>(LIST::B2)] > 2 * budget && sizes[static_cast<uint32_t>(LIST::B2)]) {
+		dropLru(LIST::B2);
+	}
+}
+
+bool BlockCache::attributesExpired(const FileId& file, uint64_t now) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto state = files.find(file);
+	if (state == files.end() || not state->second.attributesKnown) {
+		return true;
+	}
+	return now >= state->second.checkedNs + attrTimeoutNs;
+}
+
+bool BlockCache::validate(const FileId& file, const nfs3::fattr3& attributes, uint64_t now) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto& state = track(file);
+	bool changed = state.attributesKnown && (state.mtime.xdrTie() != attributes.mtime.xdrTie() || state.ctime.xdrTie() != attributes.ctime.xdrTie() || state.size != attributes.size);
+	if (changed) {
+		DEBUG_LOG(CRITICAL) << "File changed on the server, dropping " << state.blocks.size() << " cached blocks";
+		dropBlocks(state);
+	}
+	state.attributesKnown = true;
+	state.mtime = attributes.mtime;
+	state.ctime = attributes.ctime;
+	state.size = attributes.size;
+	state.checkedNs = now;
+	if (files.size() >= sweepAt) {
+		sweep(now);
+	}
+	return changed;
+}
+
+void BlockCache::invalidate(const FileId& file) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto state = files.find(file);
+	if (state == files.end()) {
+		return;
+	}
+	dropBlocks(state->second);
+	files.erase(state); // Nothing left to know of it
+}
+
+uint64_t BlockCache::getBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return sizes[static_cast<uint32_t>(LIST::T1)] + sizes[static_cast<uint32_t>(LIST::T2)];
+}
+
+uint64_t BlockCache::getTarget() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return target;
+}
+
+void BlockCache::link(FileState& file, const BlockKey& key, Entry& entry, LIST list) {
+	auto& to = lists[static_cast<uint32_t>(list)];
+	Slot slot = {&file, key};
+	to.push_front(slot);
+	entry.where = to.begin();
+	entry.list = list;
+	sizes[static_cast<uint32_t>(list)] += entry.bytes;
+}
+
+void BlockCache::unlink(Entry& entry) {
+	lists[static_cast<uint32_t>(entry.list)].erase(entry.where);
+	sizes[static_cast<uint32_t>(entry.list)] -= entry.bytes;
+}
+
+// Evicts the LRU block of T1 to B1 while T1 is over its target, else that of T2 to B2
+void BlockCache::replace(bool fromB2) {
+	uint64_t t1 = sizes[static_cast<uint32_t>(LIST::T1)];
+	bool fromT1 = t1 && (t1 > target || (fromB2 && t1 == target) || sizes[static_cast<uint32_t>(LIST::T2)] == 0);
+	auto& from = lists[static_cast<uint32_t>(fromT1 ? LIST::T1 : LIST::T2)];
+	DASSERT(not from.empty());
+	auto slot = from.back();
+	auto& entry = slot.file->blocks[slot.key];
+	unlink(entry);
+	entry.block = Block();
+	link(*slot.file, slot.key, entry, fromT1 ? LIST::B1 : LIST::B2);
+}
+
+void BlockCache::dropLru(LIST list) {
+	auto slot = lists[static_cast<uint32_t>(list)].back();
+	auto found = slot.file->blocks.find(slot.key);
+	unlink(found->second);
+	slot.file->blocks.erase(found);
+	if (slot.file->blocks.empty() && not slot.file->attributesKnown) {
+		forget(*slot.file);
+	}
+}
+
+void BlockCache::dropBlocks(FileState& file) {
+	if (file.blocks.empty()) {
+		return;
+	}
+	for (auto& entry : file.blocks) {
+		unlink(entry.second);
+	}
+	file.blocks.clear();
+	invalidations.fetch_add(1UL, std::memory_order_relaxed);
+}
+
+BlockCache::FileState& BlockCache::track(const FileId& file) {
+	auto state = files.emplace(file, FileState()).first;
+	state->second.id = &state->first;
+	return state->second;
+}
+
+void BlockCache::forget(FileState& file) {
+	DASSERT(file.blocks.empty());
+	files.erase(*file.id);
+}
+
+// Forgets the files without blocks whose attributes are stale, then waits for the number of files to double again
+void BlockCache::sweep(uint64_t now) {
+	for (auto state = files.begin(); state != files.end();) {
+		if (state->second.blocks.empty() && now >= state->second.checkedNs + attrTimeoutNs) {
+			state = files.erase(state);
+		} else {
+			++state;
+		}
+	}
+	sweepAt = std::max(static_cast<uint64_t>(SWEEP_FILES), 2 * static_cast<uint64_t>(files.size()));
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "BufferPool.hpp"
+#include "CachePolicy.hpp"
+#include "NfsTypes.hpp"
+#include "types.hpp"
+
+#include "descriptiveenum/DescriptiveEnum.hpp"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * File data cached on the client, one cache shared by every file and server. A block is what one READ of a ReadEngine
+ * returned, keyed by the file and its index, offset / blockSize. Its data is shared with the readers, never copied.
+ *
+ * Blocks are evicted by ARC. T1 holds blocks read once, T2 those read again, B1 and B2 remember the keys evicted from
+ * them. A miss that hits B1 means T1 was too small and moves its target size up, one that hits B2 moves it down, so a
+ * scan of a large file does not push out blocks that are read over and over. Sizes are in bytes of buffer, so that
+ * budget bounds the memory held.
+ *
+ * The blocks of a file are dropped when its mtime, ctime or size differ from those they were cached under, as a GETATTR
+ * or a READ reply reports them, and when the file is written through this client.
+ *
+ * A file is tracked while it has blocks or its attributes are fresh. One written through this client, or whose last
+ * block ARC dropped once its attributes were forgotten, is forgotten right away. The others that stay without blocks
+ * are swept once the number of tracked files doubled, so reading many files once does not grow the cache for ever.
+ */
+class BlockCache {
+	public:
+		// Data of one block as its READ returned it, shared with the readers using it and never changed
+		struct Block {
+			std::shared_ptr<WireBuffer> data;
+			uint32_t size;
+			bool eof;
+
+			Block() : size(0), eof(false) {}
+		};
+
+		// A file of a server, handles of different servers may be the same
+		struct FileId {
+			std::string server;
+			std::vector<uchar_t> file; // Its handle
+
+			bool operator<(const FileId& other) const {
+				return std::tie(server, file) < std::tie(other.server, other.file);
+			}
+		};
+
+		explicit BlockCache(const CachePolicy& policy);
+
+		BlockCache(const BlockCache&) = delete;
+		BlockCache& operator=(const BlockCache&) = delete;
+
+		// Block index of blockSize bytes of file. Returns false if it is not cached.
+		bool find(const FileId& file, uint32_t blockSize, uint64_t index, Block& block);
+		void insert(const FileId& file, uint32_t blockSize, uint64_t index, const Block& block);
+
+		// Whether the attributes of file should be checked with a GETATTR at now
+		bool attributesExpired(const FileId& file, uint64_t now) const;
+		// Takes the attributes a reply had for file at now, and drops its blocks if they changed. Returns true if they did.
+		bool validate(const FileId& file, const nfs3::fattr3& attributes, uint64_t now);
+		// Drops the blocks of file and forgets its attributes
+		void invalidate(const FileId& file);
+
+		// Lookups that found their block, and that did not, and the times a file had its blocks dropped
+		uint64_t getHits() const {
+			return hits.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getMisses() const {
+			return misses.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getInvalidations() const {
+			return invalidations.load(std::memory_order_relaxed);
+		}
+
+		// Bytes cached, and the part of them ARC wants in T1
+		uint64_t getBytes() const;
+		uint64_t getTarget() const;
+
+	private:
+		DESC_CLASS_ENUM(LIST, uint32_t,
+			T1,
+			T2,
+			B1,
+			B2
+		);
+		constexpr static uint32_t LISTS = 4;
+		constexpr static uint64_t SWEEP_FILES = 1024; // Tracked files before the first sweep
+
+		struct FileState;
+		using BlockKey = std::pair<uint32_t, uint64_t>; // blockSize, index
+
+		// Element of the lists, names the entry it stands for
+		struct Slot {
+			FileState* file;
+			BlockKey key;
+		};
+
+		struct Entry {
+			LIST list;
+			Block block; // Empty in B1 and B2
+			uint64_t bytes;
+			std::list<Slot>::iterator where;
+		};
+
+		struct FileState {
+			std::map<BlockKey, Entry> blocks;
+			bool attributesKnown;
+			nfs3::nfstime3 mtime;
+			nfs3::nfstime3 ctime;
+			uint64_t size;
+			uint64_t checkedNs;
+			const FileId* id; // Its key in files
+
+			FileState() : attributesKnown(false), mtime(), ctime(), size(0UL), checkedNs(0UL), id(nullptr) {}
+		};
+
+		FileState& track(const FileId& file);
+		void forget(FileState& file);
+		void sweep(uint64_t now);
+
+		void link(FileState& file, const BlockKey& key, Entry& entry, LIST list);
+		void unlink(Entry& entry);
+		void replace(bool fromB2);
+		void dropLru(LIST list);
+		void dropBlocks(FileState& file);
+
+		uint64_t budget;
+		uint64_t attrTimeoutNs;
+
+		mutable std::mutex mutex;
+		std::map<FileId, FileState> files;
+		std::list<Slot> lists[LISTS]; // Most recently used first
+		uint64_t sizes[LISTS]; // In bytes
+		uint64_t target; // Of T1, p of ARC
+		uint64_t sweepAt; // Number of tracked files at which sweep() runs
+
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		std::atomic<uint64_t> invalidations;
+};
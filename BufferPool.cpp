@@ -0,0 +1,144 @@
+#include "BufferPool.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <atomic>
+#include <new>
+#include <vector>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace {
+
+std::atomic<bool> hugePages(false);
+
+// Free buffers of the thread, by class. Given back to the system when the thread exits.
+struct ThreadCache {
+	std::vector<uchar_t*> free[BufferPool::CLASSES];
+	bool closed = false; // Buffers released after the thread cache went away are freed at once
+
+	~ThreadCache();
+};
+
+thread_local ThreadCache cache;
+
+uchar_t* allocate(size_t capacity) {
+	if (capacity < BufferPool::HUGE_PAGE_SIZE) {
+		return new (std::nothrow) uchar_t[capacity];
+	}
+	void* mapped = MAP_FAILED;
+	if (hugePages) {
+		mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (mapped == MAP_FAILED) {
+		mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED) {
+			return nullptr;
+		}
+		if (hugePages) {
+			madvise(mapped, capacity, MADV_HUGEPAGE);
+		}
+	}
+	return static_cast<uchar_t*>(mapped);
+}
+
+void deallocate(uchar_t* buffer, size_t capacity) {
+	if (capacity < BufferPool::HUGE_PAGE_SIZE) {
+		delete [] buffer;
+	} else {
+		munmap(buffer, capacity);
+	}
+}
+
+}
+
+int32_t BufferPool::classOf(size_t size) {
+	size_t classSize = MIN_SIZE;
+	for (uint32_t index = 0; index < CLASSES; ++index, classSize <<= 1) {
+		if (size <= classSize) {
+			return index;
+		}
+	}
+	return -1;
+}
+
+uchar_t* BufferPool::acquire(size_t size, size_t& capacity) {
+	auto index = classOf(size ? size : 1);
+	if (index < 0) {
+		DEBUG_LOG(CRITICAL) << "Buffer of : " << size << " bytes exceeds the limit of : " << static_cast<size_t>(MAX_SIZE);
+		return nullptr;
+	}
+	capacity = MIN_SIZE << index;
+	auto& free = cache.free[index];
+	if (not free.empty()) {
+		auto buffer = free.back();
+		free.pop_back();
+		return buffer;
+	}
+	auto buffer = allocate(capacity);
+	if (not buffer) {
+		DEBUG_LOG(CRITICAL) << "Failed to allocate a buffer of : " << capacity << " bytes";
+	}
+	return buffer;
+}
+
+void BufferPool::release(uchar_t* buffer, size_t capacity) {
+	if (not buffer) {
+		return;
+	}
+	auto index = classOf(capacity);
+	DASSERT(index >= 0 && (MIN_SIZE << index) == capacity);
+	if (cache.closed) {
+		deallocate(buffer, capacity);
+		return;
+	}
+	auto& free = cache.free[index];
+	size_t limit = CACHE_BYTES / capacity;
+	if (limit > CACHE_COUNT) {
+		limit = CACHE_COUNT;
+	}
+	if (free.size() < (limit ? limit : 1)) {
+		free.push_back(buffer);
+	} else {
+		deallocate(buffer, capacity);
+	}
+}
+
+void BufferPool::setHugePages(bool enable) {
+	hugePages = enable;
+}
+
+ThreadCache::~ThreadCache() {
+	size_t classSize = BufferPool::MIN_SIZE;
+	for (uint32_t index = 0; index < BufferPool::CLASSES; ++index, classSize <<= 1) {
+		for (auto buffer : free[index]) {
+			deallocate(buffer, classSize);
+		}
+		free[index].clear();
+	}
+	closed = true;
+}
+
+bool WireBuffer::reserve(size_t size, size_t keep) {
+	if (size <= bufferCapacity) {
+		return true;
+	}
+	size_t capacity;
+	auto larger = BufferPool::acquire(size, capacity);
+	if (not larger) {
+		return false;
+	}
+	if (keep) {
+		memcpy(larger, buffer, (keep < bufferCapacity) ? keep : bufferCapacity);
+	}
+	release();
+	buffer = larger;
+	bufferCapacity = capacity;
+	return true;
+}
+
+void WireBuffer::release() {
+	BufferPool::release(buffer, bufferCapacity);
+	buffer = nullptr;
+	bufferCapacity = 0;
+}
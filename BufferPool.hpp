@@ -0,0 +1,84 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Wire buffers for requests and replies, recycled through a cache per thread so that a call allocates nothing once its
+ * thread is warm, and takes no lock. Sizes are rounded up to power of two classes from MIN_SIZE to MAX_SIZE. A buffer
+ * freed on another thread than the one it came from simply joins that thread's cache.
+ *
+ * Buffers of HUGE_PAGE_SIZE and above are mapped directly. With huge pages enabled they are backed by explicit huge
+ * pages when the system has some reserved, and are otherwise advised to be backed by transparent ones.
+ */
+class BufferPool {
+	public:
+		constexpr static size_t MIN_SIZE = 1024;
+		constexpr static size_t MAX_SIZE = 64 * 1024 * 1024;
+		constexpr static uint32_t CLASSES = 17; // MIN_SIZE << (CLASSES - 1) == MAX_SIZE
+		constexpr static size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+		constexpr static size_t CACHE_BYTES = 8 * 1024 * 1024; // Most kept per class and thread
+		constexpr static uint32_t CACHE_COUNT = 32; // Same, in buffers
+
+		// Returns a buffer of at least size bytes and sets capacity to its real size, or nullptr
+		static uchar_t* acquire(size_t size, size_t& capacity);
+		// Takes back a buffer of capacity bytes from acquire()
+		static void release(uchar_t* buffer, size_t capacity);
+		static void setHugePages(bool enable);
+
+	private:
+		static int32_t classOf(size_t size);
+};
+
+// Owner of one pooled buffer, returns it to the pool when destroyed. Move only.
+class WireBuffer {
+	public:
+		WireBuffer() : buffer(nullptr), bufferCapacity(0) {}
+		explicit WireBuffer(size_t size) : buffer(nullptr), bufferCapacity(0) {
+			reserve(size);
+		}
+		~WireBuffer() {
+			release();
+		}
+
+		WireBuffer(WireBuffer&& other) : buffer(other.buffer), bufferCapacity(other.bufferCapacity) {
+			other.buffer = nullptr;
+			other.bufferCapacity = 0;
+		}
+
+		WireBuffer& operator=(WireBuffer&& other) {
+			if (this != &other) {
+				release();
+				buffer = other.buffer;
+				bufferCapacity = other.bufferCapacity;
+				other.buffer = nullptr;
+				other.bufferCapacity = 0;
+			}
+			return *this;
+		}
+
+		WireBuffer(const WireBuffer&) = delete;
+		WireBuffer& operator=(const WireBuffer&) = delete;
+
+		// Makes room for size bytes. The first keep bytes survive a move to a larger buffer. Returns false if out of memory.
+		bool reserve(size_t size, size_t keep = 0);
+		void release();
+
+		uchar_t* data() const {
+			return buffer;
+		}
+
+		size_t capacity() const {
+			return bufferCapacity;
+		}
+
+		explicit operator bool() const {
+			return buffer != nullptr;
+		}
+
+	private:
+		uchar_t* buffer;
+		size_t bufferCapacity;
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Client side caching of file data, see BlockCache. Up to budget bytes of the blocks READs returned are kept for all
+ * servers together, 0 turns the cache off. The attributes the blocks were cached under are checked with a GETATTR once
+ * they are attrTimeoutMs old and whenever a file is read again after close(), like the actimeo mount option and the
+ * close-to-open consistency of the Linux client.
+ */
+struct CachePolicy {
+	uint64_t budget;
+	uint32_t attrTimeoutMs;
+
+	CachePolicy() : budget(0), attrTimeoutMs(3000) {}
+};
@@ -0,0 +1,1120 @@
+#include "Connection.hpp"
+#include "Utils.hpp"
+#include "xdr.hpp"
+#include "RpcEngine.hpp"
+#include "EventLoop.hpp"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <chrono>
+#include <iomanip>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Resolves server to its first IPv4 address, with port left 0. Returns 0, or the getaddrinfo error.
+int32_t Connection::resolve(const std::string& server, struct sockaddr_in& address) {
+	struct addrinfo hints, *info;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET;
+
+	auto result = getaddrinfo(server.c_str(), nullptr, &hints, &info);
+	if (result != 0) {
+		DEBUG_LOG(CRITICAL) << "getaddrinfo failed for server : " << server << " : " << gai_strerror(result);
+		return result;
+	}
+	memcpy(&address, info->ai_addr, sizeof (address));
+	address.sin_port = 0;
+	freeaddrinfo(info);
+	return 0;
+}
+
+void Connection::setPeer(const struct sockaddr_in& address) {
+	std::lock_guard<std::mutex> lock(mutex);
+	peer = address;
+	peer.sin_port = htons(port);
+	peerKnown = true;
+}
+
+/*
+ * Opens the socket and waits up to timeout seconds for the connection. Returns 0 once open, or -1 on failure, leaving
+ * the connection closed so that the next call retries.
+ */
+int32_t Connection::connect(uint32_t timeout) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (socketFd != -1) {
+		return 0; // Already open, every caller of the program shares the socket
+	}
+
+	int32_t fd;
+	auto status = openSocketLocked(fd);
+	if (status == -EINPROGRESS) {
+		struct pollfd waiting = {fd, POLLOUT, 0};
+		int32_t ready;
+		do {
+			ready = poll(&waiting, 1, timeout * 1000);
+		} while (ready < 0 && errno == EINTR);
+		status = connectedLocked(fd, ready > 0);
+	}
+	if (status != 0) {
+		return -1;
+	}
+	return adoptSocketLocked(fd);
+}
+
+/*
+ * First half of a connect that does not wait. Returns 0 if the connection is open already, -1 on failure, or
+ * -EINPROGRESS with fd set to a socket that becomes writable once connected. finishConnect() must then be called
+ * with it.
+ */
+int32_t Connection::startConnect(int32_t& fd) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (socketFd != -1) {
+		return 0;
+	}
+	auto status = openSocketLocked(fd);
+	if (status == 0) {
+		return adoptSocketLocked(fd);
+	}
+	return status;
+}
+
+// Second half, writable tells whether fd became writable in time. Returns 0 once open, or -1.
+int32_t Connection::finishConnect(int32_t fd, bool writable) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (connectedLocked(fd, writable) != 0) {
+		return -1;
+	}
+	if (socketFd != -1) {
+		close(fd); // A caller of connect() was quicker, its socket is the one in use
+		return 0;
+	}
+	return adoptSocketLocked(fd);
+}
+
+/*
+ * Connects all connections at the same time and waits for them up to timeout seconds in total. Returns the number that
+ * failed to open.
+ */
+int32_t Connection::connectAll(const std::vector<Connection_p>& connections, uint32_t timeout) {
+	std::vector<struct pollfd> waiting;
+	std::vector<Connection_p> owners;
+	int32_t failed = 0;
+	for (auto& connection : connections) {
+		int32_t fd;
+		auto status = connection->startConnect(fd);
+		if (status == -EINPROGRESS) {
+			waiting.push_back({fd, POLLOUT, 0});
+			owners.push_back(connection);
+		} else if (status != 0) {
+			++failed;
+		}
+	}
+
+	auto deadline = getClockNs() + timeout * 1000000000UL;
+	std::vector<bool> done(waiting.size(), false);
+	size_t left = waiting.size();
+	while (left) {
+		auto now = getClockNs();
+		int32_t ready = 0;
+		if (now < deadline) {
+			ready = poll(waiting.data(), waiting.size(), (deadline - now + 999999) / 1000000);
+			if (ready < 0 && errno == EINTR) {
+				continue;
+			}
+		}
+		if (ready <= 0) {
+			break; // Deadline passed, whatever is still pending fails below
+		}
+		for (size_t i = 0; i < waiting.size(); ++i) {
+			if (not done[i] && waiting[i].revents) {
+				if (owners[i]->finishConnect(waiting[i].fd, true) != 0) {
+					++failed;
+				}
+				done[i] = true;
+				waiting[i].fd = -1; // poll skips it from now on
+				--left;
+			}
+		}
+	}
+	for (size_t i = 0; i < waiting.size(); ++i) {
+		if (not done[i]) {
+			owners[i]->finishConnect(waiting[i].fd, false);
+			++failed;
+		}
+	}
+	return failed;
+}
+
+// Opens a non-blocking socket and starts connecting it. Returns 0 if connected already, -EINPROGRESS, or -1.
+int32_t Connection::openSocketLocked(int32_t& fd) {
+	if (not peerKnown) {
+		if (resolve(server, peer) != 0) {
+			return -1;
+		}
+		peer.sin_port = htons(port);
+		peerKnown = true; // Kept for every later reconnect
+	}
+
+	int32_t type = isDatagram() ? SOCK_DGRAM : SOCK_STREAM;
+	fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		error = errno;
+		DEBUG_LOG(CRITICAL) << "Internal error, failed to open socket of AF_INET and type " << (isDatagram() ? "SOCK_DGRAM" : "SOCK_STREAM") << " : " << strerror(error);
+		return -1;
+	}
+
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&peer), sizeof (peer)) == 0) {
+		return 0; // Over UDP only fixes the peer
+	}
+	if (errno == EINPROGRESS) {
+		return -EINPROGRESS;
+	}
+	connectError = error = errno;
+	DEBUG_LOG(CRITICAL) << "Failed to connect to server : " << server << " at port : " << port << " with error : " << strerror(error);
+	close(fd);
+	return -1;
+}
+
+// Checks how a connect in progress on fd ended. Returns 0 if it is connected, else closes fd and returns -1.
+int32_t Connection::connectedLocked(int32_t fd, bool writable) {
+	if (not writable) {
+		DEBUG_LOG(CRITICAL) << "Timed out connecting to server : " << server << " at port : " << port;
+		connectError = error = ETIMEDOUT;
+		close(fd);
+		return -1;
+	}
+	int32_t result = 0;
+	socklen_t length = sizeof (result);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &length) != 0) {
+		result = errno;
+	}
+	if (result != 0) {
+		connectError = error = result;
+		DEBUG_LOG(CRITICAL) << "Failed to connect to server : " << server << " at port : " << port << " with error : " << strerror(result);
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+// Makes the connected fd the socket of this connection. Returns 0, or -1 after closing fd.
+int32_t Connection::adoptSocketLocked(int32_t fd) {
+	connectError = error = 0;
+	if (not (eventLoop && eventLoop->wantsNonBlocking())) {
+		error = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK); // Only the connect was not to block
+	}
+
+	if (error == 0 && eventLoop) {
+		// The loop owns all waiting from here on, deadlines are enforced by it and not by the socket
+		error = eventLoop->add(shared_from_this(), fd, loopRegistration);
+		if (error != 0) {
+			DEBUG_LOG(CRITICAL) << "Failed to hand socket fd : " << fd << " to event loop";
+		}
+	} else if (error == 0) {
+		uint32_t timeout = 5;
+		struct timeval tv;
+		tv.tv_usec = 0;
+		tv.tv_sec = timeout;
+		error = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+		if (error != 0) {
+			error = errno;
+			DEBUG_LOG(CRITICAL) << "Receive timeout set failure : " << strerror(error);
+		}
+		rcvTimeout = timeout;
+	}
+	if (error != 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (duplex && not eventLoop && not reader.joinable()) {
+		fullDuplex = true;
+		reader = std::thread(readLoop, std::weak_ptr<Connection>(shared_from_this()));
+	}
+
+	socketFd = fd;
+	++connectGeneration;
+	time(&connectTime);
+	timem = localtime(&connectTime);
+	return 0;
+}
+
+void Connection::disconnect() {
+	std::shared_ptr<RpcEngine> engine;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd > 0) {
+			if (eventLoop) {
+				eventLoop->remove(socketFd);
+				sendQueue.clear();
+				sendQueueOffset = 0;
+			}
+			datagramQueue.clear();
+			shutdown(socketFd, SHUT_RDWR); // Wakes pending I/O of a ring, or of a UDP receiver blocked without our lock
+			if (receiving) {
+				lingeringFd = socketFd; // The receiver closes it once it returns, so that the fd can not be reused under it
+			} else {
+				close(socketFd);
+			}
+			socketFd = -1;
+			totalSent = 0UL;
+			totalReceived = 0UL;
+			time(&disconnectTime);
+			timem = localtime(&disconnectTime);
+		}
+		engine = rpcEngine;
+	}
+	if (engine) {
+		engine->abort(-ECONNRESET); // Replies to calls still in flight can never arrive on a new socket
+	}
+}
+
+// The loop saw the socket it registered as registration fail. By then the owner may already have reconnected, in
+// which case the new socket is left alone.
+void Connection::abandon(uint32_t registration) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd < 0 || loopRegistration != registration) {
+			return;
+		}
+		DEBUG_LOG(CRITICAL) << "Connection to server : " << server << " at port : " << port << " is gone, failing its calls";
+	}
+	disconnect();
+}
+
+Connection::~Connection() {
+	disconnect();
+	if (reader.joinable()) {
+		if (reader.get_id() == std::this_thread::get_id()) {
+			reader.detach(); // Dropped by the reader itself, it returns without touching us again
+		} else {
+			reader.join(); // It can not hold on to us any more, it returns at its next turn
+		}
+	}
+	for (auto submission = submissions.takeAll(); submission;) {
+		auto next = submission->next;
+		delete submission;
+		submission = next;
+	}
+}
+
+std::shared_ptr<RpcEngine> Connection::getRpcEngine() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (not rpcEngine) {
+		rpcEngine = std::make_shared<RpcEngine>(this, inflightDepth, retransmitPolicy);
+	}
+	return rpcEngine;
+}
+
+void Connection::setEventLoop(const std::shared_ptr<EventLoop>& loop) {
+	std::lock_guard<std::mutex> lock(mutex);
+	eventLoop = loop;
+}
+
+void Connection::setInflightDepth(uint32_t depth) {
+	std::shared_ptr<RpcEngine> engine;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inflightDepth = depth;
+		engine = rpcEngine;
+	}
+	if (engine) {
+		engine->setDepth(depth); // Outside our lock, the engine takes its own lock first and then ours
+	}
+}
+
+void Connection::setRetransmitPolicy(const RetransmitPolicy& policy) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (rpcEngine) {
+		DEBUG_LOG(CRITICAL) << "Retransmit policy set after the first call to : " << server << " at port : " << port << " is ignored";
+		return;
+	}
+	retransmitPolicy = policy;
+}
+
+void Connection::setFragmentSize(uint32_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	fragmentSize = size;
+}
+
+void Connection::setDuplex(bool on) {
+	std::lock_guard<std::mutex> lock(mutex);
+	duplex = on;
+}
+
+int32_t Connection::send(uchar_t* wireBytes, int32_t size, bool trace) {
+	struct iovec vector = {wireBytes, (size_t)size};
+	return send(&vector, 1, trace);
+}
+
+static size_t vectorsLength(const struct iovec* vectors, int32_t count) {
+	size_t length = 0;
+	for (int32_t i = 0; i < count; ++i) {
+		length += vectors[i].iov_len;
+	}
+	return length;
+}
+
+// Appends the bytes of vectors from offset skip on to dst
+static void gatherVectors(const struct iovec* vectors, int32_t count, size_t skip, std::vector<uchar_t>& dst) {
+	for (int32_t i = 0; i < count; ++i) {
+		auto base = static_cast<const uchar_t*>(vectors[i].iov_base);
+		if (skip >= vectors[i].iov_len) {
+			skip -= vectors[i].iov_len;
+			continue;
+		}
+		dst.insert(dst.end(), base + skip, base + vectors[i].iov_len);
+		skip = 0;
+	}
+}
+
+// Sets rest to the part of vectors after the first skip bytes
+static void remainingVectors(const struct iovec* vectors, int32_t count, size_t skip, std::vector<struct iovec>& rest) {
+	rest.clear();
+	for (int32_t i = 0; i < count; ++i) {
+		if (skip >= vectors[i].iov_len) {
+			skip -= vectors[i].iov_len;
+			continue;
+		}
+		rest.push_back({static_cast<uchar_t*>(vectors[i].iov_base) + skip, vectors[i].iov_len - skip});
+		skip = 0;
+	}
+}
+
+/*
+ * Splits the record in vectors, which starts with the caller's record mark, into fragments of at most fragmentSize
+ * bytes. Sets pieces to the fragments, each behind its own mark kept in marks, without copying the record.
+ */
+static void fragmentVectors(const struct iovec* vectors, int32_t count, size_t size, uint32_t fragmentSize, std::vector<uchar_t>& marks, std::vector<struct iovec>& pieces) {
+	size_t body = size - sizeof(uint32_t);
+	size_t fragments = (body + fragmentSize - 1) / fragmentSize;
+	marks.resize(fragments * sizeof(uint32_t)); // Sized up front, pieces point into it
+	pieces.clear();
+
+	size_t skip = sizeof(uint32_t);
+	int32_t vector = 0;
+	for (size_t fragment = 0; fragment < fragments; ++fragment) {
+		size_t length = (body > fragmentSize) ? fragmentSize : body;
+		body -= length;
+		uchar_t* mark = &marks[fragment * sizeof(uint32_t)];
+		xdr_encode_u32(mark, body ? length : (length | RecordReader::LAST_FRAGMENT));
+		pieces.push_back({mark, sizeof(uint32_t)});
+
+		while (length) {
+			if (skip == vectors[vector].iov_len) {
+				skip = 0;
+				++vector;
+				continue;
+			}
+			size_t piece = vectors[vector].iov_len - skip;
+			if (piece > length) {
+				piece = length;
+			}
+			pieces.push_back({static_cast<uchar_t*>(vectors[vector].iov_base) + skip, piece});
+			skip += piece;
+			length -= piece;
+		}
+	}
+	DASSERT(vector < count);
+}
+
+/*
+ * Sends one record gathered from vectors, the first of which starts with the record mark. Returns 0 once the record is
+ * sent or queued, -1 on failure.
+ */
+int32_t Connection::send(const struct iovec* vectors, int32_t count, bool trace) {
+	auto size = vectorsLength(vectors, count);
+	if (size == 0) {
+		DEBUG_LOG(CRITICAL) << "Empty send";
+		return 0;
+	}
+	if (vectors[0].iov_len < sizeof(uint32_t)) {
+		DEBUG_LOG(CRITICAL) << "Record mark split over pieces of the message";
+		return -1;
+	}
+	if (isDatagram()) {
+		// The datagram is the RPC message, it has no record mark
+		if (size == sizeof(uint32_t) || size - sizeof(uint32_t) > MAX_DATAGRAM) {
+			DEBUG_LOG(CRITICAL) << "Message of length : " << size << " does not fit a datagram";
+			return -1;
+		}
+		if (count > IOV_MAX) {
+			DEBUG_LOG(CRITICAL) << "Datagram in : " << count << " pieces exceeds IOV_MAX";
+			return -1;
+		}
+	}
+
+	if (fullDuplex) {
+		return sendDuplex(vectors, count, size, trace);
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	return sendLocked(vectors, count, size, trace);
+}
+
+// Called with the lock held, by send() and the full duplex writer
+int32_t Connection::sendLocked(const struct iovec* vectors, int32_t count, size_t size, bool trace) {
+	if (socketFd == -1) {
+		DEBUG_LOG(CRITICAL) << "Bad socket";
+		return -1;
+	}
+
+	if (trace) {
+		DEBUG_LOG(CRITICAL) << "Socket fd : " << socketFd;
+		DEBUG_LOG(CRITICAL) << "Sending message of length : " << size << " in : " << count << " pieces";
+		std::ostringstream oss;
+		for (int32_t i = 0; i < count; ++i) {
+			auto base = static_cast<const uchar_t*>(vectors[i].iov_base);
+			for (size_t j = 0; j < vectors[i].iov_len; ++j) {
+				oss << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)base[j] << " ";
+			}
+		}
+		DEBUG_LOG(CRITICAL) << oss.str();
+	}
+
+	if (isDatagram()) {
+		if (not corked && datagramQueue.empty() && not (eventLoop && eventLoop->ownsWrites())) {
+			return sendDatagramLocked(vectors, count);
+		}
+		datagramQueue.emplace_back();
+		gatherVectors(vectors, count, sizeof(uint32_t), datagramQueue.back());
+		if (corked || (eventLoop && eventLoop->requestFlush(socketFd))) {
+			return 0;
+		}
+		return (flushDatagramsLocked() < 0) ? -1 : 0;
+	}
+
+	std::vector<struct iovec> fragments;
+	std::vector<uchar_t> marks;
+	if (fragmentSize && size - sizeof(uint32_t) > fragmentSize) {
+		fragmentVectors(vectors, count, size, fragmentSize, marks, fragments);
+		vectors = fragments.data();
+		count = fragments.size();
+		size = vectorsLength(vectors, count);
+	}
+
+	if (eventLoop && (eventLoop->ownsWrites() || sendQueueOffset < sendQueue.size())) {
+		// Bytes must leave in order, queue behind what is already waiting
+		gatherVectors(vectors, count, 0, sendQueue);
+		if (eventLoop->requestFlush(socketFd)) {
+			return 0; // The loop transmits the queue itself
+		}
+		return (flushLocked() < 0) ? -1 : 0;
+	}
+	return sendStreamLocked(vectors, count, size);
+}
+
+/*
+ * The first sender to find nobody writing becomes the writer and sends its record in place. Others queue a copy and
+ * return. The writer sends whatever was queued before it steps down, so a burst leaves in as few system calls as
+ * there were writers, and no sender ever waits for another's sendmsg.
+ */
+int32_t Connection::sendDuplex(const struct iovec* vectors, int32_t count, size_t size, bool trace) {
+	if (not writing.exchange(true)) {
+		int32_t status;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			status = sendLocked(vectors, count, size, trace);
+		}
+		stepDown();
+		return status;
+	}
+
+	auto submission = new Submission(); // Freed by the writer that sends it
+	submission->bytes.reserve(size);
+	gatherVectors(vectors, count, 0, submission->bytes);
+	submissions.push(submission);
+	if (not writing.exchange(true)) {
+		stepDown(); // The writer may have looked at the queue just before the push, and left
+	}
+	return 0;
+}
+
+// Writer only. Sends what was queued until the queue is found empty after giving up the writer role.
+void Connection::stepDown() {
+	do {
+		writeSubmissions();
+		writing = false;
+	} while (not submissions.empty() && not writing.exchange(true));
+}
+
+// Writer only. Sends every queued record, the stream ones gathered into one sendmsg and the datagrams into sendmmsg batches.
+void Connection::writeSubmissions() {
+	auto first = submissions.takeAll();
+	if (not first) {
+		return;
+	}
+
+	int32_t status = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<struct iovec> stream;
+		size_t streamSize = 0;
+		for (auto submission = first; submission && status == 0; submission = submission->next) {
+			struct iovec record = {submission->bytes.data(), submission->bytes.size()};
+			if (isDatagram()) {
+				datagramQueue.emplace_back();
+				gatherVectors(&record, 1, sizeof(uint32_t), datagramQueue.back());
+			} else if (fragmentSize) {
+				status = sendLocked(&record, 1, record.iov_len, false);
+			} else {
+				stream.push_back(record);
+				streamSize += record.iov_len;
+			}
+		}
+		if (socketFd == -1) {
+			status = -1;
+		} else if (status == 0 && not stream.empty()) {
+			status = sendStreamLocked(stream.data(), stream.size(), streamSize);
+		} else if (status == 0 && isDatagram() && not corked) {
+			status = (flushDatagramsLocked() < 0) ? -1 : 0;
+		}
+	}
+
+	while (first) {
+		auto next = first->next;
+		delete first;
+		first = next;
+	}
+	if (status != 0) {
+		disconnect(); // Fails the calls of every record lost with the stream, their senders already returned
+	}
+}
+
+
+/*
+ * Writes a record straight from the caller's buffers, at most IOV_MAX pieces per sendmsg. A blocking socket is written
+ * until all of it is sent. A non-blocking one never blocks the caller, whatever it does not take now is queued and
+ * flushed by the loop once it drains.
+ */
+int32_t Connection::sendStreamLocked(const struct iovec* vectors, int32_t count, size_t size) {
+	int32_t flags = MSG_NOSIGNAL; // A closed peer fails the call, not the process
+	if (eventLoop) {
+		flags |= MSG_DONTWAIT;
+	}
+	std::vector<struct iovec> rest;
+	struct msghdr message;
+	memset(&message, 0, sizeof (message));
+	message.msg_iov = const_cast<struct iovec*>(vectors);
+	message.msg_iovlen = (count < IOV_MAX) ? count : IOV_MAX;
+
+	size_t sent = 0;
+	while (sent < size) {
+		auto written = ::sendmsg(socketFd, &message, flags);
+		if (written >= 0) {
+			DASSERT((size_t)written <= size - sent);
+			sent += written;
+			totalSent += written;
+			if (sent < size) {
+				remainingVectors(vectors, count, sent, rest);
+				message.msg_iov = rest.data();
+				message.msg_iovlen = (rest.size() < IOV_MAX) ? rest.size() : IOV_MAX;
+			}
+		} else if (errno == EINTR) {
+			continue;
+		} else if (eventLoop && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			gatherVectors(vectors, count, sent, sendQueue);
+			return 0;
+		} else {
+			error = errno;
+			DEBUG_LOG(CRITICAL) << "Send failure after : " << sent << " of : " << size << " bytes : " << strerror(error);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Sends one datagram straight from the caller's buffers, leaving out the record mark at the front
+int32_t Connection::sendDatagramLocked(const struct iovec* vectors, int32_t count) {
+	std::vector<struct iovec> parts(vectors, vectors + count);
+	parts[0].iov_base = static_cast<uchar_t*>(parts[0].iov_base) + sizeof(uint32_t);
+	parts[0].iov_len -= sizeof(uint32_t);
+
+	struct msghdr message;
+	memset(&message, 0, sizeof (message));
+	message.msg_iov = parts.data();
+	message.msg_iovlen = parts.size();
+	int32_t flags = MSG_NOSIGNAL;
+	if (eventLoop) {
+		flags |= MSG_DONTWAIT;
+	}
+	while (true) {
+		auto written = ::sendmsg(socketFd, &message, flags);
+		if (written >= 0) {
+			totalSent += written;
+			return 0;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			datagramQueue.emplace_back(); // Sent by the loop's next flush, once the socket buffer drains
+			gatherVectors(vectors, count, sizeof(uint32_t), datagramQueue.back());
+			return 0;
+		} else if (errno == ECONNREFUSED) {
+			return 0; // The server is not listening right now, the datagram is lost like on the wire and retransmitted later
+		}
+		error = errno;
+		DEBUG_LOG(CRITICAL) << "Send failure : " << strerror(error);
+		return -1;
+	}
+}
+
+// Connection the calling thread is the reader of, if any
+static thread_local const Connection* readingFor = nullptr;
+
+bool Connection::onDriverThread() const {
+	if (fullDuplex) {
+		return readingFor == this;
+	}
+	auto loop = getEventLoop();
+	return loop && loop->onLoopThread();
+}
+
+/*
+ * Reader thread of a full duplex connection. Feeds every reply on the socket to the RpcEngine, and fires its timers at
+ * least every TICK_MS. It only holds on to the connection for one turn at a time, and returns once it is gone.
+ */
+void Connection::readLoop(std::weak_ptr<Connection> weak) {
+	while (auto connection = weak.lock()) {
+		readingFor = connection.get();
+		auto engine = connection->getRpcEngine();
+		auto onReply = [&engine](uchar_t* reply, int32_t replySize) {
+			engine->dispatch(reply, replySize);
+		};
+
+		auto readable = connection->waitReadable(static_cast<uint32_t>(EventLoop::TICK_MS));
+		if (readable > 0) {
+			auto status = connection->isDatagram() ? connection->receiveDatagrams(1, onReply) : connection->receiveRecords(1, onReply);
+			if (status < 0 && status != -ETIMEDOUT) {
+				connection->disconnect(); // Fails every call on the socket, the next call opens a new one
+			}
+		} else if (readable < 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint32_t>(EventLoop::TICK_MS))); // No socket until a call connects
+		}
+		engine->expire(getClockNs());
+		readingFor = nullptr;
+	}
+}
+
+// Reader only. Returns 1 once the socket is readable, 0 if it is not within timeoutMs, -1 if there is none.
+int32_t Connection::waitReadable(uint32_t timeoutMs) {
+	struct pollfd descriptor;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd == -1) {
+			return -1;
+		}
+		descriptor.fd = socketFd;
+		receiving = true;
+	}
+	descriptor.events = POLLIN;
+	descriptor.revents = 0;
+	auto ready = poll(&descriptor, 1, timeoutMs);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	receiving = false;
+	if (lingeringFd == descriptor.fd) {
+		close(descriptor.fd); // Disconnected while we were waiting
+		lingeringFd = -1;
+		return -1;
+	}
+	return (ready > 0) ? 1 : 0;
+}
+
+/*
+ * Blocking mode over TCP only. Waits up to timeout seconds for bytes, reads as many as the socket has with one readv and
+ * calls onRecord for every record they complete. Blocks without our lock so that other callers can send meanwhile.
+ * Returns the number of records, which may be 0 for part of a record, -ETIMEDOUT if nothing arrived in time, or -1 on
+ * failure.
+ */
+int32_t Connection::receiveRecords(uint32_t timeout, const std::function<void(uchar_t*, int32_t)>& onRecord) {
+	int32_t fd;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd == -1 || eventLoop || isDatagram()) {
+			DEBUG_LOG(CRITICAL) << "Blocking record receive needs an open TCP socket not driven by the event loop";
+			return -1;
+		}
+		if (armReceiveTimeoutLocked(timeout) != 0) {
+			return -1;
+		}
+		if (readerGeneration != connectGeneration) {
+			readerGeneration = connectGeneration;
+			recordReader.reset();
+		}
+		fd = socketFd;
+		receiving = true;
+	}
+
+	struct iovec vectors[2];
+	auto count = recordReader.space(vectors);
+	ssize_t received;
+	do {
+		received = readv(fd, vectors, count);
+	} while (received < 0 && errno == EINTR);
+	auto readError = errno;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		receiving = false;
+		if (lingeringFd == fd) {
+			close(fd); // Disconnected while we were blocked, whatever arrived belongs to calls already failed
+			lingeringFd = -1;
+			return -1;
+		}
+		if (received > 0) {
+			totalReceived += received;
+		} else if (received < 0) {
+			error = readError;
+		}
+	}
+
+	if (received == 0) {
+		DEBUG_LOG(CRITICAL) << "Connection closed by server : " << server << " at port : " << port;
+		return -1;
+	} else if (received < 0 && (readError == EAGAIN || readError == EWOULDBLOCK)) {
+		DEBUG_LOG(CRITICAL) << "Receive timed out after : " << timeout << " seconds";
+		return -ETIMEDOUT;
+	} else if (received < 0) {
+		DEBUG_LOG(CRITICAL) << "Receive failed : " << strerror(readError);
+		return -1;
+	}
+	recordReader.produced(received);
+	return recordReader.drain(onRecord);
+}
+
+int32_t Connection::armReceiveTimeoutLocked(uint32_t timeout) {
+	if (timeout == rcvTimeout) {
+		return 0;
+	}
+	struct timeval tv;
+	tv.tv_usec = 0;
+	tv.tv_sec = timeout;
+	if (timeout <= 0) {
+		DEBUG_LOG(CRITICAL) << "Too big timeout for receive on socket";
+	}
+	error = setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	if (error != 0) {
+		error = errno;
+		DEBUG_LOG(CRITICAL) << "Receive timeout set failure : " << strerror(error);
+		return -1;
+	}
+	rcvTimeout = timeout;
+	return 0;
+}
+
+/*
+ * Receives up to DATAGRAM_BATCH datagrams with one recvmmsg into recvStage, datagram i at i * MAX_DATAGRAM, and sets
+ * their lengths. Truncated datagrams get length 0. Only one thread may read the socket this way at a time. Returns the
+ * number of datagrams, 0 if none was waiting and flags said not to wait, -ETIMEDOUT if none arrived within SO_RCVTIMEO,
+ * or -1 on failure.
+ */
+int32_t Connection::readDatagrams(int32_t fd, int32_t flags, uint32_t* lengths) {
+	if (recvStage.size() < (size_t)DATAGRAM_BATCH * MAX_DATAGRAM) {
+		recvStage.resize((size_t)DATAGRAM_BATCH * MAX_DATAGRAM);
+	}
+	struct mmsghdr messages[DATAGRAM_BATCH];
+	struct iovec vectors[DATAGRAM_BATCH];
+	memset(messages, 0, sizeof (messages));
+	for (uint32_t i = 0; i < DATAGRAM_BATCH; ++i) {
+		vectors[i].iov_base = &recvStage[(size_t)i * MAX_DATAGRAM];
+		vectors[i].iov_len = MAX_DATAGRAM;
+		messages[i].msg_hdr.msg_iov = &vectors[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int32_t received;
+	do {
+		received = recvmmsg(fd, messages, DATAGRAM_BATCH, flags, nullptr);
+	} while (received < 0 && errno == EINTR);
+
+	if (received < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return (flags & MSG_DONTWAIT) ? 0 : -ETIMEDOUT;
+		}
+		if (errno == ECONNREFUSED) {
+			return 0; // ICMP port unreachable for an earlier datagram, the server may come back and retransmits cover it
+		}
+		DEBUG_LOG(CRITICAL) << "Receive failed : " << strerror(errno);
+		return -1;
+	}
+
+	for (int32_t i = 0; i < received; ++i) {
+		lengths[i] = messages[i].msg_len;
+		if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			DEBUG_LOG(CRITICAL) << "Dropping datagram larger than : " << static_cast<uint32_t>(MAX_DATAGRAM);
+			lengths[i] = 0;
+		}
+	}
+	return received;
+}
+
+/*
+ * Blocking mode over UDP only. Waits up to timeout seconds for datagrams and calls onRecord for every one that arrived.
+ * Blocks without our lock so that other callers can send meanwhile. Returns the number of datagrams, or as
+ * readDatagrams() when there were none.
+ */
+int32_t Connection::receiveDatagrams(uint32_t timeout, const std::function<void(uchar_t*, int32_t)>& onRecord) {
+	int32_t fd;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd == -1 || eventLoop || not isDatagram()) {
+			DEBUG_LOG(CRITICAL) << "Blocking datagram receive needs an open UDP socket not driven by the event loop";
+			return -1;
+		}
+		if (armReceiveTimeoutLocked(timeout) != 0) {
+			return -1;
+		}
+		fd = socketFd;
+		receiving = true;
+	}
+
+	uint32_t lengths[DATAGRAM_BATCH];
+	auto received = readDatagrams(fd, MSG_WAITFORONE, lengths);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		receiving = false;
+		if (lingeringFd == fd) {
+			close(fd); // Disconnected while we were blocked, whatever arrived belongs to calls already failed
+			lingeringFd = -1;
+			return -1;
+		}
+		for (int32_t i = 0; i < received; ++i) {
+			totalReceived += lengths[i];
+		}
+	}
+
+	for (int32_t i = 0; i < received; ++i) {
+		if (lengths[i]) {
+			onRecord(&recvStage[(size_t)i * MAX_DATAGRAM], lengths[i]);
+		}
+	}
+	return received;
+}
+
+void Connection::cork() {
+	std::lock_guard<std::mutex> lock(mutex);
+	corked = true;
+}
+
+int32_t Connection::uncork() {
+	std::lock_guard<std::mutex> lock(mutex);
+	corked = false;
+	if (datagramQueue.empty() || (eventLoop && eventLoop->requestFlush(socketFd))) {
+		return 0;
+	}
+	return (flushDatagramsLocked() < 0) ? -1 : 0;
+}
+
+int32_t Connection::flush() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return isDatagram() ? flushDatagramsLocked() : flushLocked();
+}
+
+// Sends queued datagrams, up to DATAGRAM_BATCH per sendmmsg. Returns the number still queued, or -1 if the socket failed.
+int32_t Connection::flushDatagramsLocked() {
+	if (socketFd == -1) {
+		return -1;
+	}
+	size_t sent = 0;
+	while (sent < datagramQueue.size()) {
+		struct mmsghdr messages[DATAGRAM_BATCH];
+		struct iovec vectors[DATAGRAM_BATCH];
+		uint32_t batch = 0;
+		memset(messages, 0, sizeof (messages));
+		for (; batch < DATAGRAM_BATCH && sent + batch < datagramQueue.size(); ++batch) {
+			auto& datagram = datagramQueue[sent + batch];
+			vectors[batch].iov_base = datagram.data();
+			vectors[batch].iov_len = datagram.size();
+			messages[batch].msg_hdr.msg_iov = &vectors[batch];
+			messages[batch].msg_hdr.msg_iovlen = 1;
+		}
+
+		auto done = sendmmsg(socketFd, messages, batch, MSG_NOSIGNAL);
+		if (done > 0) {
+			for (int32_t i = 0; i < done; ++i) {
+				totalSent += messages[i].msg_len;
+			}
+			sent += done;
+		} else if (done < 0 && errno == EINTR) {
+			continue;
+		} else if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (done < 0 && errno == ECONNREFUSED) {
+			++sent; // The server is not listening right now, the datagram is lost like on the wire and retransmitted later
+		} else {
+			error = errno;
+			DEBUG_LOG(CRITICAL) << "Send failure : " << strerror(error);
+			return -1;
+		}
+	}
+	datagramQueue.erase(datagramQueue.begin(), datagramQueue.begin() + sent);
+	return datagramQueue.size();
+}
+
+// Returns the number of bytes still queued, or -1 if the connection failed
+int32_t Connection::flushLocked() {
+	if (socketFd == -1) {
+		return -1;
+	}
+	while (sendQueueOffset < sendQueue.size()) {
+		auto written = ::send(socketFd, &sendQueue[sendQueueOffset], sendQueue.size() - sendQueueOffset, MSG_NOSIGNAL);
+		if (written > 0) {
+			sendQueueOffset += written;
+			totalSent += written;
+		} else if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			error = errno;
+			DEBUG_LOG(CRITICAL) << "Send failure : " << strerror(error);
+			return -1;
+		}
+	}
+	if (sendQueueOffset == sendQueue.size()) {
+		sendQueue.clear();
+		sendQueueOffset = 0;
+	}
+	return sendQueue.size() - sendQueueOffset;
+}
+
+// Moves up to capacity queued bytes into dst for a loop that writes on our behalf. Returns the number of bytes moved.
+size_t Connection::takeQueued(uchar_t* dst, size_t capacity) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (isDatagram()) {
+		// One datagram per write, a datagram socket never splits or joins them
+		if (datagramQueue.empty() || datagramQueue.front().size() > capacity) {
+			return 0;
+		}
+		size_t taken = datagramQueue.front().size();
+		memcpy(dst, datagramQueue.front().data(), taken);
+		datagramQueue.erase(datagramQueue.begin());
+		totalSent += taken;
+		return taken;
+	}
+	size_t taken = sendQueue.size() - sendQueueOffset;
+	if (taken > capacity) {
+		taken = capacity;
+	}
+	memcpy(dst, &sendQueue[sendQueueOffset], taken);
+	sendQueueOffset += taken;
+	totalSent += taken;
+	if (sendQueueOffset == sendQueue.size()) {
+		sendQueue.clear();
+		sendQueueOffset = 0;
+	}
+	return taken;
+}
+
+/*
+ * Non-blocking mode only. Takes bytes a loop already received on our socket, e.g. into a registered buffer, and calls
+ * onRecord for each record they complete. Records wholly inside bytes are handed out in place without copying.
+ */
+int32_t Connection::ingest(uchar_t* bytes, size_t length, const std::function<void(uchar_t*, int32_t)>& onRecord) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (socketFd == -1) {
+			return -1;
+		}
+		if (readerGeneration != connectGeneration) {
+			readerGeneration = connectGeneration;
+			recordReader.reset();
+		}
+		totalReceived += length;
+	}
+
+	if (isDatagram()) {
+		onRecord(bytes, length); // A read of a datagram socket returns exactly one datagram
+		return 1;
+	}
+
+	return recordReader.consume(bytes, length, onRecord);
+}
+
+/*
+ * Non-blocking mode only. Reads everything the socket has and calls onRecord for each complete RPC record, outside the
+ * context lock so that completions may send. Returns the number of records, or -1 once the connection is unusable.
+ */
+int32_t Connection::readRecords(const std::function<void(uchar_t*, int32_t)>& onRecord) {
+	int32_t records = 0;
+	bool drained = false;
+
+	while (isDatagram()) {
+		uint32_t lengths[DATAGRAM_BATCH];
+		int32_t received;
+		{
+			// Non-blocking, so the lock is only held for one recvmmsg
+			std::lock_guard<std::mutex> lock(mutex);
+			if (socketFd == -1) {
+				return -1;
+			}
+			received = readDatagrams(socketFd, MSG_DONTWAIT, lengths);
+			for (int32_t i = 0; i < received; ++i) {
+				totalReceived += lengths[i];
+			}
+		}
+		if (received <= 0) {
+			return (received < 0) ? -1 : records;
+		}
+		for (int32_t i = 0; i < received; ++i) {
+			if (lengths[i]) {
+				onRecord(&recvStage[(size_t)i * MAX_DATAGRAM], lengths[i]);
+			}
+		}
+		records += received;
+	}
+
+	while (not drained) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (socketFd == -1) {
+				return -1;
+			}
+			if (readerGeneration != connectGeneration) {
+				readerGeneration = connectGeneration;
+				recordReader.reset();
+			}
+			struct iovec vectors[2];
+			auto count = recordReader.space(vectors);
+			size_t space = vectors[0].iov_len + ((count > 1) ? vectors[1].iov_len : 0);
+			auto received = readv(socketFd, vectors, count);
+			if (received > 0) {
+				recordReader.produced(received);
+				totalReceived += received;
+				// A short read emptied the socket, bytes arriving later raise a new edge
+				drained = ((size_t)received < space);
+			} else if (received == 0) {
+				DEBUG_LOG(CRITICAL) << "Connection closed by server : " << server << " at port : " << port;
+				return -1;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				drained = true;
+			} else if (errno != EINTR) {
+				error = errno;
+				DEBUG_LOG(CRITICAL) << "Receive failed : " << strerror(error);
+				return -1;
+			}
+		}
+
+		auto completed = recordReader.drain(onRecord);
+		if (completed < 0) {
+			return -1;
+		}
+		records += completed;
+	}
+	return records;
+}
+
+void Connection::printStatus() {
+	if (socketFd < 0 || connectError) {
+		DEBUG_LOG(TRACE) << "Not connected to : " << server << " at port : " << port;
+	} else {
+		std::ostringstream oss;
+		oss << timem->tm_hour << "::" << timem->tm_min << "::" << timem->tm_sec;
+		DEBUG_LOG(TRACE) << "Connected to : " << server << " at port : " << port << "with socketFd : " << socketFd << " at time :" << oss.str();
+	}
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "logging/Logging.hpp"
+#include "descriptiveenum/DescriptiveEnum.hpp"
+#include "types.hpp"
+#include "GenericEnums.hpp"
+#include "RecordReader.hpp"
+#include "RetransmitPolicy.hpp"
+#include "MpscQueue.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+class RpcEngine;
+class EventLoop;
+
+/*
+ * One socket to one RPC program on a server. A Context keeps a connection per program open across calls, so a call
+ * only pays for connection setup the first time, or after the connection failed.
+ *
+ * Over TCP requests and replies are record marked, and replies are split off the stream by a RecordReader that takes
+ * as much as the socket has per read. Requests are sent as one fragment, or split into fragments of a set size. Over UDP every RPC message is one datagram without the record mark,
+ * datagrams are sent with sendmmsg and received with recvmmsg in batches of up to DATAGRAM_BATCH, and lost requests are
+ * retransmitted by the RpcEngine.
+ *
+ * A record may be handed over as a list of iovecs, e.g. a header region starting with the record mark followed by caller
+ * owned payload buffers. They are written with sendmsg straight from where they are, and only what the socket does not
+ * take at once, or what must wait in a queue, is copied.
+ *
+ * A blocking connection may be full duplex instead: a reader thread of its own feeds every reply to the RpcEngine, and
+ * senders go through a lock-free submission queue. Whoever finds nobody writing sends its record in place and then
+ * what others queued meanwhile, in one sendmsg or sendmmsg, while those others return as soon as their copy is queued.
+ */
+class Connection : public std::enable_shared_from_this<Connection> {
+	public:
+		constexpr static uint32_t DATAGRAM_BATCH = 16;
+		constexpr static uint32_t MAX_DATAGRAM = 64 * 1024;
+		constexpr static uint32_t MIN_FRAGMENT_SIZE = 1024;
+		constexpr static uint32_t CONNECT_TIMEOUT = 5;
+
+		Connection(const std::string& server, int32_t port, uint32_t inflightDepth, const std::shared_ptr<EventLoop>& loop,
+					GenericEnums::PROTOCOL_TYPE protocol = GenericEnums::PROTOCOL_TYPE::IPPROTO_TCP) : server(server), port(port), protocol(protocol), peerKnown(false), error(0), connectError(0), socketFd(-1), totalSent(0UL), totalReceived(0UL), connectTime(0), disconnectTime(0), timem(nullptr), inflightDepth(inflightDepth), fragmentSize(0), eventLoop(loop), rcvTimeout(0), connectGeneration(0UL), loopRegistration(0), duplex(false), fullDuplex(false), writing(false), sendQueueOffset(0), corked(false), readerGeneration(0UL), receiving(false), lingeringFd(-1) {}
+		~Connection();
+
+		template<typename T>
+		Connection(T&&) = delete;
+		template<typename T>
+		Connection& operator=(T&&) = delete;
+
+		static int32_t resolve(const std::string& server, struct sockaddr_in& address);
+		static int32_t connectAll(const std::vector<std::shared_ptr<Connection>>& connections, uint32_t timeout);
+
+		// Address to connect to, so that reconnects never resolve the server name again. Resolved on first connect if unset.
+		void setPeer(const struct sockaddr_in& address);
+		int32_t connect(uint32_t timeout = CONNECT_TIMEOUT);
+		int32_t startConnect(int32_t& fd);
+		int32_t finishConnect(int32_t fd, bool writable);
+		void disconnect();
+		void abandon(uint32_t registration);
+		int32_t send(uchar_t* wireBytes, int32_t size, bool trace = false);
+		int32_t send(const struct iovec* vectors, int32_t count, bool trace = false);
+		int32_t receiveRecords(uint32_t timeout, const std::function<void(uchar_t*, int32_t)>& onRecord);
+		int32_t receiveDatagrams(uint32_t timeout, const std::function<void(uchar_t*, int32_t)>& onRecord);
+		void printStatus();
+
+		// While corked, datagrams are only queued. uncork() sends everything queued with as few sendmmsg calls as possible.
+		// A corked burst must fit the in-flight depth, a submit waiting for a free slot would wait on unsent calls.
+		void cork();
+		int32_t uncork();
+
+		bool isDatagram() const {
+			return protocol == GenericEnums::PROTOCOL_TYPE::IPPROTO_UDP;
+		}
+
+		bool isConnected() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return socketFd != -1;
+		}
+
+		int32_t getPort() const {
+			return port;
+		}
+
+		std::shared_ptr<RpcEngine> getRpcEngine();
+		void setInflightDepth(uint32_t depth);
+		// Records longer than size are sent over TCP in fragments of size bytes, 0 sends every record as one fragment
+		void setFragmentSize(uint32_t size);
+		// Used by the RpcEngine, applies if set before its first call
+		void setRetransmitPolicy(const RetransmitPolicy& policy);
+		// Full duplex from the next socket on, if it is not driven by an event loop. Stays so once the reader runs.
+		void setDuplex(bool on);
+
+		// Replies are fed to the RpcEngine by an event loop or the reader thread, callers only wait for them
+		bool isDriven() const {
+			return fullDuplex || getEventLoop();
+		}
+		// True on the thread feeding replies in, which must never wait for one
+		bool onDriverThread() const;
+
+		// Sockets opened after this are non-blocking and serviced by the loop. Blocking receives are then unavailable.
+		void setEventLoop(const std::shared_ptr<EventLoop>& loop);
+		std::shared_ptr<EventLoop> getEventLoop() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return eventLoop;
+		}
+		int32_t readRecords(const std::function<void(uchar_t*, int32_t)>& onRecord);
+		int32_t ingest(uchar_t* bytes, size_t length, const std::function<void(uchar_t*, int32_t)>& onRecord);
+		int32_t flush();
+		size_t takeQueued(uchar_t* dst, size_t capacity);
+
+	private:
+		int32_t openSocketLocked(int32_t& fd);
+		int32_t connectedLocked(int32_t fd, bool writable);
+		int32_t adoptSocketLocked(int32_t fd);
+		int32_t sendLocked(const struct iovec* vectors, int32_t count, size_t size, bool trace);
+		int32_t sendDuplex(const struct iovec* vectors, int32_t count, size_t size, bool trace);
+		void writeSubmissions();
+		void stepDown();
+		int32_t waitReadable(uint32_t timeoutMs);
+		static void readLoop(std::weak_ptr<Connection> connection);
+		int32_t flushLocked();
+		int32_t flushDatagramsLocked();
+		int32_t sendDatagramLocked(const struct iovec* vectors, int32_t count);
+		int32_t sendStreamLocked(const struct iovec* vectors, int32_t count, size_t size);
+		int32_t armReceiveTimeoutLocked(uint32_t timeout);
+		int32_t readDatagrams(int32_t fd, int32_t flags, uint32_t* lengths);
+
+		std::string server;
+		const int32_t port;
+		const GenericEnums::PROTOCOL_TYPE protocol;
+		struct sockaddr_in peer;
+		bool peerKnown;
+		int32_t error;
+		int32_t connectError;
+		int32_t socketFd;
+		uint64_t totalSent;
+		uint64_t totalReceived;
+		time_t connectTime;
+		time_t disconnectTime;
+		struct tm *timem;
+		mutable std::mutex mutex;
+		uint32_t inflightDepth;
+		uint32_t fragmentSize;
+		RetransmitPolicy retransmitPolicy;
+		std::shared_ptr<RpcEngine> rpcEngine; // Created on first use, matches replies on this socket to their callers by xid
+		std::shared_ptr<EventLoop> eventLoop;
+		uint32_t rcvTimeout; // Currently armed SO_RCVTIMEO, only reprogrammed when a caller asks for a different one
+		uint64_t connectGeneration;
+		uint32_t loopRegistration; // Event loop registration of the current socket
+
+		// Full duplex only. A record queued by a sender while another was writing, record mark included.
+		struct Submission {
+			Submission* next;
+			std::vector<uchar_t> bytes;
+		};
+		bool duplex; // Asked for, takes effect with the next socket
+		std::atomic<bool> fullDuplex; // The reader runs and sends go through submissions
+		std::atomic<bool> writing; // Some sender is the writer
+		MpscQueue<Submission> submissions;
+		std::thread reader;
+
+		// Non-blocking mode only. Bytes the socket would not take yet, and bytes received but not yet parsed into records.
+		std::vector<uchar_t> sendQueue;
+		size_t sendQueueOffset;
+		std::vector<std::vector<uchar_t>> datagramQueue; // UDP only, one entry per datagram
+		bool corked;
+		// Only touched by the thread running the event loop, or by the reaper in blocking mode
+		RecordReader recordReader; // TCP only
+		std::vector<uchar_t> recvStage; // UDP only, one recvmmsg batch
+		uint64_t readerGeneration; // Connection the buffered bytes came from, stale bytes are dropped after a reconnect
+		bool receiving; // A blocking receiver waits on the socket without our lock
+		int32_t lingeringFd; // Socket disconnected under that receiver, closed by it when it returns
+};
+
+using Connection_p = std::shared_ptr<Connection>;
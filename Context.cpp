@@ -2,297 +2,467 @@
 #include "Utils.hpp"
 #include "xdr.hpp"
 #include "rpc.hpp"
+#include "RpcEngine.hpp"
+#include "EventLoop.hpp"
+#include "PortMapperContext.hpp"
+#include "NfsTypes.hpp"
+#include "ReadEngine.hpp"
+#include "WriteEngine.hpp"
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <iomanip>
 #include <netdb.h>
+#include <thread>
 
-int32_t Context::connect() {
-	struct addrinfo hints, *info;
-	std::string service = std::to_string(port);
+Context::~Context() {
+	disconnect();
+}
+
+// Every connection opened so far, taken under the lock so that callers can work on them without it
+std::vector<Connection_p> Context::openedConnections() const {
+	std::vector<Connection_p> connections;
 	std::lock_guard<std::mutex> lock(mutex);
+	if (portMapperConnection) {
+		connections.push_back(portMapperConnection);
+	}
+	if (mountConnection) {
+		connections.push_back(mountConnection);
+	}
+	for (auto& connection : nfsConnections) {
+		if (connection) {
+			connections.push_back(connection);
+		}
+	}
+	return connections;
+}
 
-    if (socketFd != -1) {
-        DEBUG_LOG(CRITICAL) << "Attempt to reconnect already open socket with fd :" << socketFd;
-        return -1;
-    }
-
-	memset(&hints, 0, sizeof (hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM; /* want TCP */
-
-
-    error = getaddrinfo(server.c_str(), service.c_str(), &hints, &info);
-    if (error != 0) {
-        DEBUG_LOG(CRITICAL) << "getaddrinfo failed : " << gai_strerror(error);
-        return error;
-    }
-
-    socketFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketFd < 0) {
-        DEBUG_LOG(CRITICAL) << "Internal error, failed to open socket of AF_INET and type SOCK_STREAM";
-        return -1;
-    }
-
-    connectError = error = ::connect(socketFd, info->ai_addr, info->ai_addrlen);
-    if (error != 0) {
-        DEBUG_LOG(CRITICAL) << "Failed to connect to server : " << server << " at port : " << port << " with error : " << strerror(errno);
-    }
-
-	uint32_t timeout = 5;
-	struct timeval tv;
-	tv.tv_usec = 0;
-	tv.tv_sec = timeout;
-	if (timeout <= 0) {
-		DEBUG_LOG(CRITICAL) << "Too big timeout for receive on socket";
-	}
-	error = setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
-	if (error != 0) {
-		error = errno;
-		DEBUG_LOG(CRITICAL) << "Receive timeout set failure : " << strerror(error);
-		return -1;
+void Context::disconnect() {
+	for (auto& connection : openedConnections()) {
+		connection->disconnect();
 	}
+}
 
-    freeaddrinfo(info);
-	time(&connectTime);
-	timem = localtime(&connectTime);
-    DASSERT(!error);
+void Context::printStatus() {
+	for (auto& connection : openedConnections()) {
+		connection->printStatus();
+	}
+}
 
-	return 0;
+void Context::setEventLoop(const std::shared_ptr<EventLoop>& loop) {
+	std::lock_guard<std::mutex> lock(mutex);
+	eventLoop = loop;
 }
 
-int32_t Context::connect(int32_t newPort) {
-	disconnect();
-	port = newPort;
-	DEBUG_LOG(CRITICAL) << "Connecting to port : " << newPort;
-	return connect();
+void Context::setInflightDepth(uint32_t depth) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inflightDepth = depth;
+	}
+	for (auto& connection : openedConnections()) {
+		connection->setInflightDepth(depth);
+	}
 }
 
-void Context::disconnect() {
+void Context::setRetransmitPolicy(const RetransmitPolicy& policy) {
 	std::lock_guard<std::mutex> lock(mutex);
-	if (socketFd > 0) {
-		close(socketFd);
-		socketFd = -1;
-		totalSent = 0UL;
-		totalReceived = 0UL;
-		time(&disconnectTime);
-		timem = localtime(&disconnectTime);
-	}
+	retransmitPolicy = policy;
 }
 
-int32_t Context::send(uchar_t* wireBytes, int32_t size, bool trace) {
-	if (size == 0) {
-		DEBUG_LOG(CRITICAL) << "Empty send";
-		return 0;
-	}
-	auto pending = size;
+void Context::setReadPolicy(const ReadPolicy& policy) {
 	std::lock_guard<std::mutex> lock(mutex);
-	if (socketFd == -1) {
-		DEBUG_LOG(CRITICAL) << "Bad socket";
-		return -1;
-	}
+	readPolicy = policy;
+}
 
-	if (trace) {
-		DEBUG_LOG(CRITICAL) << "Socket fd : " << socketFd;
-		DEBUG_LOG(CRITICAL) << "Sending message of length : " << size;
-		std::ostringstream oss;
-		for (int i = 0; i < size; ++i) {
-			oss << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)wireBytes[i] << " ";
-		}
-		DEBUG_LOG(CRITICAL) << oss.str();
-	}
-	while (pending) {
-		auto written = ::send(socketFd, &wireBytes[size-pending], pending, 0);
-		if (written >= 0) {
-			DASSERT(written <= pending);
-			pending -= written;
-		} else {
-			error = errno;
-			DEBUG_LOG(CRITICAL) << "Send failure with written : " << written << ": " << strerror(error);
-			return -1;
-		}
+ReadPolicy Context::getReadPolicy() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return readPolicy;
+}
+
+void Context::setWritePolicy(const WritePolicy& policy) {
+	std::lock_guard<std::mutex> lock(mutex);
+	writePolicy = policy;
+	if (policy.gather && not writeFlusher) {
+		writeFlusher = std::make_shared<WriteFlusher>();
 	}
-	totalSent += (size - pending);
-	return pending;
 }
 
-int32_t Context::receive(uint32_t timeout, uchar_t* wireBytes, int32_t& size, bool trace) {
+WritePolicy Context::getWritePolicy() const {
 	std::lock_guard<std::mutex> lock(mutex);
-	if (socketFd == -1) {
-		DEBUG_LOG(CRITICAL) << "Bad socket";
-		return -1;
+	return writePolicy;
+}
+
+std::shared_ptr<WriteFlusher> Context::getWriteFlusher() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return writeFlusher;
+}
+
+void Context::setBlockCache(const std::shared_ptr<BlockCache>& cache) {
+	std::lock_guard<std::mutex> lock(mutex);
+	blockCache = cache;
+}
+
+std::shared_ptr<BlockCache> Context::getBlockCache() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return blockCache;
+}
+
+void Context::setFragmentSize(uint32_t size) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		fragmentSize = size;
 	}
+	for (auto& connection : openedConnections()) {
+		connection->setFragmentSize(size);
+	}
+}
 
-	struct timeval tv;
-	tv.tv_usec = 0;
-	tv.tv_sec = timeout;
-	if (timeout <= 0) {
-		DEBUG_LOG(CRITICAL) << "Too big timeout for receive on socket";
+void Context::setDuplex(bool on) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		duplex = on;
 	}
-	error = setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
-	if (error != 0) {
-		error = errno;
-		DEBUG_LOG(CRITICAL) << "Receive timeout set failure : " << strerror(error);
-		return -1;
+	for (auto& connection : openedConnections()) {
+		connection->setDuplex(on);
 	}
+}
 
-	int32_t pending = 4;
-	size = pending;
-	bool rpcSizeHeaderReceived = false;
+int32_t Context::setNconnect(uint32_t count, SHARDING how) {
+	if (count == 0 || count > MAX_NCONNECT || how == SHARDING::None || how == SHARDING::UNKNOWN) {
+		DEBUG_LOG(CRITICAL) << "Unsupported nconnect : " << count << " with sharding : " << SHARDINGImage::printEnum(how);
+		return -1;
+	}
 
-	while (pending) {
-		error = recv(socketFd, &wireBytes[size-pending], pending, 0);
-		if (error < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				continue;
-			} else if (error < 0) {
-				error = errno;
-				DEBUG_LOG(CRITICAL) << "Receive failed : " << strerror(error);
-				return -1;
-			}
-		} else {
-//			DEBUG_LOG(CRITICAL) << "Read : " << error << "bytes";
-			totalReceived += error;
-			pending -= error;
-			if (not rpcSizeHeaderReceived && pending == 0) {
-				rpcSizeHeaderReceived = true;
-				uint32_t recvOffset = 0;
-				if (trace) {
-					DEBUG_LOG(CRITICAL) << "Received message header : " << size;
-					std::ostringstream oss;
-					for (int i = 0; i < size; ++i) {
-						oss << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)wireBytes[i] << " ";
-					}
-					DEBUG_LOG(CRITICAL) << oss.str();
-				}
-				xdr_strip_lastFragment(wireBytes);
-				size = pending = xdr_decode_u32(wireBytes, recvOffset);
-//				DEBUG_LOG(CRITICAL) << "Expecting response of size : " << size;
+	std::vector<Connection_p> dropped;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto shard = count; shard < nconnect; ++shard) {
+			if (nfsConnections[shard]) {
+				dropped.push_back(nfsConnections[shard]);
+				nfsConnections[shard].reset();
 			}
 		}
+		nconnect = count;
+		sharding = how;
 	}
-
-	if (trace) {
-		DEBUG_LOG(CRITICAL) << "Socket fd : " << socketFd;
-		DEBUG_LOG(CRITICAL) << "Received message of length : " << size;
-		std::ostringstream oss;
-		for (int i = 0; i < size; ++i) {
-			oss << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)wireBytes[i] << " ";
-		}
-		DEBUG_LOG(CRITICAL) << oss.str();
+	for (auto& connection : dropped) {
+		connection->disconnect();
 	}
-	return pending;
+	return 0;
 }
 
-void Context::printStatus() {
-	if (socketFd < 0 || connectError) {
-		DEBUG_LOG(TRACE) << "Not connected to : " << server << " at port : " << port;
-	} else {
-		std::ostringstream oss;
-		oss << timem->tm_hour << "::" << timem->tm_min << "::" << timem->tm_sec;
-		DEBUG_LOG(TRACE) << "Connected to : " << server << " at port : " << port << "with socketFd : " << socketFd << " at time :" << oss.str();
+// FNV-1a with a final mix, the low bits of plain FNV-1a depend on too few input bits to pick a shard by modulo
+static uint32_t hashHandle(const handle& fileHandle) {
+	uint32_t hash = 2166136261u;
+	for (auto byte : fileHandle) {
+		hash ^= byte;
+		hash *= 16777619u;
 	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
 }
 
-int32_t Context::connectPortMapperPort(uint32_t timeout) {
-	if (port != portMapperPort) {
-		port = portMapperPort;
-		connect(portMapperPort);
+int32_t Context::resolve() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (resolved) {
+		return 0;
+	}
+	if (Connection::resolve(server, address) != 0) {
+		return -1;
 	}
+	resolved = true;
 	return 0;
 }
 
-int32_t Context::connectMountPort(uint32_t timeout) {
-	if (mountPort == -1) {
-		DEBUG_LOG(CRITICAL) << "Mount port obtained : " << mountPort;
+/*
+ * Called with the lock held. Returns the connection kept in slot for a program at port, making it if there is none yet.
+ * A kept one for another port is replaced and handed back in moved, to be disconnected outside the lock.
+ */
+Connection_p Context::slotConnectionLocked(Connection_p& connection, int32_t port, Connection_p& moved) {
+	if (connection && connection->getPort() != port) {
+		moved = connection;
+		connection.reset();
 	}
-	connect(mountPort);
-	return 0;
+	if (not connection) {
+		connection = std::make_shared<Connection>(server, port, inflightDepth, eventLoop, protocol);
+		connection->setFragmentSize(fragmentSize);
+		connection->setRetransmitPolicy(retransmitPolicy);
+		connection->setDuplex(duplex);
+		if (resolved) {
+			connection->setPeer(address);
+		}
+		DEBUG_LOG(CRITICAL) << "Connecting to port : " << port << " over " << GenericEnums::PROTOCOL_TYPEImage::printEnum(protocol);
+	}
+	return connection;
 }
 
-int32_t Context::connectNfsPort(uint32_t timeout) {
-	if (nfsPort == -1) {
-		DEBUG_LOG(CRITICAL) << "NFS port obtained : " << nfsPort;
+/*
+ * Returns the open connection for the program, reusing the one already kept for it. A new one is only made when the
+ * program moved to another port, and a kept one is only reopened after it failed. The connection slot is chosen under
+ * the lock by pick, which must not block.
+ */
+Connection_p Context::connectProgram(const std::function<Connection_p&()>& pick, const int32_t& port, const char* program, uint32_t timeout) {
+	if (resolve() != 0) {
+		return {};
 	}
-	connect(nfsPort);
-	return 0;
+	Connection_p moved;
+	Connection_p current;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (port == -1) {
+			DEBUG_LOG(CRITICAL) << program << " port not obtained yet";
+			return {};
+		}
+		current = slotConnectionLocked(pick(), port, moved);
+	}
+
+	if (moved) {
+		moved->disconnect();
+	}
+	if (current->connect(timeout) != 0) {
+		return {};
+	}
+	return current;
 }
 
-#define LOOKUP_RESPONSE_SIZE	1024
+std::vector<Connection_p> Context::prepareConnections() {
+	std::vector<Connection_p> connections;
+	std::vector<Connection_p> moved(MAX_NCONNECT + 2);
+	if (resolve() != 0) {
+		return connections;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		connections.push_back(slotConnectionLocked(portMapperConnection, portMapperPort, moved[0]));
+		if (mountPort != -1) {
+			connections.push_back(slotConnectionLocked(mountConnection, mountPort, moved[1]));
+		}
+		for (uint32_t shard = 0; nfsPort != -1 && shard < nconnect; ++shard) {
+			connections.push_back(slotConnectionLocked(nfsConnections[shard], nfsPort, moved[shard + 2]));
+		}
+	}
+	for (auto& connection : moved) {
+		if (connection) {
+			connection->disconnect();
+		}
+	}
+	return connections;
+}
 
-const handle_p Context::Inode::lookup(Context_p& context, uint32_t timeout, const iName& child, const Inode_p& parent, GenericEnums::AUTH_TYPE authType) {
-	context->connectNfsPort(timeout);	
+Connection_p Context::connectPortMapperPort(uint32_t timeout) {
+	return connectProgram([this]() -> Connection_p& { return portMapperConnection; }, portMapperPort, "Port mapper", timeout);
+}
 
-	if (not parent->selfHandle) {
-		
+Connection_p Context::connectMountPort(uint32_t timeout) {
+	return connectProgram([this]() -> Connection_p& { return mountConnection; }, mountPort, "Mount", timeout);
+}
+
+/*
+ * With nconnect above one, calls are spread over that many connections. Round robin balances load best, sharding by
+ * file handle keeps all calls on one file in order on one connection. Calls without a handle always go round robin.
+ */
+Connection_p Context::connectNfsPort(uint32_t timeout, const handle* fileHandle) {
+	return connectProgram([this, fileHandle]() -> Connection_p& {
+		uint32_t shard;
+		if (sharding == SHARDING::HANDLE_HASH && fileHandle) {
+			shard = hashHandle(*fileHandle) % nconnect;
+		} else {
+			shard = nextShard++ % nconnect;
+		}
+		return nfsConnections[shard];
+	}, nfsPort, "NFS", timeout);
+}
+
+uint32_t Context::getLoad(uint64_t& latencyNs) const {
+	uint32_t outstanding = 0;
+	uint64_t latencySum = 0UL;
+	uint32_t sampled = 0;
+	for (auto& connection : openedConnections()) {
+		auto engine = connection->getRpcEngine();
+		outstanding += engine->getOutstanding();
+		auto latency = engine->getLatency();
+		if (latency) {
+			latencySum += latency;
+			++sampled;
+		}
 	}
+	latencyNs = sampled ? latencySum / sampled : 0UL;
+	return outstanding;
+}
 
+int32_t ServerContexts::bringUp(uint32_t timeout) {
+	std::vector<Context_p> contexts;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& server : sContexts) {
+			contexts.push_back(server->context);
+		}
+	}
 
-	handle_p lHandle;
+	// Port mappers first, the MOUNT and NFS ports are only known once they answered
+	std::vector<Connection_p> connections;
+	std::vector<Connection_p> portMappers;
+	for (auto& context : contexts) {
+		auto prepared = context->prepareConnections();
+		portMappers.push_back(prepared.empty() ? nullptr : prepared.front());
+		connections.insert(connections.end(), prepared.begin(), prepared.end());
+	}
+	Connection::connectAll(connections, timeout);
 
-	uchar_t* wireRequest = new uchar_t [GenericEnums::MOUNT_REQUEST_SIZE];
-	uint64_t requestSize = 0UL;
-	if (!wireRequest) {
-		MEM_ALLOC_FAILURE("Failed to allocate memory in ", __FUNCTION__);
-		return {};
+	// One thread per server, so that a slow server does not hold up the others. Unreachable ones are not asked again.
+	std::vector<std::thread> askers;
+	for (size_t server = 0; server < contexts.size(); ++server) {
+		if (not portMappers[server] || not portMappers[server]->isConnected()) {
+			continue;
+		}
+		auto& context = contexts[server];
+		askers.emplace_back([&context, timeout]() {
+			PortMapperContext portMapper(context, GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION2, GenericEnums::AUTH_TYPE::AUTH_SYS);
+			if (context->getMountPort() == -1) {
+				context->setMountPort(portMapper.getMountPort(timeout));
+			}
+			if (context->getNfsPort() == -1) {
+				context->setNfsPort(portMapper.getNfsPort(timeout));
+			}
+		});
+	}
+	for (auto& asker : askers) {
+		asker.join();
 	}
 
-	ScopedMemoryHandler mainRequest(wireRequest);
+	connections.clear();
+	std::vector<size_t> firstOf; // Index of each server's first connection
+	for (auto& context : contexts) {
+		firstOf.push_back(connections.size());
+		if (context->getMountPort() == -1 || context->getNfsPort() == -1) {
+			continue; // Not reachable, or its port mapper knew neither
+		}
+		auto prepared = context->prepareConnections();
+		connections.insert(connections.end(), prepared.begin(), prepared.end());
+	}
+	firstOf.push_back(connections.size());
+	Connection::connectAll(connections, timeout);
+
+	int32_t up = 0;
+	for (size_t server = 0; server < contexts.size(); ++server) {
+		bool complete = contexts[server]->getMountPort() != -1 && contexts[server]->getNfsPort() != -1;
+		for (auto i = firstOf[server]; complete && i < firstOf[server + 1]; ++i) {
+			complete = connections[i]->isConnected();
+		}
+		if (complete) {
+			++up;
+		}
+	}
+	DEBUG_LOG(CRITICAL) << up << " of " << contexts.size() << " servers brought up";
+	return up;
+}
 
-	uint32_t xid = (uint32_t)getMonotonic(0UL);
+int32_t ServerContexts::setStrategy(GetContextStrategy how, uint32_t index) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (how == GetContextStrategy::None || how == GetContextStrategy::UNKNOWN || (how == GetContextStrategy::Fixed && index >= sContexts.size())) {
+		DEBUG_LOG(CRITICAL) << "Unsupported context strategy : " << GetContextStrategyImage::printEnum(how) << " with index : " << index;
+		return -1;
+	}
+	strategy = how;
+	fixedIndex = index;
+	return 0;
+}
 
-	requestSize = RPC::makeRPC(xid, GenericEnums::RPCTYPE::CALL, GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, wireRequest);
+// Called with the lock held. Load counts RPCs in flight plus callers holding the context that may be about to send.
+uint64_t ServerContexts::loadOf(const ServerHold& server, uint64_t& latencyNs) const {
+	return server.context->getLoad(latencyNs) + server.usageCount;
+}
 
-	requestSize += xdr_encode_u32(&wireRequest[requestSize], static_cast<uint32_t>(NFSPROG::NFSPROC3_LOOKUP));
+/*
+ * Called with the lock held. Cost is (load + 1) * latency, so a slow server is only picked once it is proportionally
+ * less busy. A server without replies yet borrows the other's latency and is compared on load alone.
+ */
+size_t ServerContexts::pickLessLoaded(size_t first, size_t second) const {
+	uint64_t firstLatency, secondLatency;
+	auto firstLoad = loadOf(*sContexts[first], firstLatency);
+	auto secondLoad = loadOf(*sContexts[second], secondLatency);
+	if (not firstLatency) {
+		firstLatency = secondLatency;
+	}
+	if (not secondLatency) {
+		secondLatency = firstLatency;
+	}
+	if ((firstLoad + 1) * (firstLatency + 1) <= (secondLoad + 1) * (secondLatency + 1)) {
+		return first;
+	}
+	return second;
+}
 
-	uchar_t* wireCredRequest = new uchar_t [GenericEnums::CRED_REQUEST_SIZE];
-	uint64_t credRequestSize = 0UL;
-	if (!wireCredRequest) {
-		MEM_ALLOC_FAILURE("Failed to allocate credentials memory in ", __FUNCTION__);
-		return lHandle;
+Context_p ServerContexts::selectContext(int32_t& index) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (sContexts.empty()) {
+		index = -1;
+		return {};
 	}
 
-	ScopedMemoryHandler credRequest(wireCredRequest);
+	size_t count = sContexts.size();
+	size_t chosen = 0;
+	switch (strategy) {
+		case GetContextStrategy::Random:
+			chosen = getRandomNumber(0) % count;
+			break;
+		case GetContextStrategy::Fixed:
+			chosen = fixedIndex;
+			break;
+		case GetContextStrategy::PowerOfTwo:
+			if (count > 1) {
+				size_t first = getRandomNumber(0) % count;
+				size_t second = getRandomNumber(0) % (count - 1);
+				if (second >= first) {
+					++second; // Two distinct servers
+				}
+				chosen = pickLessLoaded(first, second);
+			}
+			break;
+		default:
+			chosen = nextIndex++ % count;
+			break;
+	}
 
-	if (authType == GenericEnums::AUTH_TYPE::AUTH_SYS) {
+	ServerHold& server = *sContexts[chosen];
+	DASSERT(server.usageCount >= 0);
+	++server.usageCount;
+	index = chosen;
+	return server.context;
+}
 
-		auto credSize = RPC::addAuthSys(wireCredRequest);
+const handle_p Context::Inode::lookup(Context_p& context, uint32_t timeout, const iName& child, const Inode_p& parent, GenericEnums::AUTH_TYPE authType) {
+	auto connection = context->connectNfsPort(timeout, parent->selfHandle.get());
+	if (not connection) {
+		return {};
+	}
 
-		memcpy(&wireRequest[requestSize], wireCredRequest, credSize);
-		requestSize += credSize;
-	} else {
-		DEBUG_LOG(CRITICAL) << "Auth type not supported : " << GenericEnums::AUTH_TYPEImage::printEnum(authType);
-		return lHandle;
+	if (not parent->selfHandle) {
+		
 	}
 
-	requestSize += xdr_encode_nBytes(&wireRequest[requestSize], *(parent->selfHandle));
-	requestSize += xdr_encode_string(&wireRequest[requestSize], child);
-	requestSize += xdr_encode_align(&wireRequest[requestSize], requestSize, sizeof(uint32_t));
 
-	xdr_encode_u32(&wireRequest[0], requestSize-sizeof(uint32_t)); // Subtract the length of the first uint32_t containing LAST_FRAGMENT
-	xdr_encode_lastFragment(wireRequest);
+	handle_p lHandle;
 
-	context->send(wireRequest, requestSize);
+	nfs3::LOOKUP3args args;
+	args.what.dir.data = *(parent->selfHandle);
+	args.what.name = child;
 
-	uchar_t* wireResponse = new uchar_t [LOOKUP_RESPONSE_SIZE];
-	int32_t responseSize = 0;
-	if (!wireResponse) {
-		MEM_ALLOC_FAILURE("Failed to allocate memory to receive LOOKUP ", __FUNCTION__);
+	RPC::Procedure lookup = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(NFSPROG::NFSPROC3_LOOKUP), "LOOKUP"};
+	nfs3::LOOKUP3res result;
+	if (RPC::callRPC(connection, timeout, lookup, args, result) != 0) {
 		return lHandle;
 	}
-	context->receive(timeout, wireResponse, responseSize, true);
-
-	uchar_t* payload = RPC::parseAndStripRPC(wireResponse, responseSize, xid);	
-
-	uint32_t payloadOffset = 0;
-	NFSPROGERR rpcResult = static_cast<NFSPROGERR>(xdr_decode_u32(payload, payloadOffset));
 
+	NFSPROGERR rpcResult = static_cast<NFSPROGERR>(result.status);
 	if (rpcResult == NFSPROGERR::NFS3_OK) {
-		handle childHandle;
-		xdr_decode_nBytes(payload, childHandle, 64, payloadOffset);
-		printHandle("Child handle for : " + child, childHandle);
+		printHandle("Child handle for : " + child, result.ok.object.data);
+		lHandle = std::make_shared<handle>(std::move(result.ok.object.data));
 	} else {
 		DEBUG_LOG(CRITICAL) << "Lookup operation result : " << NFSPROGERRImage::printEnum(rpcResult);
 	}
@@ -385,3 +555,80 @@ const handle& Context::makeMkdirCall(uint32_t timeout, const std::string& dirNam
 	return getMountContext().getMountHandle();
 }
 *******************/
+
+// The engine kept for fileName in engines, made with the handle a LOOKUP in parent gives the first time the file is used
+template<typename Engine, typename Policy>
+static std::shared_ptr<Engine> engineOf(std::map<iName, std::shared_ptr<Engine>>& engines, std::mutex& mutex, Context_p& context, uint32_t timeout, const iName& fileName, const Context::Inode_p& parent, GenericEnums::AUTH_TYPE authType, const Policy& policy) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = engines.find(fileName);
+		if (found != engines.end()) {
+			return found->second;
+		}
+	}
+
+	auto file = Context::Inode::lookup(context, timeout, fileName, parent, authType);
+	if (not file) {
+		return {};
+	}
+	auto engine = std::make_shared<Engine>(context, file, authType, policy);
+	std::lock_guard<std::mutex> lock(mutex);
+	return engines.emplace(fileName, engine).first->second; // A racing first use may have made one already
+}
+
+int64_t Context::Inode::read(Context_p& context, uint32_t timeout, const iName& fileName, const Inode_p& parent, uint64_t offset, uint64_t size, uchar_t* dst, GenericEnums::AUTH_TYPE authType) {
+	auto reader = engineOf(parent->readers, parent->mutex, context, timeout, fileName, parent, authType, context->getReadPolicy());
+	if (not reader) {
+		return -1;
+	}
+	return reader->read(timeout, offset, size, dst);
+}
+
+int64_t Context::Inode::write(Context_p& context, uint32_t timeout, const iName& fileName, const Inode_p& parent, uint64_t offset, uint64_t size, const uchar_t* src, GenericEnums::AUTH_TYPE authType) {
+	auto writer = engineOf(parent->writers, parent->mutex, context, timeout, fileName, parent, authType, context->getWritePolicy());
+	if (not writer) {
+		return -1;
+	}
+	auto written = writer->write(timeout, offset, size, src);
+
+	std::shared_ptr<ReadEngine> reader;
+	{
+		std::lock_guard<std::mutex> lock(parent->mutex);
+		auto found = parent->readers.find(fileName);
+		if (found != parent->readers.end()) {
+			reader = found->second;
+		}
+	}
+	if (reader) {
+		reader->invalidate(); // Its readahead holds what the file had before this write
+	}
+	return written;
+}
+
+int32_t Context::Inode::commit(uint32_t timeout, const iName& fileName, const Inode_p& parent, uint64_t offset, uint64_t size) {
+	std::shared_ptr<WriteEngine> writer;
+	{
+		std::lock_guard<std::mutex> lock(parent->mutex);
+		auto found = parent->writers.find(fileName);
+		if (found == parent->writers.end()) {
+			return 0; // Nothing written
+		}
+		writer = found->second;
+	}
+	return writer->commit(timeout, offset, size);
+}
+
+int32_t Context::Inode::close(uint32_t timeout, const iName& fileName, const Inode_p& parent) {
+	std::shared_ptr<WriteEngine> writer;
+	{
+		std::lock_guard<std::mutex> lock(parent->mutex);
+		parent->readers.erase(fileName);
+		auto found = parent->writers.find(fileName);
+		if (found == parent->writers.end()) {
+			return 0;
+		}
+		writer = found->second;
+		parent->writers.erase(found);
+	}
+	return writer->close(timeout);
+}
@@ -4,6 +4,12 @@
 #include "descriptiveenum/DescriptiveEnum.hpp"
 #include "types.hpp"
 #include "GenericEnums.hpp"
+#include "Connection.hpp"
+#include "ReadPolicy.hpp"
+#include "WritePolicy.hpp"
+#include "CachePolicy.hpp"
+#include "BlockCache.hpp"
+#include "WriteFlusher.hpp"
 
 #include <assert.h>
 #include <vector>
@@ -16,27 +22,76 @@
 #include <memory>
 #include <time.h>
 #include <mutex>
+#include <atomic>
+#include <functional>
 
 using handle = std::vector<uchar_t>;
 using handle_p = std::shared_ptr<handle>;
 using iName = std::string;
 using iName_p = std::shared_ptr<std::string>;
 
+class ReadEngine;
+class WriteEngine;
+
 class Context : public std::enable_shared_from_this<Context> {
 	public:
-		Context(std::string& server, int32_t mapperPort) : server(server), portMapperPort(mapperPort), port(-1), error(0), returnValue(0), returnString(nullptr), socketFd(-1), totalSent(0UL), totalReceived(0UL), mountPort(-1), nfsPort(-1) {}
+		Context(std::string& server, int32_t mapperPort) : server(server), portMapperPort(mapperPort), returnValue(0), returnString(nullptr), mountPort(-1), nfsPort(-1), inflightDepth(DEFAULT_INFLIGHT_DEPTH), fragmentSize(0), duplex(false), resolved(false), nconnect(1), sharding(SHARDING::ROUND_ROBIN), nextShard(0), protocol(GenericEnums::PROTOCOL_TYPE::IPPROTO_TCP), nfsConnections(MAX_NCONNECT) {}
+		~Context();
+
+		constexpr static uint32_t DEFAULT_INFLIGHT_DEPTH = 16;
+		constexpr static uint32_t MAX_NCONNECT = 16; // Same limit as the nconnect mount option of Linux
+
+		DESC_CLASS_ENUM(SHARDING, uint32_t,
+			None,
+			ROUND_ROBIN,
+			HANDLE_HASH,
+			UNKNOWN
+		);
 
-		int32_t connect();
-		int32_t connect(int32_t port);
 		void disconnect();
-		int32_t send(uchar_t* wireBytes, int32_t size, bool trace = false);
-		int32_t receive(uint32_t timeout, uchar_t* wireBytes, int32_t& size, bool trace = false);
 		void printStatus();
 		uint32_t getPort(int32_t rcvTimeo, uint32_t program, uint32_t version);
 
-		int32_t connectPortMapperPort(uint32_t timeout);
-		int32_t connectNfsPort(uint32_t timeout);
-		int32_t connectMountPort(uint32_t timeout);
+		// Each returns the program's open connection, opening it only if there is none yet or the last one failed
+		Connection_p connectPortMapperPort(uint32_t timeout);
+		Connection_p connectNfsPort(uint32_t timeout, const handle* fileHandle = nullptr);
+		Connection_p connectMountPort(uint32_t timeout);
+
+		void setInflightDepth(uint32_t depth);
+		// Largest record fragment sent over TCP, 0 sends every record as one fragment
+		void setFragmentSize(uint32_t size);
+		// Number of NFS connections and how calls are spread over them
+		int32_t setNconnect(uint32_t count, SHARDING how);
+		// For connections opened after this
+		void setRetransmitPolicy(const RetransmitPolicy& policy);
+		// Connections get a reader thread and lock-free sends, see Connection
+		void setDuplex(bool on);
+		// For files read after this, see ReadEngine
+		void setReadPolicy(const ReadPolicy& policy);
+		ReadPolicy getReadPolicy() const;
+		// For files written after this, see WriteEngine. A policy that gathers gets the context a WriteFlusher.
+		void setWritePolicy(const WritePolicy& policy);
+		WritePolicy getWritePolicy() const;
+		// Thread sending the aged dirty ranges of the files written through this context, none until a policy gathers
+		std::shared_ptr<WriteFlusher> getWriteFlusher() const;
+		// Cache the files read after this keep their data in, none if empty. One cache may serve several contexts.
+		void setBlockCache(const std::shared_ptr<BlockCache>& cache);
+		std::shared_ptr<BlockCache> getBlockCache() const;
+		// RPCs in flight over all connections, and the mean of their recent reply latencies (0 until a reply arrived)
+		uint32_t getLoad(uint64_t& latencyNs) const;
+
+		// Connections opened after this are non-blocking and serviced by the loop
+		void setEventLoop(const std::shared_ptr<EventLoop>& loop);
+
+		// Transport of connections opened after this, for every program
+		void setProtocol(GenericEnums::PROTOCOL_TYPE transport) {
+			std::lock_guard<std::mutex> lock(mutex);
+			protocol = transport;
+		}
+		GenericEnums::PROTOCOL_TYPE getProtocol() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return protocol;
+		}
 
 		DESC_CLASS_ENUM(NFSPROG, uint32_t,
 			NFSPROC3_NULL = 0,
@@ -178,10 +233,21 @@ class Context : public std::enable_shared_from_this<Context> {
 				static const handle& makeFile(const std::shared_ptr<Context>& context, uint32_t timeout, const iName_p& parent, const iName& fileName);
 				static const void unlinkDir(const std::shared_ptr<Context>& context, uint32_t timeout, const iName_p& parent, const iName& dirName);
 				static const void unlinkFile(const std::shared_ptr<Context>& context, uint32_t timeout, const iName_p& parent, const iName& fileName);
-				static const int64_t read(const std::shared_ptr<Context>& context, uint32_t timeout, const iName_p& parent, const iName& fileName,
-											uint64_t offset, uint64_t size, uchar_t* dst);
-				static const int64_t write(const std::shared_ptr<Context>& context, uint32_t timeout, const iName_p& parent, const iName& fileName,
-											uint64_t offset, uint64_t size, uchar_t* dst);
+				// Reads through a ReadEngine kept per file of parent, so that readahead carries over from one read to the next
+				static int64_t read(std::shared_ptr<Context>& context, uint32_t timeout, const iName& fileName, const std::shared_ptr<Inode>& parent,
+											uint64_t offset, uint64_t size, uchar_t* dst, GenericEnums::AUTH_TYPE authType);
+				// Writes behind the caller through a WriteEngine kept per file of parent, and drops the readahead of the file. Errors of the WRITEs show up in commit() and close().
+				static int64_t write(std::shared_ptr<Context>& context, uint32_t timeout, const iName& fileName, const std::shared_ptr<Inode>& parent,
+											uint64_t offset, uint64_t size, const uchar_t* src, GenericEnums::AUTH_TYPE authType);
+				// Makes what was written to the range durable with one COMMIT, size 0 runs to the end of the file
+				static int32_t commit(uint32_t timeout, const iName& fileName, const std::shared_ptr<Inode>& parent, uint64_t offset, uint64_t size);
+				// Commits the whole file and forgets its readahead and write state
+				static int32_t close(uint32_t timeout, const iName& fileName, const std::shared_ptr<Inode>& parent);
+
+				void setHandle(const handle& myHandle) {
+					std::lock_guard<std::mutex> lock(mutex);
+					selfHandle = std::make_shared<handle>(myHandle);
+				}
 
 				int32_t makeHandle(const std::shared_ptr<Context>& context);
 				int32_t releaseHandle(const std::shared_ptr<Context>& context);
@@ -220,42 +286,81 @@ class Context : public std::enable_shared_from_this<Context> {
 				iName_p selfDir; // Not fully qualified if regular, otherwise fully qualified
 				handle_p selfHandle;
 				std::map<std::string, Inode> children; // names here are NEVER fully qualified
+				std::map<iName, std::shared_ptr<ReadEngine>> readers; // Of the files read in here, by name
+				std::map<iName, std::shared_ptr<WriteEngine>> writers; // Of the files written in here, by name
 				mutable std::mutex	mutex;
 		};
 		using Inode_p = std::shared_ptr<Inode>;
 
 		void setMountPort(uint32_t port) {
+			std::lock_guard<std::mutex> lock(mutex);
 			mountPort = port;
 		}
 
 		void setNfsPort(uint32_t port) {
+			std::lock_guard<std::mutex> lock(mutex);
 			nfsPort = port;
 		}
 
+		int32_t getMountPort() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return mountPort;
+		}
+
+		// Name of the server as it was given
+		const std::string& getServer() const {
+			return server;
+		}
+
+		int32_t getNfsPort() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return nfsPort;
+		}
+
+		// Resolves the server name once, every connection of the context connects to the cached address
+		int32_t resolve();
+		// Connections of every program whose port is known, made but not necessarily open, for Connection::connectAll
+		std::vector<Connection_p> prepareConnections();
+
 	private:
+		Connection_p connectProgram(const std::function<Connection_p&()>& pick, const int32_t& port, const char* program, uint32_t timeout);
+		Connection_p slotConnectionLocked(Connection_p& connection, int32_t port, Connection_p& moved);
+		std::vector<Connection_p> openedConnections() const;
+
 		std::string server;
-		int32_t	port;
 		int32_t portMapperPort;
-		int32_t error;
-		int32_t connectError;
 		int32_t returnValue;
 		char *returnString;
-		int32_t socketFd;
-		uint64_t totalSent;
-		uint64_t totalReceived;
-		time_t connectTime;
-		time_t disconnectTime;
-		struct tm *timem;
 		mutable std::mutex mutex;
 		int32_t mountPort;
 		int32_t nfsPort;
+		uint32_t inflightDepth;
+		uint32_t fragmentSize;
+		bool duplex;
+		RetransmitPolicy retransmitPolicy;
+		ReadPolicy readPolicy;
+		WritePolicy writePolicy;
+		std::shared_ptr<WriteFlusher> writeFlusher;
+		std::shared_ptr<BlockCache> blockCache;
+		struct sockaddr_in address;
+		bool resolved;
+		uint32_t nconnect;
+		SHARDING sharding;
+		uint32_t nextShard;
+		GenericEnums::PROTOCOL_TYPE protocol;
+		std::shared_ptr<EventLoop> eventLoop;
+
+		// Opened on first use and kept open side by side, one per program and nconnect of them for NFS
+		Connection_p portMapperConnection;
+		Connection_p mountConnection;
+		std::vector<Connection_p> nfsConnections; // Always MAX_NCONNECT long, only the first nconnect are used
 };
 
 using Context_p = std::shared_ptr<Context>;
 
 class ServerContexts {
 	public:
-		ServerContexts() = default;
+		ServerContexts() : strategy(GetContextStrategy::Iterate), fixedIndex(0), nextIndex(0) {}
 
 		template<typename T>
 		ServerContexts(T&& sContexts) = delete; // Yep, no copy, move, nothing ...
@@ -268,35 +373,135 @@ class ServerContexts {
 			Random,
 			Iterate,
 			Fixed,
+			PowerOfTwo, // Least loaded of two random servers, by outstanding RPCs and recent latency
 			UNKNOWN
 		);
 
 		struct ServerHold {
+			ServerHold(const Context_p& context) : context(context), usageCount(0) {}
+
 			Context_p	context;
-			int32_t		usageCount;
+			std::atomic<int32_t>	usageCount;
 		};
 
 		void addContext(Context_p& context) {
-			struct ServerHold server = {.context = context, .usageCount = 0};
-			sContexts.push_back(server);
+			std::lock_guard<std::mutex> lock(mutex);
+			sContexts.emplace_back(new ServerHold(context));
+		}
+
+		void setInflightDepth(uint32_t depth) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setInflightDepth(depth);
+			}
+		}
+
+		void setFragmentSize(uint32_t size) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setFragmentSize(size);
+			}
 		}
 
+		void setEventLoop(const std::shared_ptr<EventLoop>& loop) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setEventLoop(loop);
+			}
+		}
+
+		void setRetransmitPolicy(const RetransmitPolicy& policy) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setRetransmitPolicy(policy);
+			}
+		}
+
+		void setDuplex(bool on) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setDuplex(on);
+			}
+		}
+
+		void setReadPolicy(const ReadPolicy& policy) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setReadPolicy(policy);
+			}
+		}
+
+		void setWritePolicy(const WritePolicy& policy) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setWritePolicy(policy);
+			}
+		}
+
+		// One cache for all servers, or none if the budget is 0
+		void setCachePolicy(const CachePolicy& policy) {
+			std::shared_ptr<BlockCache> cache;
+			if (policy.budget) {
+				cache = std::make_shared<BlockCache>(policy);
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setBlockCache(cache);
+			}
+		}
+
+		void setProtocol(GenericEnums::PROTOCOL_TYPE protocol) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				server->context->setProtocol(protocol);
+			}
+		}
+
+		int32_t setNconnect(uint32_t count, Context::SHARDING sharding) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& server : sContexts) {
+				if (server->context->setNconnect(count, sharding) != 0) {
+					return -1;
+				}
+			}
+			return 0;
+		}
+
+		// Resolves every server, then connects to all of them at once, asks their port mappers for the MOUNT and NFS ports
+		// and connects to those at once as well. Returns the number of servers fully brought up.
+		int32_t bringUp(uint32_t timeout);
+
+		// index is only used by the Fixed strategy
+		int32_t setStrategy(GetContextStrategy how, uint32_t index = 0);
+
 		void deleteContext(Context_p context);
 		void deleteContext(int32_t index);
 
 		Context_p getContext(int32_t index) {
-			ServerHold& server =  sContexts.at(index);
+			std::lock_guard<std::mutex> lock(mutex);
+			ServerHold& server = *sContexts.at(index);
 			DASSERT(server.usageCount >= 0);
 			++server.usageCount;
 			return server.context;
 		}
-			
+
+		// Picks a server by the configured strategy. Returns its context and sets index for the matching putContext().
+		Context_p selectContext(int32_t& index);
+
 		void putContext(int32_t index) {
-			ServerHold& server =  sContexts.at(index);
+			std::lock_guard<std::mutex> lock(mutex);
+			ServerHold& server = *sContexts.at(index);
 			DASSERT(server.usageCount > 0);
 			--server.usageCount;
 		}
 
 	private:
-		std::vector<ServerHold> sContexts; // Store the context and its in-use count together
+		uint64_t loadOf(const ServerHold& server, uint64_t& latencyNs) const;
+		size_t pickLessLoaded(size_t first, size_t second) const;
+
+		std::vector<std::unique_ptr<ServerHold>> sContexts; // Store the context and its in-use count together
+		GetContextStrategy strategy;
+		uint32_t fixedIndex;
+		std::atomic<uint32_t> nextIndex;
+		mutable std::mutex mutex; // Guards the list, counts are atomic so that load can be read while others get and put
 };
@@ -0,0 +1,223 @@
+#include "Coroutines.hpp"
+
+#include "logging/Logging.hpp"
+#include "descriptiveenum/DescriptiveEnum.hpp"
+
+#include <string.h>
+
+static thread_local Executor* currentExecutor = nullptr;
+
+Executor::Executor(uint32_t threads) : live(0UL), stopping(false) {
+	for (uint32_t i = 0; i < (threads ? threads : 1); ++i) {
+		workers.emplace_back(&Executor::run, this);
+	}
+}
+
+Executor::~Executor() {
+	join();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	ready.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void Executor::post(std::coroutine_handle<> handle) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(handle);
+	}
+	ready.notify_one();
+}
+
+// Top of a spawned task. Owns the Task, and its own frame goes away when it falls off the end.
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() {
+			return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+
+	static Detached launch(Executor* executor, Task<void> task) {
+		co_await task;
+		executor->finished();
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+void Executor::spawn(Task<void>&& task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		++live;
+	}
+	post(Detached::launch(this, std::move(task)).handle);
+}
+
+void Executor::finished() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--live == 0) {
+		idle.notify_all();
+	}
+}
+
+void Executor::join() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] { return live == 0; });
+}
+
+Executor* Executor::current() {
+	return currentExecutor;
+}
+
+void Executor::run() {
+	currentExecutor = this;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		ready.wait(lock, [this] { return stopping || not queue.empty(); });
+		if (queue.empty()) {
+			break;
+		}
+		auto handle = queue.front();
+		queue.pop_front();
+		lock.unlock();
+		handle.resume();
+		lock.lock();
+	}
+}
+
+static RPC::Procedure nfsProcedure(Context::NFSPROG procedure, GenericEnums::AUTH_TYPE authType, const char* name) {
+	return {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(procedure), name};
+}
+
+// Logs a failed call or an NFS error. Returns true for NFS3_OK.
+static bool succeeded(const char* operation, const iName& name, int32_t status, uint32_t nfsStatus) {
+	if (status != 0) {
+		DEBUG_LOG(CRITICAL) << operation << " of : " << name << " failed : " << status;
+		return false;
+	}
+	auto result = static_cast<Context::NFSPROGERR>(nfsStatus);
+	if (result != Context::NFSPROGERR::NFS3_OK) {
+		DEBUG_LOG(CRITICAL) << operation << " of : " << name << " result : " << Context::NFSPROGERRImage::printEnum(result);
+		return false;
+	}
+	return true;
+}
+
+static nfs3::diropargs3 dirop(const handle_p& dir, const iName& name) {
+	nfs3::diropargs3 what;
+	what.dir.data = *dir;
+	what.name = name;
+	return what;
+}
+
+Task<handle_p> CoInode::lookup(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType) {
+	nfs3::LOOKUP3args args;
+	args.what = dirop(dir, name);
+	auto reply = co_await awaitRPC<nfs3::LOOKUP3res>(context->connectNfsPort(timeout, dir.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_LOOKUP, authType, "LOOKUP"), std::move(args));
+	if (not succeeded("LOOKUP", name, reply.status, reply.result.status)) {
+		co_return handle_p();
+	}
+	co_return std::make_shared<handle>(std::move(reply.result.ok.object.data));
+}
+
+Task<int32_t> CoInode::getattr(Context_p context, uint32_t timeout, handle_p object, nfs3::fattr3* attributes, GenericEnums::AUTH_TYPE authType) {
+	nfs3::GETATTR3args args;
+	args.object.data = *object;
+	auto reply = co_await awaitRPC<nfs3::GETATTR3res>(context->connectNfsPort(timeout, object.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_GETATTR, authType, "GETATTR"), std::move(args));
+	if (not succeeded("GETATTR", "", reply.status, reply.result.status)) {
+		co_return -1;
+	}
+	if (attributes) {
+		*attributes = reply.result.ok.obj_attributes;
+	}
+	co_return 0;
+}
+
+Task<handle_p> CoInode::makeMkdir(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType) {
+	nfs3::MKDIR3args args = nfs3::MKDIR3args();
+	args.where = dirop(dir, name);
+	args.attributes.mode = XdrOptional<uint32_t>(Context::Permissions::makeDefault());
+	auto reply = co_await awaitRPC<nfs3::MKDIR3res>(context->connectNfsPort(timeout, dir.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_MKDIR, authType, "MKDIR"), std::move(args));
+	if (not succeeded("MKDIR", name, reply.status, reply.result.status) || not reply.result.ok.obj.present) {
+		co_return handle_p();
+	}
+	co_return std::make_shared<handle>(std::move(reply.result.ok.obj.value.data));
+}
+
+Task<handle_p> CoInode::makeFile(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType) {
+	nfs3::CREATE3args args = nfs3::CREATE3args();
+	args.where = dirop(dir, name);
+	args.how.mode = nfs3::createmode3::UNCHECKED;
+	args.how.obj_attributes.mode = XdrOptional<uint32_t>(Context::Permissions::makeDefault());
+	auto reply = co_await awaitRPC<nfs3::CREATE3res>(context->connectNfsPort(timeout, dir.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_CREATE, authType, "CREATE"), std::move(args));
+	if (not succeeded("CREATE", name, reply.status, reply.result.status) || not reply.result.ok.obj.present) {
+		co_return handle_p();
+	}
+	co_return std::make_shared<handle>(std::move(reply.result.ok.obj.value.data));
+}
+
+Task<int32_t> CoInode::unlinkDir(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType) {
+	nfs3::REMOVE3args args; // RMDIR takes and returns the same as REMOVE
+	args.object = dirop(dir, name);
+	auto reply = co_await awaitRPC<nfs3::REMOVE3res>(context->connectNfsPort(timeout, dir.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_RMDIR, authType, "RMDIR"), std::move(args));
+	co_return succeeded("RMDIR", name, reply.status, reply.result.status) ? 0 : -1;
+}
+
+Task<int32_t> CoInode::unlinkFile(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType) {
+	nfs3::REMOVE3args args;
+	args.object = dirop(dir, name);
+	auto reply = co_await awaitRPC<nfs3::REMOVE3res>(context->connectNfsPort(timeout, dir.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_REMOVE, authType, "REMOVE"), std::move(args));
+	co_return succeeded("REMOVE", name, reply.status, reply.result.status) ? 0 : -1;
+}
+
+Task<int64_t> CoInode::read(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, uchar_t* dst, GenericEnums::AUTH_TYPE authType) {
+	nfs3::READ3args args;
+	args.file.data = *file;
+	args.offset = offset;
+	args.count = size;
+	auto reply = co_await awaitRPC<nfs3::READ3res>(context->connectNfsPort(timeout, file.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_READ, authType, "READ"), std::move(args));
+	if (not succeeded("READ", "", reply.status, reply.result.status)) {
+		co_return -1;
+	}
+	auto& data = reply.result.ok.data;
+	uint32_t count = (data.size() < size) ? data.size() : size;
+	memcpy(dst, data.data(), count);
+	co_return count;
+}
+
+Task<int64_t> CoInode::write(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, const uchar_t* src, nfs3::stable_how stable, GenericEnums::AUTH_TYPE authType) {
+	nfs3::WRITE3args args;
+	args.file.data = *file;
+	args.offset = offset;
+	args.count = size;
+	args.stable = stable;
+	args.data.assign(src, src + size);
+	auto reply = co_await awaitRPC<nfs3::WRITE3res>(context->connectNfsPort(timeout, file.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_WRITE, authType, "WRITE"), std::move(args));
+	if (not succeeded("WRITE", "", reply.status, reply.result.status)) {
+		co_return -1;
+	}
+	co_return reply.result.ok.count;
+}
+
+Task<int32_t> CoInode::commit(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, GenericEnums::AUTH_TYPE authType) {
+	nfs3::COMMIT3args args;
+	args.file.data = *file;
+	args.offset = offset;
+	args.count = size;
+	auto reply = co_await awaitRPC<nfs3::COMMIT3res>(context->connectNfsPort(timeout, file.get()), timeout, nfsProcedure(Context::NFSPROG::NFSPROC3_COMMIT, authType, "COMMIT"), std::move(args));
+	co_return succeeded("COMMIT", "", reply.status, reply.result.status) ? 0 : -1;
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "Context.hpp"
+#include "Utils.hpp"
+#include "rpc.hpp"
+#include "NfsTypes.hpp"
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#ifndef NFSCLISIM_COROUTINES
+#error "Coroutines.hpp needs the C++20 build, configure with -DNFSCLISIM_COROUTINES=ON"
+#endif
+
+/*
+ * C++20 coroutine front-end. A simulated client is a Task spawned on an Executor, and every NFS operation it awaits is
+ * one RPC::runRPC() call: the client is suspended while the call is in flight and resumed on an executor thread by its
+ * completion. A few threads so carry tens of thousands of clients, each costing a coroutine frame instead of a thread.
+ *
+ * Replies have to come in without a thread blocking for them, so the connections are meant to be driven by an EventLoop
+ * (-e epoll|io_uring) or be full duplex (-D). Otherwise an operation waits for its reply on the executor thread.
+ */
+
+class Executor;
+
+// Lazily started coroutine producing a T, run by co_await-ing it. The awaiting coroutine is resumed when it finishes.
+template<typename T>
+class Task;
+
+template<typename T>
+struct TaskPromiseBase {
+	std::coroutine_handle<> continuation;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			auto continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+	void unhandled_exception() {
+		std::terminate(); // Nothing here throws, errors are returned
+	}
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase<T> {
+	T value;
+
+	Task<T> get_return_object();
+	void return_value(T result) {
+		value = std::move(result);
+	}
+	T result() {
+		return std::move(value);
+	}
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+	Task<void> get_return_object();
+	void return_void() {}
+	void result() {}
+};
+
+template<typename T>
+class Task {
+	public:
+		using promise_type = TaskPromise<T>;
+
+		explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+		Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		Task& operator=(Task&&) = delete;
+
+		~Task() {
+			if (handle) {
+				handle.destroy();
+			}
+		}
+
+		struct Awaiter {
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() noexcept {
+				return false;
+			}
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+				handle.promise().continuation = caller;
+				return handle;
+			}
+			T await_resume() {
+				return handle.promise().result();
+			}
+		};
+
+		Awaiter operator co_await() noexcept {
+			return Awaiter{handle};
+		}
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/*
+ * Fixed set of threads resuming coroutines from one queue. Completions of RPCs post their coroutine here, so the thread
+ * that reaped the reply, typically an EventLoop, goes straight back to reaping.
+ */
+class Executor {
+	public:
+		explicit Executor(uint32_t threads);
+		~Executor();
+
+		Executor(const Executor&) = delete;
+		Executor& operator=(const Executor&) = delete;
+
+		void post(std::coroutine_handle<> handle);
+		// Starts task on an executor thread. It runs detached, join() waits for it.
+		void spawn(Task<void>&& task);
+		// Waits until every spawned task finished
+		void join();
+
+		// The executor the calling thread works for, nullptr outside of one
+		static Executor* current();
+
+	private:
+		void run();
+		void finished();
+
+		std::vector<std::thread> workers;
+		std::deque<std::coroutine_handle<>> queue;
+		uint64_t live; // Spawned tasks not finished yet
+		bool stopping;
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::condition_variable idle;
+
+		friend struct Detached;
+};
+
+/*
+ * co_await-ing one gives the RPC::Reply of the call. The call is sent when the coroutine suspends and the coroutine is
+ * resumed on the executor it runs on. Outside of an executor, or when nothing feeds replies in, the call is made in place.
+ */
+template<typename Result, typename Args>
+class RpcAwaitable {
+	public:
+		RpcAwaitable(const Connection_p& connection, uint32_t timeout, const RPC::Procedure& procedure, Args&& args) : connection(connection), timeout(timeout), procedure(procedure), args(std::move(args)), reply{-1, Result()} {}
+
+		bool await_ready() noexcept {
+			return not connection;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			auto executor = Executor::current();
+			if (not executor || not connection->isDriven()) {
+				reply.status = RPC::callRPC(connection, timeout, procedure, args, reply.result);
+				return false;
+			}
+			auto self = this;
+			auto resume = [self, executor, handle](int32_t status, Result& result) {
+				self->reply.status = status;
+				self->reply.result = std::move(result);
+				executor->post(handle);
+			};
+			// Once the call is in flight the coroutine may be resumed, and this destroyed, before runRPC() returns
+			auto status = RPC::runRPC<Result>(connection, timeout, procedure, args, resume);
+			if (status != 0) {
+				reply.status = status;
+				return false;
+			}
+			return true;
+		}
+
+		RPC::Reply<Result> await_resume() {
+			return std::move(reply);
+		}
+
+	private:
+		Connection_p connection;
+		uint32_t timeout;
+		RPC::Procedure procedure;
+		Args args;
+		RPC::Reply<Result> reply;
+};
+
+template<typename Result, typename Args>
+RpcAwaitable<Result, Args> awaitRPC(const Connection_p& connection, uint32_t timeout, const RPC::Procedure& procedure, Args args) {
+	return RpcAwaitable<Result, Args>(connection, timeout, procedure, std::move(args));
+}
+
+/*
+ * Coroutine versions of the NFS operations of Context::Inode, on file handles. Like Context::Inode::lookup() they log
+ * a failure and return an empty handle or a negative count. Arguments are taken by value as the coroutine outlives the
+ * expression that started it; dst and src must stay valid until the Task finished.
+ */
+class CoInode {
+	public:
+		static Task<handle_p> lookup(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType);
+		static Task<int32_t> getattr(Context_p context, uint32_t timeout, handle_p object, nfs3::fattr3* attributes, GenericEnums::AUTH_TYPE authType);
+		static Task<handle_p> makeMkdir(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType);
+		static Task<handle_p> makeFile(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType);
+		static Task<int32_t> unlinkDir(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType);
+		static Task<int32_t> unlinkFile(Context_p context, uint32_t timeout, handle_p dir, iName name, GenericEnums::AUTH_TYPE authType);
+		static Task<int64_t> read(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, uchar_t* dst, GenericEnums::AUTH_TYPE authType);
+		static Task<int64_t> write(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, const uchar_t* src, nfs3::stable_how stable, GenericEnums::AUTH_TYPE authType);
+		static Task<int32_t> commit(Context_p context, uint32_t timeout, handle_p file, uint64_t offset, uint32_t size, GenericEnums::AUTH_TYPE authType);
+};
@@ -0,0 +1,106 @@
+#include "EpollLoop.hpp"
+#include "RpcEngine.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+EpollLoop::EpollLoop() : epollFd(-1), wakeFd(-1) {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to create epoll instance : " << strerror(errno);
+		return;
+	}
+
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to create wakeup eventfd : " << strerror(errno);
+		return;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof (event));
+	event.events = EPOLLIN;
+	event.data.u64 = (uint32_t)wakeFd; // Generation 0 is never handed out
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) != 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to watch wakeup eventfd : " << strerror(errno);
+	}
+}
+
+EpollLoop::~EpollLoop() {
+	stop();
+	if (wakeFd >= 0) {
+		close(wakeFd);
+	}
+	if (epollFd >= 0) {
+		close(epollFd);
+	}
+}
+
+int32_t EpollLoop::watch(const Connection_p&, int32_t fd, uint32_t generation) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof (event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // Edge triggered, connections drain until EAGAIN
+	event.data.u64 = ((uint64_t)generation << 32) | (uint32_t)fd;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		DEBUG_LOG(CRITICAL) << "epoll_ctl add failed for fd : " << fd << " : " << strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+void EpollLoop::unwatch(int32_t fd) {
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int32_t EpollLoop::runOnce(uint32_t timeoutMs) {
+	struct epoll_event events[MAX_EVENTS];
+
+	auto ready = epoll_wait(epollFd, events, MAX_EVENTS, (timeoutMs < TICK_MS) ? timeoutMs : TICK_MS);
+	if (ready < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		DEBUG_LOG(CRITICAL) << "epoll_wait failed : " << strerror(errno);
+		return -1;
+	}
+
+	for (int32_t i = 0; i < ready; ++i) {
+		auto fd = static_cast<int32_t>(events[i].data.u64 & 0xffffffff);
+		auto generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+		if (generation == 0 && fd == wakeFd) {
+			uint64_t count;
+			while (read(wakeFd, &count, sizeof (count)) > 0);
+			continue;
+		}
+
+		auto connection = lookup(fd, generation);
+		if (not connection) {
+			continue; // Stale event for a socket that was closed after epoll_wait returned
+		}
+
+		bool failed = (events[i].events & EPOLLERR) != 0;
+		if (not failed && (events[i].events & EPOLLOUT)) {
+			failed = connection->flush() < 0;
+		}
+		if (not failed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+			auto engine = connection->getRpcEngine();
+			failed = connection->readRecords([&engine](uchar_t* reply, int32_t replySize) {
+				engine->dispatch(reply, replySize);
+			}) < 0;
+		}
+		if (failed) {
+			connection->abandon(generation);
+		}
+	}
+	return ready;
+}
+
+void EpollLoop::wakeup() {
+	uint64_t one = 1;
+	if (wakeFd >= 0 && write(wakeFd, &one, sizeof (one)) < 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to wake event loop : " << strerror(errno);
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "EventLoop.hpp"
+
+#include <stdint.h>
+
+// Edge triggered epoll backend. Connections read and write their own sockets when told they are ready.
+class EpollLoop : public EventLoop {
+	public:
+		constexpr static uint32_t MAX_EVENTS = 256;
+
+		EpollLoop();
+		~EpollLoop() override;
+
+		int32_t runOnce(uint32_t timeoutMs) override;
+
+	protected:
+		bool ready() const override {
+			return epollFd >= 0 && wakeFd >= 0;
+		}
+		int32_t watch(const Connection_p& connection, int32_t fd, uint32_t generation) override;
+		void unwatch(int32_t fd) override;
+		void wakeup() override;
+
+	private:
+		int32_t epollFd;
+		int32_t wakeFd;
+};
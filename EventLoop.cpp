@@ -0,0 +1,97 @@
+#include "EventLoop.hpp"
+#include "RpcEngine.hpp"
+#include "Utils.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <vector>
+
+int32_t EventLoop::add(const Connection_p& connection, int32_t fd, uint32_t& generation) {
+	std::lock_guard<std::mutex> lock(mutex);
+	generation = ++nextGeneration;
+	if (watch(connection, fd, generation) != 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to add fd : " << fd << " to event loop";
+		return -1;
+	}
+	connections[fd] = {connection, generation};
+	return 0;
+}
+
+void EventLoop::remove(int32_t fd) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (connections.erase(fd)) {
+		unwatch(fd);
+	}
+}
+
+int32_t EventLoop::start() {
+	if (not ready()) {
+		return -1;
+	}
+	bool expected = false;
+	if (not running.compare_exchange_strong(expected, true)) {
+		return 0;
+	}
+	thread = std::thread(run, std::weak_ptr<EventLoop>(shared_from_this()));
+	return 0;
+}
+
+void EventLoop::stop() {
+	running = false;
+	wakeup();
+	if (thread.joinable()) {
+		if (onLoopThread()) {
+			thread.detach(); // Destroyed by run() between two turns, which returns without touching it again
+		} else {
+			thread.join();
+		}
+	}
+}
+
+// Holds on to the loop for one turn at a time, and returns once it is stopped or gone
+void EventLoop::run(std::weak_ptr<EventLoop> weak) {
+	if (auto loop = weak.lock()) {
+		loop->loopThreadId = std::this_thread::get_id();
+	}
+	while (auto loop = weak.lock()) {
+		if (not loop->running || loop->runOnce(TICK_MS) < 0) {
+			break;
+		}
+		if (getClockNs() - loop->lastExpire >= TICK_MS * 1000000UL) {
+			loop->expireCalls();
+		}
+	}
+}
+
+// Returns the connection registered for fd, unless fd has since been closed and reused for another registration
+Connection_p EventLoop::lookup(int32_t fd, uint32_t generation) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iter = connections.find(fd);
+	if (iter == connections.end() || iter->second.generation != generation) {
+		return {};
+	}
+	auto connection = iter->second.connection.lock();
+	if (not connection) {
+		connections.erase(iter);
+		unwatch(fd);
+	}
+	return connection;
+}
+
+void EventLoop::expireCalls() {
+	std::vector<Connection_p> live;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& entry : connections) {
+			auto connection = entry.second.connection.lock();
+			if (connection) {
+				live.push_back(connection);
+			}
+		}
+	}
+
+	lastExpire = getClockNs();
+	for (auto& connection : live) {
+		connection->getRpcEngine()->expire(lastExpire);
+	}
+}
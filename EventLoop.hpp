@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Connection.hpp"
+#include "descriptiveenum/DescriptiveEnum.hpp"
+#include "types.hpp"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+/*
+ * Drives any number of non-blocking Connection sockets from one thread. Replies are handed to each connection's RpcEngine as
+ * soon as they are complete, and overdue calls are failed by the loop instead of by SO_RCVTIMEO. How sockets are
+ * watched and written is up to the backend, see EpollLoop and UringLoop.
+ *
+ * A loop must be owned by a shared_ptr before start(). Its thread only holds on to it for one turn at a time, so the last
+ * reference may be dropped anywhere, the loop thread included, and the loop is destroyed between two turns.
+ */
+class EventLoop : public std::enable_shared_from_this<EventLoop> {
+	public:
+		DESC_CLASS_ENUM(LOOP_TYPE, uint32_t,
+			None,
+			EPOLL,
+			IO_URING,
+			UNKNOWN
+		);
+
+		constexpr static uint32_t TICK_MS = 100; // Longest sleep, bounds how late a deadline or stop() is noticed
+
+		EventLoop() : running(false), lastExpire(0UL), nextGeneration(0) {}
+		virtual ~EventLoop() = default; // Backends must stop() in their own destructor, the loop thread calls into them
+
+		template<typename T>
+		EventLoop(T&&) = delete;
+		template<typename T>
+		EventLoop& operator=(T&&) = delete;
+
+		// generation is set to the registration number the loop will hand back to Connection::abandon()
+		int32_t add(const Connection_p& connection, int32_t fd, uint32_t& generation);
+		void remove(int32_t fd);
+
+		// Called by a connection after queueing bytes. Returns false if the backend leaves writing to the caller.
+		virtual bool requestFlush(int32_t) {
+			return false;
+		}
+
+		// True if the backend writes every queued byte itself. A connection must then never write its socket directly, or
+		// its bytes could overtake ones the backend already took.
+		virtual bool ownsWrites() const {
+			return false;
+		}
+
+		virtual bool wantsNonBlocking() const {
+			return true;
+		}
+
+		virtual int32_t runOnce(uint32_t timeoutMs) = 0;
+		int32_t start();
+		void stop();
+
+		bool onLoopThread() const {
+			return std::this_thread::get_id() == loopThreadId;
+		}
+
+	protected:
+		virtual bool ready() const = 0;
+		// generation tells this registration of fd apart from earlier sockets that had the same fd number
+		virtual int32_t watch(const Connection_p& connection, int32_t fd, uint32_t generation) = 0;
+		virtual void unwatch(int32_t fd) = 0;
+		virtual void wakeup() = 0;
+
+		Connection_p lookup(int32_t fd, uint32_t generation);
+		void expireCalls();
+
+	private:
+		static void run(std::weak_ptr<EventLoop> weak);
+
+		struct Registration {
+			std::weak_ptr<Connection> connection;
+			uint32_t generation;
+		};
+
+		std::map<int32_t, Registration> connections;
+		std::atomic<bool> running;
+		std::thread thread;
+		std::thread::id loopThreadId;
+		uint64_t lastExpire;
+		uint32_t nextGeneration;
+		mutable std::mutex mutex;
+};
@@ -17,7 +17,10 @@
 
 Context::Inode_p FSTree::getRoot() const {
 	std::lock_guard<std::mutex> lock(mutex);
-	auto iter = tree.find("");
+	auto iter = tree.begin();
+	if (iter == tree.end()) {
+		return {};
+	}
 	return std::get<1>(*iter);
 }
 
@@ -29,6 +32,7 @@ void FSTree::addMountHandle(const std::string& remote, const handle& myHandle) {
 	}
 	iName_p parent = std::make_shared<iName>(remote);	
 	Context::Inode_p inode = std::make_shared<Context::Inode>(parent, "/", Context::Inode::INODE_TYPE::NFS3DIR);
+	inode->setHandle(myHandle);
 	tree.insert({*parent, inode});
 	return;
 }
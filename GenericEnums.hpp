@@ -6,7 +6,6 @@ class GenericEnums {
 	public:
 		constexpr static uint32_t GETPORT_REQUEST_SIZE = 1024;
 		constexpr static uint32_t GETPORT_RESPONSE_SIZE = 1024;
-		constexpr static uint32_t CRED_REQUEST_SIZE = 1024;
 		constexpr static uint32_t MOUNT_REQUEST_SIZE = 1024;
 
 		DESC_CLASS_ENUM(AUTH_TYPE, uint32_t,
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * Lock-free multi-producer single-consumer queue of intrusive nodes, T has a T* next. Producers push onto a stack with
+ * one CAS, the consumer takes the whole stack with one exchange and gets it back in push order. Nobody ever waits on
+ * anybody, and the consumer pays one atomic operation per batch rather than per node.
+ */
+template<typename T>
+class MpscQueue {
+	public:
+		MpscQueue() : head(nullptr) {}
+
+		template<typename U>
+		MpscQueue(U&&) = delete;
+		template<typename U>
+		MpscQueue& operator=(U&&) = delete;
+
+		void push(T* node) {
+			auto top = head.load(std::memory_order_relaxed);
+			do {
+				node->next = top;
+			} while (not head.compare_exchange_weak(top, node, std::memory_order_seq_cst, std::memory_order_relaxed));
+		}
+
+		// Consumer only. Returns everything pushed so far, oldest first, linked through next.
+		T* takeAll() {
+			T* node = head.exchange(nullptr, std::memory_order_seq_cst);
+			T* ordered = nullptr;
+			while (node) {
+				T* next = node->next;
+				node->next = ordered;
+				ordered = node;
+				node = next;
+			}
+			return ordered;
+		}
+
+		bool empty() const {
+			return head.load(std::memory_order_seq_cst) == nullptr;
+		}
+
+	private:
+		std::atomic<T*> head;
+};
@@ -0,0 +1,459 @@
+#pragma once
+
+#include "XdrCodec.hpp"
+
+#include <array>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Arguments and results of the NFSv3 (RFC 1813), MOUNT v3 and PORTMAP v2 procedures we call, described for XdrCodec.
+ * Names follow the RFCs. A result is an XdrResult of its resok and resfail arms, selected by the status in front of it.
+ */
+
+namespace nfs3 {
+
+constexpr uint32_t NFS3_FHSIZE = 64;
+constexpr uint32_t NFS3_COOKIEVERFSIZE = 8;
+constexpr uint32_t NFS3_CREATEVERFSIZE = 8;
+constexpr uint32_t NFS3_WRITEVERFSIZE = 8;
+
+using cookieverf3 = std::array<uchar_t, NFS3_COOKIEVERFSIZE>;
+using createverf3 = std::array<uchar_t, NFS3_CREATEVERFSIZE>;
+using writeverf3 = std::array<uchar_t, NFS3_WRITEVERFSIZE>;
+
+enum class ftype3 {
+	NF3REG = 1,
+	NF3DIR = 2,
+	NF3BLK = 3,
+	NF3CHR = 4,
+	NF3LNK = 5,
+	NF3SOCK = 6,
+	NF3FIFO = 7
+};
+
+enum class stable_how {
+	UNSTABLE = 0,
+	DATA_SYNC = 1,
+	FILE_SYNC = 2
+};
+
+enum class time_how {
+	DONT_CHANGE = 0,
+	SET_TO_SERVER_TIME = 1,
+	SET_TO_CLIENT_TIME = 2
+};
+
+enum class createmode3 {
+	UNCHECKED = 0,
+	GUARDED = 1,
+	EXCLUSIVE = 2
+};
+
+// Opaque of at most NFS3_FHSIZE bytes, also the fhandle3 of MOUNT
+struct nfs_fh3 {
+	std::vector<uchar_t> data;
+};
+
+struct nfstime3 {
+	uint32_t seconds;
+	uint32_t nseconds;
+	XDR_FIELDS(seconds, nseconds)
+};
+
+struct specdata3 {
+	uint32_t specdata1;
+	uint32_t specdata2;
+	XDR_FIELDS(specdata1, specdata2)
+};
+
+struct fattr3 {
+	ftype3 type;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t used;
+	specdata3 rdev;
+	uint64_t fsid;
+	uint64_t fileid;
+	nfstime3 atime;
+	nfstime3 mtime;
+	nfstime3 ctime;
+	XDR_FIELDS(type, mode, nlink, uid, gid, size, used, rdev, fsid, fileid, atime, mtime, ctime)
+};
+
+struct wcc_attr {
+	uint64_t size;
+	nfstime3 mtime;
+	nfstime3 ctime;
+	XDR_FIELDS(size, mtime, ctime)
+};
+
+using post_op_attr = XdrOptional<fattr3>;
+using pre_op_attr = XdrOptional<wcc_attr>;
+using post_op_fh3 = XdrOptional<nfs_fh3>;
+
+struct wcc_data {
+	pre_op_attr before;
+	post_op_attr after;
+	XDR_FIELDS(before, after)
+};
+
+// set_atime and set_mtime of sattr3, a time_how followed by the time only for SET_TO_CLIENT_TIME
+struct set_time3 {
+	time_how set_it;
+	nfstime3 time;
+};
+
+struct sattr3 {
+	XdrOptional<uint32_t> mode;
+	XdrOptional<uint32_t> uid;
+	XdrOptional<uint32_t> gid;
+	XdrOptional<uint64_t> size;
+	set_time3 atime;
+	set_time3 mtime;
+	XDR_FIELDS(mode, uid, gid, size, atime, mtime)
+};
+
+struct diropargs3 {
+	nfs_fh3 dir;
+	std::string name;
+	XDR_FIELDS(dir, name)
+};
+
+// How CREATE creates, attributes for UNCHECKED and GUARDED, a verifier for EXCLUSIVE
+struct createhow3 {
+	createmode3 mode;
+	sattr3 obj_attributes;
+	createverf3 verf;
+};
+
+struct GETATTR3args {
+	nfs_fh3 object;
+	XDR_FIELDS(object)
+};
+
+struct GETATTR3resok {
+	fattr3 obj_attributes;
+	XDR_FIELDS(obj_attributes)
+};
+
+using GETATTR3res = XdrResult<GETATTR3resok, XdrVoid>;
+
+struct LOOKUP3args {
+	diropargs3 what;
+	XDR_FIELDS(what)
+};
+
+struct LOOKUP3resok {
+	nfs_fh3 object;
+	post_op_attr obj_attributes;
+	post_op_attr dir_attributes;
+	XDR_FIELDS(object, obj_attributes, dir_attributes)
+};
+
+struct LOOKUP3resfail {
+	post_op_attr dir_attributes;
+	XDR_FIELDS(dir_attributes)
+};
+
+using LOOKUP3res = XdrResult<LOOKUP3resok, LOOKUP3resfail>;
+
+struct ACCESS3args {
+	nfs_fh3 object;
+	uint32_t access;
+	XDR_FIELDS(object, access)
+};
+
+struct ACCESS3resok {
+	post_op_attr obj_attributes;
+	uint32_t access;
+	XDR_FIELDS(obj_attributes, access)
+};
+
+struct ACCESS3resfail {
+	post_op_attr obj_attributes;
+	XDR_FIELDS(obj_attributes)
+};
+
+using ACCESS3res = XdrResult<ACCESS3resok, ACCESS3resfail>;
+
+struct READ3args {
+	nfs_fh3 file;
+	uint64_t offset;
+	uint32_t count;
+	XDR_FIELDS(file, offset, count)
+};
+
+struct READ3resok {
+	post_op_attr file_attributes;
+	uint32_t count;
+	bool eof;
+	std::vector<uchar_t> data;
+	XDR_FIELDS(file_attributes, count, eof, data)
+};
+
+struct READ3resfail {
+	post_op_attr file_attributes;
+	XDR_FIELDS(file_attributes)
+};
+
+using READ3res = XdrResult<READ3resok, READ3resfail>;
+
+struct WRITE3args {
+	nfs_fh3 file;
+	uint64_t offset;
+	uint32_t count;
+	stable_how stable;
+	std::vector<uchar_t> data;
+	XDR_FIELDS(file, offset, count, stable, data)
+};
+
+struct WRITE3resok {
+	wcc_data file_wcc;
+	uint32_t count;
+	stable_how committed;
+	writeverf3 verf;
+	XDR_FIELDS(file_wcc, count, committed, verf)
+};
+
+struct WRITE3resfail {
+	wcc_data file_wcc;
+	XDR_FIELDS(file_wcc)
+};
+
+using WRITE3res = XdrResult<WRITE3resok, WRITE3resfail>;
+
+struct CREATE3args {
+	diropargs3 where;
+	createhow3 how;
+	XDR_FIELDS(where, how)
+};
+
+// Also the resok of MKDIR
+struct CREATE3resok {
+	post_op_fh3 obj;
+	post_op_attr obj_attributes;
+	wcc_data dir_wcc;
+	XDR_FIELDS(obj, obj_attributes, dir_wcc)
+};
+
+// Also the resfail of MKDIR and REMOVE, and the resok of REMOVE
+struct CREATE3resfail {
+	wcc_data dir_wcc;
+	XDR_FIELDS(dir_wcc)
+};
+
+using CREATE3res = XdrResult<CREATE3resok, CREATE3resfail>;
+
+struct MKDIR3args {
+	diropargs3 where;
+	sattr3 attributes;
+	XDR_FIELDS(where, attributes)
+};
+
+using MKDIR3res = XdrResult<CREATE3resok, CREATE3resfail>;
+
+struct REMOVE3args {
+	diropargs3 object;
+	XDR_FIELDS(object)
+};
+
+using REMOVE3res = XdrResult<CREATE3resfail, CREATE3resfail>;
+
+struct READDIRPLUS3args {
+	nfs_fh3 dir;
+	uint64_t cookie;
+	cookieverf3 cookieverf;
+	uint32_t dircount;
+	uint32_t maxcount;
+	XDR_FIELDS(dir, cookie, cookieverf, dircount, maxcount)
+};
+
+struct entryplus3 {
+	uint64_t fileid;
+	std::string name;
+	uint64_t cookie;
+	post_op_attr name_attributes;
+	post_op_fh3 name_handle;
+	XDR_FIELDS(fileid, name, cookie, name_attributes, name_handle)
+};
+
+struct dirlistplus3 {
+	XdrList<entryplus3> entries;
+	bool eof;
+	XDR_FIELDS(entries, eof)
+};
+
+struct READDIRPLUS3resok {
+	post_op_attr dir_attributes;
+	cookieverf3 cookieverf;
+	dirlistplus3 reply;
+	XDR_FIELDS(dir_attributes, cookieverf, reply)
+};
+
+struct READDIRPLUS3resfail {
+	post_op_attr dir_attributes;
+	XDR_FIELDS(dir_attributes)
+};
+
+using READDIRPLUS3res = XdrResult<READDIRPLUS3resok, READDIRPLUS3resfail>;
+
+struct COMMIT3args {
+	nfs_fh3 file;
+	uint64_t offset;
+	uint32_t count;
+	XDR_FIELDS(file, offset, count)
+};
+
+struct COMMIT3resok {
+	wcc_data file_wcc;
+	writeverf3 verf;
+	XDR_FIELDS(file_wcc, verf)
+};
+
+struct COMMIT3resfail {
+	wcc_data file_wcc;
+	XDR_FIELDS(file_wcc)
+};
+
+using COMMIT3res = XdrResult<COMMIT3resok, COMMIT3resfail>;
+
+/*
+ * The same results decoded as views into the reply, for replies that are looked at once and may be large. They are
+ * only valid as long as the reply buffer is.
+ */
+struct nfs_fh3_view {
+	XdrBytesView data;
+};
+
+using post_op_fh3_view = XdrOptional<nfs_fh3_view>;
+
+struct READ3resok_view {
+	post_op_attr file_attributes;
+	uint32_t count;
+	bool eof;
+	XdrBytesView data;
+	XDR_FIELDS(file_attributes, count, eof, data)
+};
+
+using READ3res_view = XdrResult<READ3resok_view, READ3resfail>;
+
+// WRITE3args up to its data, which RPC::runRPC sends from the caller's buffer behind the encoded call
+struct WRITE3args_head {
+	nfs_fh3 file;
+	uint64_t offset;
+	uint32_t count;
+	stable_how stable;
+	XDR_FIELDS(file, offset, count, stable)
+};
+
+struct entryplus3_view {
+	uint64_t fileid;
+	XdrStringView name;
+	uint64_t cookie;
+	post_op_attr name_attributes;
+	post_op_fh3_view name_handle;
+	XDR_FIELDS(fileid, name, cookie, name_attributes, name_handle)
+};
+
+struct dirlistplus3_view {
+	XdrListView<entryplus3_view> entries;
+	bool eof;
+	XDR_FIELDS(entries, eof)
+};
+
+struct READDIRPLUS3resok_view {
+	post_op_attr dir_attributes;
+	cookieverf3 cookieverf;
+	dirlistplus3_view reply;
+	XDR_FIELDS(dir_attributes, cookieverf, reply)
+};
+
+using READDIRPLUS3res_view = XdrResult<READDIRPLUS3resok_view, READDIRPLUS3resfail>;
+
+// MOUNT v3, MNT and UMNT take the exported path as a bare string
+struct mountres3_ok {
+	nfs_fh3 fhandle;
+	std::vector<uint32_t> auth_flavors;
+	XDR_FIELDS(fhandle, auth_flavors)
+};
+
+using mountres3 = XdrResult<mountres3_ok, XdrVoid>;
+
+// PORTMAP v2, GETPORT takes a mapping and returns the port as a bare uint32_t
+struct mapping {
+	uint32_t prog;
+	uint32_t vers;
+	uint32_t prot;
+	uint32_t port;
+	XDR_FIELDS(prog, vers, prot, port)
+};
+
+}
+
+// The unions and bounded opaques above, which field lists can not express
+
+template<>
+struct XdrCodec<nfs3::nfs_fh3> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const nfs3::nfs_fh3& value) {
+		return (value.data.size() <= nfs3::NFS3_FHSIZE || encoder.fail()) && encoder.put(value.data);
+	}
+	static bool decode(XdrDecoder& decoder, nfs3::nfs_fh3& value) {
+		if (not decoder.get(value.data)) {
+			return false;
+		}
+		return value.data.size() <= nfs3::NFS3_FHSIZE || decoder.fail("file handle longer than NFS3_FHSIZE");
+	}
+};
+
+template<>
+struct XdrCodec<nfs3::nfs_fh3_view> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const nfs3::nfs_fh3_view& value) {
+		return (value.data.size <= nfs3::NFS3_FHSIZE || encoder.fail()) && encoder.put(value.data);
+	}
+	static bool decode(XdrDecoder& decoder, nfs3::nfs_fh3_view& value) {
+		if (not decoder.get(value.data)) {
+			return false;
+		}
+		return value.data.size <= nfs3::NFS3_FHSIZE || decoder.fail("file handle longer than NFS3_FHSIZE");
+	}
+};
+
+template<>
+struct XdrCodec<nfs3::set_time3> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const nfs3::set_time3& value) {
+		return encoder.put(value.set_it) && (value.set_it != nfs3::time_how::SET_TO_CLIENT_TIME || encoder.put(value.time));
+	}
+	static bool decode(XdrDecoder& decoder, nfs3::set_time3& value) {
+		return decoder.get(value.set_it) && (value.set_it != nfs3::time_how::SET_TO_CLIENT_TIME || decoder.get(value.time));
+	}
+};
+
+template<>
+struct XdrCodec<nfs3::createhow3> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const nfs3::createhow3& value) {
+		if (not encoder.put(value.mode)) {
+			return false;
+		}
+		return (value.mode == nfs3::createmode3::EXCLUSIVE) ? encoder.put(value.verf) : encoder.put(value.obj_attributes);
+	}
+	static bool decode(XdrDecoder& decoder, nfs3::createhow3& value) {
+		if (not decoder.get(value.mode)) {
+			return false;
+		}
+		return (value.mode == nfs3::createmode3::EXCLUSIVE) ? decoder.get(value.verf) : decoder.get(value.obj_attributes);
+	}
+};
+
+static_assert(XdrCodec<nfs3::fattr3>::fixedSize == 84, "fattr3 is 84 bytes on the wire");
+static_assert(XdrCodec<nfs3::wcc_attr>::fixedSize == 24, "wcc_attr is 24 bytes on the wire");
+static_assert(XdrCodec<nfs3::mapping>::fixedSize == 16, "mapping is 16 bytes on the wire");
+static_assert(XdrCodec<nfs3::READ3args>::fixedSize == 0, "READ3args carries a handle of variable size");
@@ -0,0 +1,322 @@
+#include "ReadEngine.hpp"
+#include "RpcEngine.hpp"
+#include "Utils.hpp"
+#include "rpc.hpp"
+#include "NfsTypes.hpp"
+#include "RecordReader.hpp"
+
+#include "logging/Logging.hpp"
+#include "descriptiveenum/DescriptiveEnum.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+static_assert(ReadPolicy::MAX_RSIZE + 4096 <= RecordReader::MAX_RECORD_SIZE, "A READ reply of rsize has to fit into one record");
+
+ReadEngine::ReadEngine(const Context_p& context, const handle_p& file, GenericEnums::AUTH_TYPE authType, const ReadPolicy& policy) : context(context), file(file), authType(authType), rsize(policy.rsize ? policy.rsize : 1), window(policy.window ? policy.window : 1), readaheadMax(0), cache(context->getBlockCache()), nextOffset(0UL), readaheadStart(0UL), readaheadSize(0), readaheadMarker(0UL), fileSize(0UL), sizeKnown(false), opened(false), reads(0UL), readaheadHits(0UL) {
+	if (rsize > ReadPolicy::MAX_RSIZE) {
+		rsize = ReadPolicy::MAX_RSIZE;
+	}
+	if (context->getProtocol() == GenericEnums::PROTOCOL_TYPE::IPPROTO_UDP && rsize > MAX_UDP_RSIZE) {
+		rsize = MAX_UDP_RSIZE;
+	}
+	if (policy.readaheadMax == ReadPolicy::DEFAULT_READAHEAD) {
+		readaheadMax = ReadPolicy::DEFAULT_READAHEAD_READS;
+	} else {
+		readaheadMax = std::min<uint64_t>(policy.readaheadMax / rsize, UINT32_MAX);
+	}
+	if (cache) {
+		fileId.server = context->getServer();
+		fileId.file = *file;
+	}
+}
+
+int64_t ReadEngine::read(uint32_t timeout, uint64_t offset, uint64_t size, uchar_t* dst) {
+	if (size == 0) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (cache) {
+		revalidate(timeout);
+	}
+	uint64_t first = offset / rsize;
+	uint64_t last = (offset + size - 1) / rsize;
+	updateReadahead(offset, first, last);
+	nextOffset = offset + size;
+	fetch(timeout, first, last); // A chunk that could not be sent fails the read below
+
+	uint64_t done = 0;
+	bool failed = false;
+	for (uint64_t index = first; index <= last; ++index) {
+		auto found = chunks.find(index);
+		if (found == chunks.end()) {
+			failed = true; // Could not be sent
+			break;
+		}
+		auto chunk = found->second;
+		if (waitFor(timeout, chunk) != 0 || chunk->getState() != CHUNK_STATE::READY) {
+			if (chunk->status < 0) {
+				DEBUG_LOG(CRITICAL) << "READ failed : " << chunk->status;
+			} else if (chunk->status > 0) {
+				DEBUG_LOG(CRITICAL) << "READ result : " << Context::NFSPROGERRImage::printEnum(static_cast<Context::NFSPROGERR>(chunk->status));
+			}
+			chunks.erase(index);
+			failed = true;
+			break;
+		}
+		if (chunk->attributesKnown) {
+			fileSize = chunk->attributes.size;
+			sizeKnown = true;
+			if (cache && cache->validate(fileId, chunk->attributes, getClockNs()) && index < last) {
+				// The chunks behind this one may have been read before the change
+				chunks.erase(chunks.upper_bound(index), chunks.end());
+				fetch(timeout, index + 1, last);
+			}
+		}
+		if (cache && not chunk->cached && (chunk->size == rsize || chunk->eof)) {
+			BlockCache::Block block;
+			block.data = chunk->data;
+			block.size = chunk->size;
+			block.eof = chunk->eof;
+			cache->insert(fileId, rsize, index, block);
+			chunk->cached = true;
+		}
+
+		uint64_t from = offset + done - index * rsize;
+		if (from < chunk->size) {
+			uint64_t count = std::min<uint64_t>(chunk->size - from, size - done);
+			memcpy(dst + done, chunk->data->data() + from, count);
+			done += count;
+		}
+		if (chunk->size < rsize) {
+			if (not chunk->eof) {
+				chunks.erase(index); // Short reply, the rest is asked for again by the next read
+			}
+			break;
+		}
+	}
+
+	// Everything the read went past is dropped, the chunk it ended in stays for the next read
+	chunks.erase(chunks.begin(), chunks.lower_bound((offset + done) / rsize));
+	if (failed && done == 0) {
+		return -1;
+	}
+	return done;
+}
+
+void ReadEngine::invalidate() {
+	std::lock_guard<std::mutex> lock(mutex);
+	chunks.clear();
+}
+
+// Checks the cached blocks of the file with a GETATTR when it is first read and once their attributes are too old
+void ReadEngine::revalidate(uint32_t timeout) {
+	auto now = getClockNs();
+	if (opened && not cache->attributesExpired(fileId, now)) {
+		return;
+	}
+	opened = true;
+
+	nfs3::GETATTR3args args;
+	args.object.data = *file;
+	RPC::Procedure procedure = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(Context::NFSPROG::NFSPROC3_GETATTR), "GETATTR"};
+	nfs3::GETATTR3res result;
+	auto connection = context->connectNfsPort(timeout, file.get());
+	if (not connection || RPC::callRPC(connection, timeout, procedure, args, result) != 0 || result.status != static_cast<uint32_t>(Context::NFSPROGERR::NFS3_OK)) {
+		DEBUG_LOG(CRITICAL) << "GETATTR failed, cached data of the file is not used";
+		cache->invalidate(fileId);
+		return;
+	}
+	fileSize = result.ok.obj_attributes.size;
+	sizeKnown = true;
+	if (cache->validate(fileId, result.ok.obj_attributes, now)) {
+		chunks.clear(); // Read before the change
+	}
+}
+
+// Makes the chunk of index from a cached block. Returns false if there is none.
+bool ReadEngine::fromCache(uint64_t index) {
+	BlockCache::Block block;
+	if (not cache->find(fileId, rsize, index, block)) {
+		return false;
+	}
+	auto chunk = std::make_shared<Chunk>();
+	chunk->data = block.data;
+	chunk->size = block.size;
+	chunk->eof = block.eof;
+	chunk->cached = true;
+	chunk->state.store(static_cast<int32_t>(CHUNK_STATE::READY), std::memory_order_relaxed);
+	chunks[index] = chunk;
+	return true;
+}
+
+void ReadEngine::updateReadahead(uint64_t offset, uint64_t first, uint64_t last) {
+	bool sequential = (offset == nextOffset) || (readaheadSize && first >= readaheadStart && first < readaheadStart + readaheadSize);
+	if (not sequential) {
+		// Whatever was read ahead is of no use to a random reader
+		readaheadSize = 0;
+		chunks.erase(chunks.begin(), chunks.lower_bound(first));
+		chunks.erase(chunks.upper_bound(last), chunks.end());
+		return;
+	}
+
+	if (readaheadSize == 0) {
+		readaheadStart = last + 1;
+		readaheadSize = initialReadahead(last - first + 1);
+		readaheadMarker = readaheadStart;
+		return;
+	}
+	// The reader got into the readahead, the next one is sent behind it while this one is being read
+	while (last >= readaheadMarker) {
+		readaheadStart += readaheadSize;
+		readaheadSize = nextReadahead(readaheadSize);
+		readaheadMarker = readaheadStart;
+	}
+}
+
+// Sends the chunks of [first, last] not sent yet or failed, then as much of the readahead as the window allows. Returns 0, or -1 if one of the first could not be sent.
+int32_t ReadEngine::fetch(uint32_t timeout, uint64_t first, uint64_t last) {
+	for (uint64_t index = first; index <= last; ++index) {
+		auto found = chunks.find(index);
+		if (found != chunks.end() && found->second->getState() == CHUNK_STATE::FAILED) {
+			chunks.erase(found); // Readahead that failed, asked for again now that it is needed
+			found = chunks.end();
+		}
+		if (found != chunks.end()) {
+			if (found->second->readahead) {
+				readaheadHits.fetch_add(1UL, std::memory_order_relaxed);
+				found->second->readahead = false;
+			}
+			continue;
+		}
+		if (cache && fromCache(index)) {
+			continue;
+		}
+		if (waitForSlot(timeout) != 0 || send(timeout, index, false) != 0) {
+			return -1;
+		}
+	}
+
+	if (readaheadSize == 0) {
+		return 0;
+	}
+	for (uint64_t index = last + 1; index < readaheadStart + readaheadSize; ++index) {
+		if (sizeKnown && index * rsize >= fileSize) {
+			break;
+		}
+		if (chunks.count(index) || (cache && fromCache(index))) {
+			continue;
+		}
+		if (inflight() >= window || send(timeout, index, true) != 0) {
+			break; // The rest is sent by a later read
+		}
+	}
+	return 0;
+}
+
+int32_t ReadEngine::send(uint32_t timeout, uint64_t index, bool readahead) {
+	auto chunk = std::make_shared<Chunk>();
+	chunk->data = std::make_shared<WireBuffer>();
+	if (not chunk->data->reserve(rsize)) {
+		MEM_ALLOC_FAILURE("Failed to allocate memory in ", __FUNCTION__);
+		return -1;
+	}
+	chunk->readahead = readahead;
+	chunk->connection = context->connectNfsPort(timeout, file.get());
+	if (not chunk->connection) {
+		return -1;
+	}
+
+	nfs3::READ3args args;
+	args.file.data = *file;
+	args.offset = index * rsize;
+	args.count = rsize;
+
+	RPC::Procedure procedure = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(Context::NFSPROG::NFSPROC3_READ), "READ"};
+	auto capacity = rsize;
+	// Runs on the thread that reaped the reply, the data is copied out before the reply goes away
+	auto filled = [chunk, capacity](int32_t status, nfs3::READ3res_view& result) {
+		if (status != 0 || result.status != static_cast<uint32_t>(Context::NFSPROGERR::NFS3_OK)) {
+			// Only logged if the chunk is read, readahead that is never read may fail quietly
+			chunk->status = (status != 0) ? status : static_cast<int32_t>(result.status);
+			chunk->state.store(static_cast<int32_t>(CHUNK_STATE::FAILED), std::memory_order_release);
+			return;
+		}
+		chunk->size = std::min(result.ok.data.size, capacity);
+		memcpy(chunk->data->data(), result.ok.data.data, chunk->size);
+		chunk->eof = result.ok.eof;
+		if (result.ok.file_attributes.present) {
+			chunk->attributes = result.ok.file_attributes.value;
+			chunk->attributesKnown = true;
+		}
+		chunk->state.store(static_cast<int32_t>(CHUNK_STATE::READY), std::memory_order_release);
+	};
+	if (RPC::runRPC<nfs3::READ3res_view>(chunk->connection, timeout, procedure, args, filled) != 0) {
+		return -1;
+	}
+	chunks[index] = chunk;
+	reads.fetch_add(1UL, std::memory_order_relaxed);
+	return 0;
+}
+
+int32_t ReadEngine::waitFor(uint32_t timeout, const Chunk_p& chunk) {
+	if (chunk->getState() != CHUNK_STATE::INFLIGHT) {
+		return 0;
+	}
+	auto done = [&chunk]() {
+		return chunk->getState() != CHUNK_STATE::INFLIGHT;
+	};
+	if (chunk->connection->getRpcEngine()->waitUntil(done, timeout) != 0) {
+		DEBUG_LOG(CRITICAL) << "Timed out waiting for a READ of the file";
+		return -1;
+	}
+	return 0;
+}
+
+// Waits for the oldest READ outstanding while the window is full
+int32_t ReadEngine::waitForSlot(uint32_t timeout) {
+	while (inflight() >= window) {
+		for (auto& entry : chunks) {
+			if (entry.second->getState() == CHUNK_STATE::INFLIGHT) {
+				if (waitFor(timeout, entry.second) != 0) {
+					return -1;
+				}
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+uint32_t ReadEngine::inflight() const {
+	uint32_t count = 0;
+	for (auto& entry : chunks) {
+		if (entry.second->getState() == CHUNK_STATE::INFLIGHT) {
+			++count;
+		}
+	}
+	return count;
+}
+
+// Like get_init_ra_size() of Linux: 4 times the read while that is small, 2 times while it is not too large
+uint32_t ReadEngine::initialReadahead(uint64_t requested) const {
+	uint64_t size = 1;
+	while (size < requested && size < readaheadMax) {
+		size <<= 1;
+	}
+	if (size <= readaheadMax / 32) {
+		size *= 4;
+	} else if (size <= readaheadMax / 4) {
+		size *= 2;
+	} else {
+		size = readaheadMax;
+	}
+	return std::min<uint64_t>(size, readaheadMax);
+}
+
+// Like get_next_ra_size() of Linux
+uint32_t ReadEngine::nextReadahead(uint32_t current) const {
+	uint64_t size = (current < readaheadMax / 16) ? current * 4UL : current * 2UL;
+	return std::min<uint64_t>(size, readaheadMax);
+}
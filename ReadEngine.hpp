@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Context.hpp"
+#include "Connection.hpp"
+#include "BufferPool.hpp"
+#include "ReadPolicy.hpp"
+#include "BlockCache.hpp"
+#include "NfsTypes.hpp"
+#include "GenericEnums.hpp"
+#include "types.hpp"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+/*
+ * Reads one file through READs of rsize bytes, each covering an rsize aligned chunk of the file, with up to window of them
+ * outstanding. The chunks a read needs are sent first, then those of its readahead, and the read waits for its own only.
+ *
+ * Readahead follows the on-demand heuristic of Linux. A read that starts where the last one ended, or inside the current
+ * readahead, is sequential: the first one sets up a readahead of 2 or 4 times its size, and reaching the start of the
+ * readahead already fetched pushes the next one behind it, 2 or 4 times larger, up to readaheadMax. A random read drops
+ * the readahead and fetches what it asks for only. A readahead READ that failed is sent again once a read needs its chunk.
+ *
+ * Chunks are buffers, not a cache: one is dropped once a read went past it. With a BlockCache in the context, a chunk is
+ * looked up there before its READ is sent, and one that was read goes into it. The cached blocks of the file are checked
+ * with a GETATTR on the first read and whenever their attributes are too old, see CachePolicy.
+ */
+class ReadEngine {
+	public:
+		// Largest READ over UDP, a reply has to fit into one datagram. Same as the Linux client.
+		constexpr static uint32_t MAX_UDP_RSIZE = 32 * 1024;
+
+		ReadEngine(const Context_p& context, const handle_p& file, GenericEnums::AUTH_TYPE authType, const ReadPolicy& policy);
+
+		template<typename T>
+		ReadEngine(T&&) = delete;
+		template<typename T>
+		ReadEngine& operator=(T&&) = delete;
+
+		/*
+		 * Reads up to size bytes at offset into dst. Returns the number of bytes read, fewer than size at the end of the file
+		 * or after a short READ reply, 0 past the end of the file, or -1 if a READ failed before any byte was read.
+		 */
+		int64_t read(uint32_t timeout, uint64_t offset, uint64_t size, uchar_t* dst);
+		// Drops the chunks fetched so far, e.g. once the file was written through this client. Waits for a read in progress.
+		void invalidate();
+
+		// READs sent, chunks a read found already fetched by readahead, and the current readahead in bytes
+		uint64_t getReads() const {
+			return reads.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getReadaheadHits() const {
+			return readaheadHits.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getReadahead() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return (uint64_t)readaheadSize * rsize;
+		}
+
+	private:
+		DESC_CLASS_ENUM(CHUNK_STATE, int32_t,
+			INFLIGHT,
+			READY,
+			FAILED
+		);
+
+		// One READ. Its completion fills it in and publishes state last, waiting readers only look at state.
+		struct Chunk {
+			std::atomic<int32_t> state;
+			std::shared_ptr<WireBuffer> data; // Shared with the cache
+			uint32_t size; // Bytes the server returned
+			int32_t status; // Of the call, or the NFS status of a reply that failed
+			bool eof;
+			bool attributesKnown; // The reply had the attributes of the file
+			nfs3::fattr3 attributes;
+			bool readahead; // Sent ahead of the reader
+			bool cached; // Came from the cache or went into it
+			Connection_p connection;
+
+			Chunk() : state(static_cast<int32_t>(CHUNK_STATE::INFLIGHT)), size(0), status(0), eof(false), attributesKnown(false), attributes(), readahead(false), cached(false) {}
+
+			CHUNK_STATE getState() const {
+				return static_cast<CHUNK_STATE>(state.load(std::memory_order_acquire));
+			}
+		};
+		using Chunk_p = std::shared_ptr<Chunk>;
+
+		void revalidate(uint32_t timeout);
+		bool fromCache(uint64_t index);
+		void updateReadahead(uint64_t offset, uint64_t first, uint64_t last);
+		int32_t fetch(uint32_t timeout, uint64_t first, uint64_t last);
+		int32_t send(uint32_t timeout, uint64_t index, bool readahead);
+		int32_t waitFor(uint32_t timeout, const Chunk_p& chunk);
+		int32_t waitForSlot(uint32_t timeout);
+		uint32_t inflight() const;
+		uint32_t initialReadahead(uint64_t requested) const;
+		uint32_t nextReadahead(uint32_t current) const;
+
+		Context_p context;
+		handle_p file;
+		GenericEnums::AUTH_TYPE authType;
+		uint32_t rsize;
+		uint32_t window;
+		uint32_t readaheadMax; // In chunks
+		std::shared_ptr<BlockCache> cache;
+		BlockCache::FileId fileId;
+
+		mutable std::mutex mutex; // Held for a whole read, reads of one file go one at a time
+		std::map<uint64_t, Chunk_p> chunks; // By index, offset / rsize
+		uint64_t nextOffset; // Where a sequential read starts
+		uint64_t readaheadStart; // First chunk of the current readahead
+		uint32_t readaheadSize; // Its length in chunks, 0 while reads are random
+		uint64_t readaheadMarker; // Reading this chunk pushes the next readahead
+		uint64_t fileSize; // As the last reply read had it, readahead stops there
+		bool sizeKnown;
+		bool opened; // The cache was checked since the engine was made, as at open() of the file
+
+		std::atomic<uint64_t> reads;
+		std::atomic<uint64_t> readaheadHits;
+};
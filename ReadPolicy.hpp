@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * How a file is read, after the rsize mount option and the readahead of the Linux client. A read is split into READs of
+ * at most rsize bytes, and up to window of them are kept outstanding per file. While a file is read sequentially its
+ * readahead grows towards readaheadMax bytes, a random read turns it off again. By default readaheadMax is 15 READs, as
+ * the Linux NFS client has it. rsize is at most MAX_RSIZE.
+ */
+struct ReadPolicy {
+	constexpr static uint64_t DEFAULT_READAHEAD = UINT64_MAX; // DEFAULT_READAHEAD_READS of rsize
+	constexpr static uint32_t DEFAULT_READAHEAD_READS = 15;
+	constexpr static uint32_t MAX_RSIZE = 1024 * 1024; // A reply has to fit into one record, same as the Linux client
+
+	uint32_t rsize;
+	uint32_t window;
+	uint64_t readaheadMax;
+
+	ReadPolicy() : rsize(1024 * 1024), window(16), readaheadMax(DEFAULT_READAHEAD) {}
+};
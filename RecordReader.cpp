@@ -0,0 +1,167 @@
+#include "RecordReader.hpp"
+#include "xdr.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <string.h>
+
+int32_t RecordReader::space(struct iovec* vectors) {
+	if (ring.empty()) {
+		ring.resize(INITIAL_CAPACITY);
+	}
+	if (buffered() == ring.size()) {
+		grow(ring.size() * 2); // Only if a caller reads without draining
+	}
+	size_t capacity = ring.size();
+	size_t free = capacity - buffered();
+	size_t start = tail & (capacity - 1);
+	size_t first = (free < capacity - start) ? free : capacity - start;
+
+	vectors[0].iov_base = &ring[start];
+	vectors[0].iov_len = first;
+	if (first == free) {
+		return 1;
+	}
+	vectors[1].iov_base = &ring[0];
+	vectors[1].iov_len = free - first;
+	return 2;
+}
+
+void RecordReader::produced(size_t length) {
+	DASSERT(length <= ring.size() - buffered());
+	tail += length;
+}
+
+int32_t RecordReader::drain(const OnRecord& onRecord) {
+	int32_t records = 0;
+	while (true) {
+		if (state == STATE::MARK) {
+			if (buffered() < sizeof(uint32_t)) {
+				break;
+			}
+			uchar_t markBytes[sizeof(uint32_t)];
+			copyOut(head, markBytes, sizeof(markBytes));
+			head += sizeof(uint32_t);
+			uint32_t offset = 0;
+			if (parseMark(xdr_decode_u32(markBytes, offset)) != 0) {
+				return -1;
+			}
+			size_t capacity = ring.size();
+			while (capacity < fragmentSize) {
+				capacity *= 2;
+			}
+			if (capacity != ring.size()) {
+				grow(capacity);
+			}
+		}
+
+		if (buffered() < fragmentSize) {
+			break;
+		}
+		size_t start = head & (ring.size() - 1);
+		if (not scratch.empty() || not lastFragment) {
+			// Part of a record in several fragments, gathered behind the ones before it
+			auto gathered = scratch.size();
+			scratch.resize(gathered + fragmentSize);
+			copyOut(head, &scratch[gathered], fragmentSize);
+			if (lastFragment) {
+				onRecord(scratch.data(), scratch.size());
+				scratch.clear();
+			}
+		} else if (start + fragmentSize <= ring.size()) {
+			onRecord(&ring[start], fragmentSize);
+		} else {
+			scratch.resize(fragmentSize);
+			copyOut(head, scratch.data(), fragmentSize);
+			onRecord(scratch.data(), fragmentSize);
+			scratch.clear();
+		}
+		head += fragmentSize;
+		state = STATE::MARK;
+		if (lastFragment) {
+			++records;
+		}
+	}
+	if (buffered() == 0) {
+		head = tail = 0; // The next read starts at the beginning of the ring, where records do not wrap
+	}
+	return records;
+}
+
+int32_t RecordReader::consume(uchar_t* bytes, size_t length, const OnRecord& onRecord) {
+	int32_t records = 0;
+	size_t consumed = 0;
+	while (buffered() == 0 && state == STATE::MARK && scratch.empty() && length - consumed >= sizeof(uint32_t)) {
+		uint32_t offset = consumed;
+		uint32_t mark = xdr_decode_u32(bytes, offset);
+		uint32_t size = mark & ~LAST_FRAGMENT;
+		if (not (mark & LAST_FRAGMENT) || length - offset < size) {
+			break; // Reassembled or buffered in the ring
+		}
+		if (parseMark(mark) != 0) {
+			return -1;
+		}
+		onRecord(&bytes[offset], size);
+		state = STATE::MARK;
+		consumed = offset + size;
+		++records;
+	}
+
+	while (consumed < length) {
+		struct iovec vectors[2];
+		auto count = space(vectors);
+		for (int32_t i = 0; i < count && consumed < length; ++i) {
+			size_t piece = (vectors[i].iov_len < length - consumed) ? vectors[i].iov_len : length - consumed;
+			memcpy(vectors[i].iov_base, &bytes[consumed], piece);
+			produced(piece);
+			consumed += piece;
+		}
+		auto drained = drain(onRecord);
+		if (drained < 0) {
+			return -1;
+		}
+		records += drained;
+	}
+	return records;
+}
+
+void RecordReader::reset() {
+	head = tail = 0;
+	state = STATE::MARK;
+	fragmentSize = 0;
+	lastFragment = false;
+	scratch.clear();
+}
+
+// Takes the mark in front of the next fragment. Returns 0, or -1 if the mark can not be right.
+int32_t RecordReader::parseMark(uint32_t mark) {
+	fragmentSize = mark & ~LAST_FRAGMENT;
+	lastFragment = (mark & LAST_FRAGMENT) != 0;
+	if (scratch.size() + fragmentSize > MAX_RECORD_SIZE) {
+		DEBUG_LOG(CRITICAL) << "Record of : " << scratch.size() + fragmentSize << " bytes exceeds the limit of : " << static_cast<uint32_t>(MAX_RECORD_SIZE);
+		return -1;
+	}
+	if (fragmentSize == 0 && not lastFragment) {
+		DEBUG_LOG(CRITICAL) << "Empty record fragment that is not the last";
+		return -1; // Legal, but only a corrupt or hostile peer sends them and they would let a record grow without bound
+	}
+	state = STATE::BODY;
+	return 0;
+}
+
+// Moves the buffered bytes to the front of a ring of the given capacity
+void RecordReader::grow(size_t capacity) {
+	std::vector<uchar_t> larger(capacity);
+	auto length = buffered();
+	copyOut(head, larger.data(), length);
+	ring.swap(larger);
+	head = 0;
+	tail = length;
+}
+
+void RecordReader::copyOut(size_t position, uchar_t* dst, size_t length) {
+	size_t start = position & (ring.size() - 1);
+	size_t first = (length < ring.size() - start) ? length : ring.size() - start;
+	memcpy(dst, &ring[start], first);
+	memcpy(dst + first, &ring[0], length - first);
+}
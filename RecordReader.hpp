@@ -0,0 +1,70 @@
+#pragma once
+
+#include "descriptiveenum/DescriptiveEnum.hpp"
+#include "types.hpp"
+
+#include <functional>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Splits the byte stream of a TCP connection into RPC records. Bytes are read into a ring, as many as the socket has
+ * per read, and record marks are parsed incrementally, so one read may complete any number of replies and one reply may
+ * take any number of reads.
+ *
+ * Records may come in any number of fragments (RFC 5531 record marking). A record sent as a single fragment and lying in
+ * one piece in the ring is handed out in place. One that wraps around the end of the ring is copied out once, and the
+ * fragments of a multi-fragment record are gathered into one buffer as they complete. The ring grows when a fragment
+ * does not fit in it, and restarts at its beginning whenever it runs empty, so wrapping is rare. Only one thread may use
+ * a reader at a time.
+ */
+class RecordReader {
+	public:
+		using OnRecord = std::function<void(uchar_t*, int32_t)>;
+
+		constexpr static size_t INITIAL_CAPACITY = 64 * 1024; // Power of two
+		constexpr static uint32_t MAX_RECORD_SIZE = 4 * 1024 * 1024; // Larger records mean a corrupt stream
+		constexpr static uint32_t LAST_FRAGMENT = 1u << 31; // Set in the mark of the fragment that ends a record
+
+		RecordReader() : head(0), tail(0), state(STATE::MARK), fragmentSize(0), lastFragment(false) {}
+
+		template<typename T>
+		RecordReader(T&&) = delete;
+		template<typename T>
+		RecordReader& operator=(T&&) = delete;
+
+		// Sets vectors to the free space of the ring, for one readv. Returns the number of vectors, 1 or 2.
+		int32_t space(struct iovec* vectors);
+		// Accounts for length bytes read into the vectors returned by space()
+		void produced(size_t length);
+		// Hands out every complete record. Returns the number of records, or -1 if the stream is corrupt.
+		int32_t drain(const OnRecord& onRecord);
+		// Same for bytes received elsewhere. Records wholly inside bytes are handed out in place, the rest is buffered.
+		int32_t consume(uchar_t* bytes, size_t length, const OnRecord& onRecord);
+		void reset();
+
+		size_t buffered() const {
+			return tail - head;
+		}
+
+	private:
+		DESC_CLASS_ENUM(STATE, uint32_t,
+			None,
+			MARK,
+			BODY
+		);
+
+		int32_t parseMark(uint32_t mark);
+		void grow(size_t capacity);
+		void copyOut(size_t position, uchar_t* dst, size_t length);
+
+		std::vector<uchar_t> ring;
+		std::vector<uchar_t> scratch; // Holds a record that wraps around the end of the ring, or is being reassembled
+		size_t head; // Positions only ever grow, the index into the ring is position & (ring.size() - 1)
+		size_t tail;
+		STATE state;
+		uint32_t fragmentSize; // Of the fragment being received
+		bool lastFragment;
+};
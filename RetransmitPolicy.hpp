@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * When an RPC is retransmitted and when it is given up on, after the timeo/retrans/soft mount options of the Linux
+ * client. Every timeoMs without a reply a UDP call is sent again (a minor timeout), doubling the wait up to maxTimeoMs.
+ * After retrans minor timeouts comes a major timeout: a soft call fails with -ETIMEDOUT, a hard one reports the server
+ * as not responding and starts over from timeoMs. Either way a call never outlives the deadline it was submitted with.
+ *
+ * A reply of NFS3ERR_JUKEBOX means the server is busy, e.g. recalling a file from tape. The call is sent again with a new
+ * xid after jukeboxMs, or the reply is handed to the caller if jukeboxMs is 0.
+ */
+struct RetransmitPolicy {
+	uint32_t timeoMs;
+	uint32_t maxTimeoMs;
+	uint32_t retrans;
+	bool soft;
+	uint32_t jukeboxMs;
+
+	RetransmitPolicy() : timeoMs(1100), maxTimeoMs(60000), retrans(3), soft(false), jukeboxMs(5000) {}
+};
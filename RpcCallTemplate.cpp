@@ -0,0 +1,62 @@
+#include "RpcCallTemplate.hpp"
+#include "Utils.hpp"
+#include "XdrCodec.hpp"
+#include "rpc.hpp"
+
+#include <string.h>
+
+namespace {
+
+std::vector<RpcCallTemplate> makeTemplates() {
+	const GenericEnums::RPC_VERSION rpcVersions[] = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_VERSION::RPC_VERSION1};
+	const GenericEnums::RPC_PROGRAM programs[] = {GenericEnums::RPC_PROGRAM::NFS, GenericEnums::RPC_PROGRAM::MOUNT, GenericEnums::RPC_PROGRAM::PORTMAP, GenericEnums::RPC_PROGRAM::NLM};
+	const GenericEnums::PROGRAM_VERSION programVersions[] = {GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION2};
+	const GenericEnums::AUTH_TYPE authTypes[] = {GenericEnums::AUTH_TYPE::AUTH_SYS, GenericEnums::AUTH_TYPE::AUTH_NONE};
+
+	std::vector<RpcCallTemplate> templates; // Most used first, find() searches in order
+	for (auto rpcVersion : rpcVersions) {
+		for (auto program : programs) {
+			for (auto programVersion : programVersions) {
+				for (auto authType : authTypes) {
+					templates.emplace_back(rpcVersion, program, programVersion, authType);
+				}
+			}
+		}
+	}
+	return templates;
+}
+
+}
+
+RpcCallTemplate::RpcCallTemplate(GenericEnums::RPC_VERSION rpcVersion, GenericEnums::RPC_PROGRAM program, GenericEnums::PROGRAM_VERSION programVersion, GenericEnums::AUTH_TYPE authType) : rpcVersion(rpcVersion), program(program), programVersion(programVersion), authType(authType) {
+	uchar_t wireBytes[GenericEnums::MOUNT_REQUEST_SIZE];
+	uint32_t size = RPC::makeRPC(0, GenericEnums::RPCTYPE::CALL, rpcVersion, program, programVersion, wireBytes);
+	DASSERT(size == PROCEDURE_OFFSET);
+	size += xdr_encode_u32(&wireBytes[size], 0); // Procedure, set by build()
+	if (authType == GenericEnums::AUTH_TYPE::AUTH_SYS) {
+		size += RPC::addAuthSys(&wireBytes[size]);
+	} else {
+		DASSERT(authType == GenericEnums::AUTH_TYPE::AUTH_NONE);
+		for (uint32_t i = 0; i < 4; ++i) {
+			size += xdr_encode_u32(&wireBytes[size], 0); // AUTH_NONE credential and verifier, both empty
+		}
+	}
+	bytes.assign(wireBytes, wireBytes + size);
+}
+
+const RpcCallTemplate* RpcCallTemplate::find(GenericEnums::RPC_VERSION rpcVersion, GenericEnums::RPC_PROGRAM program, GenericEnums::PROGRAM_VERSION programVersion, GenericEnums::AUTH_TYPE authType) {
+	static const std::vector<RpcCallTemplate> templates = makeTemplates();
+	for (auto& callTemplate : templates) {
+		if (callTemplate.program == program && callTemplate.programVersion == programVersion && callTemplate.authType == authType && callTemplate.rpcVersion == rpcVersion) {
+			return &callTemplate;
+		}
+	}
+	return nullptr;
+}
+
+uint32_t RpcCallTemplate::build(uchar_t* wireBytes, uint32_t xid, uint32_t procedure) const {
+	memcpy(wireBytes, bytes.data(), bytes.size());
+	xdrPut32(&wireBytes[XID_OFFSET], xid);
+	xdrPut32(&wireBytes[PROCEDURE_OFFSET], procedure);
+	return bytes.size();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "descriptiveenum/DescriptiveEnum.hpp"
+#include "GenericEnums.hpp"
+#include "types.hpp"
+
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Pre-encoded head of an RPC call: the record mark, the call header, the credential and the verifier. Only the xid
+ * and the procedure differ between calls of one program, version and credential, so a request starts as a copy of the
+ * template with those two patched in. The record mark is left for the caller to fill in once the arguments follow.
+ *
+ * The templates of every program, version and flavor we speak are encoded once, on first use, and never change after,
+ * so they are shared by all threads without locking. An AUTH_SYS credential carries a stamp taken when they are made.
+ */
+class RpcCallTemplate {
+	public:
+		constexpr static uint32_t XID_OFFSET = 4;
+		constexpr static uint32_t PROCEDURE_OFFSET = 24;
+
+		// Returns nullptr for a combination we do not speak, e.g. an unsupported flavor
+		static const RpcCallTemplate* find(GenericEnums::RPC_VERSION rpcVersion, GenericEnums::RPC_PROGRAM program, GenericEnums::PROGRAM_VERSION programVersion, GenericEnums::AUTH_TYPE authType);
+
+		// Copies the template to wireBytes with xid and procedure set. Returns the number of bytes written.
+		uint32_t build(uchar_t* wireBytes, uint32_t xid, uint32_t procedure) const;
+
+		uint32_t size() const {
+			return bytes.size();
+		}
+
+		// Encodes a template, callers share the ones find() returns instead
+		RpcCallTemplate(GenericEnums::RPC_VERSION rpcVersion, GenericEnums::RPC_PROGRAM program, GenericEnums::PROGRAM_VERSION programVersion, GenericEnums::AUTH_TYPE authType);
+
+	private:
+		GenericEnums::RPC_VERSION rpcVersion;
+		GenericEnums::RPC_PROGRAM program;
+		GenericEnums::PROGRAM_VERSION programVersion;
+		GenericEnums::AUTH_TYPE authType;
+		std::vector<uchar_t> bytes;
+};
@@ -0,0 +1,506 @@
+#include "RpcEngine.hpp"
+#include "Context.hpp"
+#include "Utils.hpp"
+#include "xdr.hpp"
+#include "XdrCodec.hpp"
+#include "EventLoop.hpp"
+#include "RpcCallTemplate.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+constexpr uint32_t PROGRAM_OFFSET = 16; // Past the record mark, xid, message type and RPC version
+
+// True if the call is to the NFS program, whose replies may ask for the call again later with NFS3ERR_JUKEBOX
+bool isNfsCall(const struct iovec* request, int32_t count) {
+	if (count < 1 || request[0].iov_len < PROGRAM_OFFSET + sizeof(uint32_t)) {
+		return false;
+	}
+	uint32_t offset = PROGRAM_OFFSET;
+	return xdr_decode_u32(static_cast<uchar_t*>(request[0].iov_base), offset) == static_cast<uint32_t>(GenericEnums::RPC_PROGRAM::NFS);
+}
+
+// True if the reply was accepted and executed, and the procedure's status is NFS3ERR_JUKEBOX
+bool isJukebox(uchar_t* reply, int32_t replySize) {
+	XdrDecoder decoder(reply, replySize);
+	uint32_t xid;
+	uint32_t type;
+	uint32_t replyStatus;
+	uint32_t verifierType;
+	XdrBytesView verifier;
+	uint32_t acceptStatus;
+	uint32_t status;
+	return decoder.get(xid) && decoder.get(type) && decoder.get(replyStatus) && replyStatus == 0 && decoder.get(verifierType) && decoder.get(verifier) &&
+			decoder.get(acceptStatus) && acceptStatus == 0 && decoder.get(status) && status == static_cast<uint32_t>(Context::NFSPROGERR::NFS3ERR_JUKEBOX);
+}
+
+}
+
+int32_t RpcEngine::submit(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, Completion completion) {
+	struct iovec request = {wireRequest, (size_t)requestSize};
+	return submit(timeout, xid, &request, 1, completion);
+}
+
+int32_t RpcEngine::submit(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, Completion completion) {
+	auto now = getClockNs();
+	PendingCall call = {completion, now, now + timeout * 1000000000UL, false, nullptr, 0, 0UL, policy.timeoMs, 0, xid, policy.jukeboxMs && isNfsCall(request, count), false, {}, 0};
+	if (connection->isDatagram() || (call.jukebox && count > MAX_PIECES)) {
+		if (not keepCopy(call, xid, request, count)) {
+			return -1;
+		}
+	} else if (call.jukebox) {
+		std::copy(request, request + count, call.pieces);
+		call.pieceCount = count;
+	}
+	call.timerAt = nextTimer(call, now);
+	auto timerAt = call.timerAt;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (pending.size() >= depth && connection->onDriverThread()) {
+			// Nobody else can free a slot while the thread feeding replies in sleeps here
+			DEBUG_LOG(CRITICAL) << "Window full, xid : " << xid << " can not be submitted from the thread feeding replies";
+			return -1;
+		}
+		while (pending.size() >= depth) {
+			if (waitForProgress(lock, timeout) < 0) {
+				DEBUG_LOG(CRITICAL) << "No free slot to submit xid : " << xid << " with " << pending.size() << " calls in flight";
+				return -1;
+			}
+		}
+		// Register before sending so that a fast reply can never beat its own pending entry
+		if (not pending.insert(xid, std::move(call))) {
+			DEBUG_LOG(CRITICAL) << "xid : " << xid << " is already in flight";
+			return -1;
+		}
+	}
+	timers.schedule(xid, timerAt);
+
+	if (connection->send(request, count) != 0) {
+		forget(xid);
+		connection->disconnect(); // A partly sent record leaves the stream unusable, the next call opens a new socket
+		return -1;
+	}
+	markSent(xid);
+	return 0;
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, uchar_t* wireResponse, int32_t responseCapacity, int32_t& responseSize) {
+	struct iovec request = {wireRequest, (size_t)requestSize};
+	return call(timeout, xid, &request, 1, wireResponse, responseCapacity, responseSize);
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, uchar_t* wireResponse, int32_t responseCapacity, int32_t& responseSize) {
+	responseSize = 0;
+	auto copy = [&](int32_t replyStatus, uchar_t* reply, int32_t replySize) {
+		if (replyStatus == 0 && replySize > responseCapacity) {
+			DEBUG_LOG(CRITICAL) << "Reply of size : " << replySize << " for xid : " << xid << " does not fit in buffer of size : " << responseCapacity;
+		} else if (replyStatus == 0) {
+			memcpy(wireResponse, reply, replySize);
+			responseSize = replySize;
+		}
+	};
+	auto status = call(timeout, xid, request, count, copy);
+	return (status == 0 && responseSize == 0) ? -1 : status;
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, WireBuffer& response, int32_t& responseSize) {
+	struct iovec request = {wireRequest, (size_t)requestSize};
+	return call(timeout, xid, &request, 1, response, responseSize);
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, WireBuffer& response, int32_t& responseSize) {
+	responseSize = 0;
+	auto copy = [&](int32_t replyStatus, uchar_t* reply, int32_t replySize) {
+		if (replyStatus == 0 && response.reserve(replySize)) {
+			memcpy(response.data(), reply, replySize);
+			responseSize = replySize;
+		}
+	};
+	auto status = call(timeout, xid, request, count, copy);
+	return (status == 0 && responseSize == 0) ? -ENOMEM : status;
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, Completion completion) {
+	struct iovec request = {wireRequest, (size_t)requestSize};
+	return call(timeout, xid, &request, 1, completion);
+}
+
+int32_t RpcEngine::call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, Completion completion) {
+	bool done = false;
+	int32_t status = -1;
+
+	auto waited = [&](int32_t replyStatus, uchar_t* reply, int32_t replySize) {
+		completion(replyStatus, reply, replySize);
+		std::lock_guard<std::mutex> lock(mutex);
+		status = replyStatus;
+		done = true;
+	};
+
+	if (submit(timeout, xid, request, count, waited) != 0) {
+		return -1;
+	}
+	return (wait(xid, timeout, done) == 0) ? status : -1;
+}
+
+// Waits until the completion of xid set done. Returns 0, or -1 if the call timed out and was forgotten.
+int32_t RpcEngine::wait(uint32_t xid, uint32_t timeout, bool& done) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not done) {
+		if (waitForProgress(lock, timeout) < 0 && not done) {
+			if (forget(xid)) {
+				DEBUG_LOG(CRITICAL) << "Timed out waiting for reply to xid : " << xid;
+				return -1;
+			}
+			// The reaper already owns our completion, wait for it to finish
+		}
+	}
+	return 0;
+}
+
+int32_t RpcEngine::reap(uint32_t timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (pending.empty()) {
+		return 0;
+	}
+	return waitForProgress(lock, timeout);
+}
+
+int32_t RpcEngine::drain(uint32_t timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not pending.empty()) {
+		if (waitForProgress(lock, timeout) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// A completion finishes before wakeAll() takes the lock, so one that finishes after done() was checked still wakes the wait
+int32_t RpcEngine::waitUntil(const std::function<bool()>& done, uint32_t timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not done()) {
+		if (waitForProgress(lock, timeout) < 0 && not done()) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void RpcEngine::abort(int32_t status) {
+	std::vector<std::pair<uint32_t, PendingCall>> aborted;
+	pending.takeAll(aborted);
+	for (auto& entry : aborted) {
+		untrack(entry.second);
+	}
+	for (auto& entry : aborted) {
+		DEBUG_LOG(CRITICAL) << "Aborting xid : " << entry.first;
+		entry.second.completion(status, nullptr, 0);
+	}
+	wakeAll();
+}
+
+void RpcEngine::setDepth(uint32_t newDepth) {
+	std::lock_guard<std::mutex> lock(mutex);
+	depth = newDepth ? newDepth : 1;
+	progress.notify_all();
+}
+
+/*
+ * Called with the lock held. Either becomes the reaper and completes the replies of one read, or waits for the current
+ * reaper (or a sender) to make progress. Returns the number of calls completed, or -1 on timeout or receive failure.
+ */
+int32_t RpcEngine::waitForProgress(std::unique_lock<std::mutex>& lock, uint32_t timeout) {
+	if (not reaping && (sentCount > 0 || delayedCount > 0) && not connection->isDriven()) {
+		reaping = true;
+		lock.unlock();
+		auto completed = reapOne(timeout);
+		lock.lock();
+		reaping = false;
+		progress.notify_all();
+		return completed;
+	}
+
+	if (progress.wait_for(lock, std::chrono::seconds(timeout)) == std::cv_status::timeout) {
+		return -1;
+	}
+	return 0;
+}
+
+int32_t RpcEngine::reapOne(uint32_t timeout) {
+	int32_t completed = 0;
+	auto onReply = [this, &completed](uchar_t* reply, int32_t replySize) {
+		completed += dispatch(reply, replySize);
+	};
+
+	if (sentCount == 0) {
+		// Only calls waiting out NFS3ERR_JUKEBOX, nothing can arrive until they are sent again or another call is sent
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			progress.wait_for(lock, std::chrono::milliseconds(static_cast<uint32_t>(EventLoop::TICK_MS)));
+		}
+		return expire(getClockNs());
+	}
+
+	if (connection->isDatagram()) {
+		// Wake at least every second so that lost datagrams are retransmitted, and reap a whole batch per wakeup
+		auto status = connection->receiveDatagrams((timeout > 1) ? 1 : timeout, onReply);
+		if (status == -1) {
+			connection->disconnect();
+			return -1;
+		}
+		return completed + expire(getClockNs());
+	}
+
+	// Every reply that one read completes is dispatched, not only the one the caller waits for
+	// Wakes every second too while a call waits out NFS3ERR_JUKEBOX, to send it again in time
+	auto slice = (delayedCount > 0 && timeout > 1) ? 1 : timeout;
+	auto status = connection->receiveRecords(slice, onReply);
+	if (status == -ETIMEDOUT && slice < timeout) {
+		return expire(getClockNs());
+	}
+	if (status < 0) {
+		if (status != -ETIMEDOUT) {
+			connection->disconnect(); // Fails every call on the socket, the next call opens a new one
+		}
+		return -1;
+	}
+	return completed + expire(getClockNs());
+}
+
+// Completes the call owning the reply's xid. Returns 1 if a call was completed, 0 if the reply was unsolicited.
+int32_t RpcEngine::dispatch(uchar_t* reply, int32_t replySize) {
+	if (replySize < (int32_t)sizeof(uint32_t)) {
+		DEBUG_LOG(CRITICAL) << "Dropping runt reply of size : " << replySize;
+		return 0;
+	}
+
+	uint32_t offset = 0;
+	uint32_t xid = xdr_decode_u32(reply, offset);
+
+	PendingCall call;
+	if (not take(xid, call)) {
+		DEBUG_LOG(CRITICAL) << "Dropping reply for unknown xid : " << xid;
+		return 0;
+	}
+	auto now = getClockNs();
+	// The caller's request is still valid, its completion has not run, so it is only copied now that it is needed again
+	if (call.jukebox && call.deadline > now && isJukebox(reply, replySize) && (call.request || keepCopy(call, xid, call.pieces, call.pieceCount))) {
+		// The server is busy, send the call again later rather than hand the caller a reply it has to retry itself
+		delay(xid, std::move(call), now);
+		return 0;
+	}
+	if (call.callerXid != xid) {
+		xdr_encode_u32(reply, call.callerXid); // Sent again under a new xid, the caller matches the reply by the old one
+	}
+	auto sample = now - call.submitTime;
+	auto average = latencyNs.load(std::memory_order_relaxed);
+	// Racing replies may each drop the other's sample, which an average can live with
+	latencyNs.store(average ? (average * 7 + sample) / 8 : sample, std::memory_order_relaxed); // Weighs the last eight replies most
+
+	call.completion(0, reply, replySize);
+
+	wakeAll();
+	return 1;
+}
+
+/*
+ * Handles the timers that came due: fails calls whose deadline passed, or that hit a major timeout on a soft policy,
+ * retransmits UDP calls, and sends calls that waited out NFS3ERR_JUKEBOX again. Returns the number of calls failed.
+ */
+uint32_t RpcEngine::expire(uint64_t now) {
+	std::vector<TimerWheel::Timer> due;
+	timers.advance(now, due);
+	if (due.empty()) {
+		return 0;
+	}
+
+	std::vector<std::pair<uint32_t, PendingCall>> expired;
+	std::vector<std::pair<uint32_t, PendingCall>> resumed;
+	std::vector<TimerWheel::Timer> rescheduled;
+	std::vector<std::pair<std::shared_ptr<WireBuffer>, uint32_t>> resend; // Shared with the call, which may complete before it is sent
+	for (auto& timer : due) {
+		PendingCall call;
+		auto taken = pending.takeIf(timer.id, [&](PendingCall& candidate) {
+			if (candidate.timerAt != timer.at) {
+				return false; // Replaced by a later timer
+			}
+			if (candidate.deadline <= now || candidate.delayed) {
+				return true;
+			}
+			if (candidate.sent && candidate.requestSize && connection->isDatagram()) {
+				if (++candidate.retransmits > policy.retrans) {
+					++majorTimeouts;
+					if (policy.soft) {
+						return true;
+					}
+					DEBUG_LOG(CRITICAL) << "Server not responding to xid : " << timer.id << ", still trying";
+					candidate.retransmits = 0;
+					candidate.timeoutMs = policy.timeoMs;
+				} else {
+					candidate.timeoutMs = (candidate.timeoutMs < policy.maxTimeoMs / 2) ? candidate.timeoutMs * 2 : policy.maxTimeoMs;
+				}
+				++retransmits;
+				resend.emplace_back(candidate.request, candidate.requestSize);
+			}
+			candidate.timerAt = nextTimer(candidate, now);
+			rescheduled.push_back({timer.id, candidate.timerAt});
+			return false;
+		}, call);
+		if (not taken) {
+			continue;
+		}
+		untrack(call);
+		if (call.delayed && call.deadline > now) {
+			resumed.emplace_back(timer.id, std::move(call));
+		} else {
+			expired.emplace_back(timer.id, std::move(call));
+		}
+	}
+
+	for (auto& timer : rescheduled) {
+		timers.schedule(timer.id, timer.at);
+	}
+	if (not resend.empty()) {
+		// Same xid, a reply to any of the copies completes the call and later ones are dropped as unknown
+		connection->cork();
+		for (auto& request : resend) {
+			connection->send(request.first->data(), request.second);
+		}
+		connection->uncork();
+	}
+	for (auto& entry : resumed) {
+		resubmit(entry.first, std::move(entry.second), now);
+	}
+	for (auto& entry : expired) {
+		DEBUG_LOG(CRITICAL) << "xid : " << entry.first << " timed out";
+		entry.second.completion(-ETIMEDOUT, nullptr, 0);
+	}
+	if (not expired.empty()) {
+		wakeAll();
+	}
+	return expired.size();
+}
+
+// When the live timer of a call sent at now fires: its next retransmission over UDP, otherwise its deadline
+uint64_t RpcEngine::nextTimer(const PendingCall& call, uint64_t now) const {
+	if (not connection->isDatagram()) {
+		return call.deadline;
+	}
+	auto at = now + call.timeoutMs * 1000000UL;
+	return (at < call.deadline) ? at : call.deadline;
+}
+
+// Parks a call that got NFS3ERR_JUKEBOX for policy.jukeboxMs, or until its deadline if that comes first
+void RpcEngine::delay(uint32_t xid, PendingCall&& call, uint64_t now) {
+	auto at = now + policy.jukeboxMs * 1000000UL;
+	call.timerAt = (at < call.deadline) ? at : call.deadline;
+	call.sent = false;
+	call.delayed = true;
+	auto timerAt = call.timerAt;
+	++delayedCount;
+	if (not pending.insert(xid, std::move(call))) {
+		--delayedCount;
+		DEBUG_LOG(CRITICAL) << "xid : " << xid << " was reused while its call waited out NFS3ERR_JUKEBOX";
+		call.completion(-EIO, nullptr, 0);
+		wakeAll();
+		return;
+	}
+	timers.schedule(xid, timerAt);
+	wakeAll(); // A blocking reaper must now wake up for the delayed call
+}
+
+// Sends a call that waited out NFS3ERR_JUKEBOX again under a new xid, so that the server does not answer it from its
+// duplicate request cache
+void RpcEngine::resubmit(uint32_t oldXid, PendingCall&& call, uint64_t now) {
+	auto xid = nextXid();
+	xdr_encode_u32(call.request->data() + RpcCallTemplate::XID_OFFSET, xid);
+	call.delayed = false;
+	call.retransmits = 0;
+	call.timeoutMs = policy.timeoMs;
+	call.timerAt = nextTimer(call, now);
+	auto timerAt = call.timerAt;
+	auto wireRequest = call.request; // Shared, the call may complete before it is sent
+	auto requestSize = call.requestSize;
+	if (not pending.insert(xid, std::move(call))) {
+		DEBUG_LOG(CRITICAL) << "xid : " << xid << " is already in flight, failing xid : " << oldXid;
+		call.completion(-EIO, nullptr, 0);
+		wakeAll();
+		return;
+	}
+	timers.schedule(xid, timerAt);
+	++jukeboxRetries;
+	DEBUG_LOG(CRITICAL) << "Sending xid : " << oldXid << " again as xid : " << xid << " after NFS3ERR_JUKEBOX";
+
+	if (connection->send(wireRequest->data(), requestSize) != 0) {
+		PendingCall failed;
+		if (take(xid, failed)) {
+			failed.completion(-EIO, nullptr, 0);
+		}
+		connection->disconnect();
+		return;
+	}
+	markSent(xid);
+}
+
+// Copies the request of a call into one buffer of its own, to send it again. Returns false if out of memory.
+bool RpcEngine::keepCopy(PendingCall& call, uint32_t xid, const struct iovec* request, int32_t count) {
+	uint32_t size = 0;
+	for (int32_t i = 0; i < count; ++i) {
+		size += request[i].iov_len;
+	}
+	auto copy = std::make_shared<WireBuffer>();
+	if (not copy->reserve(size)) {
+		DEBUG_LOG(CRITICAL) << "Could not allocate " << size << " bytes to keep xid : " << xid << " for retransmission";
+		return false;
+	}
+	uint32_t copied = 0;
+	for (int32_t i = 0; i < count; ++i) {
+		memcpy(copy->data() + copied, request[i].iov_base, request[i].iov_len);
+		copied += request[i].iov_len;
+	}
+	call.request = std::move(copy);
+	call.requestSize = size;
+	return true;
+}
+
+void RpcEngine::markSent(uint32_t xid) {
+	pending.update(xid, [this](PendingCall& sent) {
+		sent.sent = true;
+		++sentCount;
+	});
+	wakeAll();
+}
+
+// Called for every call taken out of the table. Its marks were set with its shard locked, so never after the take saw them.
+void RpcEngine::untrack(const PendingCall& call) {
+	if (call.sent) {
+		--sentCount;
+	}
+	if (call.delayed) {
+		--delayedCount;
+	}
+}
+
+// Takes the call of xid out of the table. Returns false if it is no longer pending, i.e. its completion already ran or is running.
+bool RpcEngine::take(uint32_t xid, PendingCall& call) {
+	if (not pending.take(xid, call)) {
+		return false;
+	}
+	untrack(call);
+	return true;
+}
+
+bool RpcEngine::forget(uint32_t xid) {
+	PendingCall call;
+	return take(xid, call);
+}
+
+void RpcEngine::wakeAll() {
+	std::lock_guard<std::mutex> lock(mutex);
+	progress.notify_all();
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Connection.hpp"
+#include "BufferPool.hpp"
+#include "RetransmitPolicy.hpp"
+#include "TimerWheel.hpp"
+#include "XidTable.hpp"
+#include "types.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Keeps up to 'depth' RPC calls outstanding on one Connection and hands every reply back to the call that owns its xid.
+ * On a blocking Connection there is no dedicated receiver: whichever caller needs progress becomes the reaper, pulls replies
+ * off the socket and completes them, while other callers wait for it (leader/follower). On a Connection driven by an
+ * EventLoop, or by its own reader thread in full duplex mode, that thread feeds replies in through dispatch() and fails
+ * overdue calls through expire().
+ *
+ * Outstanding calls live in an XidTable, so matching a reply to its call only locks the shard of its xid. The engine
+ * mutex guards the window, the reaper role and the wakeups only.
+ *
+ * Every call has one timer on a TimerWheel, for its next retransmission or its deadline, and expire() only looks at the
+ * timers that came due. Over UDP a call keeps a copy of its request and is retransmitted with the same xid as its
+ * RetransmitPolicy says. An NFS call otherwise only points at the caller's request, and copies it when an NFS3ERR_JUKEBOX
+ * reply asks for it to be sent again later. A blocking reaper wakes at least every second while either is waiting.
+ */
+class RpcEngine {
+	public:
+		// status is 0 on success, negative on failure. reply is only valid for the duration of the callback.
+		using Completion = std::function<void(int32_t status, uchar_t* reply, int32_t replySize)>;
+
+		RpcEngine(Connection* connection, uint32_t depth, const RetransmitPolicy& policy = RetransmitPolicy()) : connection(connection), depth(depth ? depth : 1), policy(policy), reaping(false), sentCount(0), delayedCount(0), latencyNs(0UL), retransmits(0UL), majorTimeouts(0UL), jukeboxRetries(0UL) {}
+
+		template<typename T>
+		RpcEngine(T&&) = delete;
+		template<typename T>
+		RpcEngine& operator=(T&&) = delete;
+
+		// wireRequest must stay valid until completion ran, an NFS3ERR_JUKEBOX reply copies it to send the call again
+		int32_t submit(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, Completion completion);
+		int32_t call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, uchar_t* wireResponse, int32_t responseCapacity, int32_t& responseSize);
+
+		// Same, for a request in pieces, e.g. the RPC header followed by a WRITE payload. The request must stay valid until completion ran.
+		int32_t submit(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, Completion completion);
+		int32_t call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, uchar_t* wireResponse, int32_t responseCapacity, int32_t& responseSize);
+		// Same as submit(), and returns once completion ran, with the status it got. Returns -1 without running it if the call could not be sent or timed out.
+		int32_t call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, Completion completion);
+		int32_t call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, Completion completion);
+		// Same, with a response buffer that grows to whatever size the reply has
+		int32_t call(uint32_t timeout, uint32_t xid, uchar_t* wireRequest, int32_t requestSize, WireBuffer& response, int32_t& responseSize);
+		int32_t call(uint32_t timeout, uint32_t xid, const struct iovec* request, int32_t count, WireBuffer& response, int32_t& responseSize);
+		int32_t reap(uint32_t timeout);
+		int32_t drain(uint32_t timeout);
+		// Waits until done() holds, reaping on a blocking connection. done() runs under the engine lock, it may not lock what a completion holds.
+		int32_t waitUntil(const std::function<bool()>& done, uint32_t timeout);
+		int32_t dispatch(uchar_t* reply, int32_t replySize);
+		uint32_t expire(uint64_t now);
+		void abort(int32_t status);
+
+		void setDepth(uint32_t newDepth);
+
+		uint32_t getDepth() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return depth;
+		}
+
+		uint32_t getOutstanding() const {
+			return pending.size();
+		}
+
+		// Moving average of the time from submit to reply, 0 until the first reply
+		uint64_t getLatency() const {
+			return latencyNs.load(std::memory_order_relaxed);
+		}
+
+		// Calls sent again after a minor timeout, major timeouts, and calls sent again after NFS3ERR_JUKEBOX
+		uint64_t getRetransmits() const {
+			return retransmits.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getMajorTimeouts() const {
+			return majorTimeouts.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getJukeboxRetries() const {
+			return jukeboxRetries.load(std::memory_order_relaxed);
+		}
+
+	private:
+		constexpr static int32_t MAX_PIECES = 4; // Of a request kept by reference, one in more pieces is copied at submit
+
+		struct PendingCall {
+			Completion completion;
+			uint64_t submitTime;
+			uint64_t deadline;
+			bool sent;
+			std::shared_ptr<WireBuffer> request; // Copy resent as is, made at submit over UDP and on NFS3ERR_JUKEBOX otherwise
+			uint32_t requestSize;
+			uint64_t timerAt; // When its live timer fires, older timers for it are ignored
+			uint32_t timeoutMs; // Current minor timeout
+			uint32_t retransmits; // Since the last major timeout
+			uint32_t callerXid; // xid the caller knows the call by, it is sent under a new one after NFS3ERR_JUKEBOX
+			bool jukebox; // Sent again on NFS3ERR_JUKEBOX
+			bool delayed; // Waiting out NFS3ERR_JUKEBOX, nothing on the wire
+			struct iovec pieces[MAX_PIECES]; // The caller's request, valid until completion ran
+			int32_t pieceCount;
+		};
+
+		int32_t waitForProgress(std::unique_lock<std::mutex>& lock, uint32_t timeout);
+		int32_t reapOne(uint32_t timeout);
+		int32_t wait(uint32_t xid, uint32_t timeout, bool& done);
+		void markSent(uint32_t xid);
+		void untrack(const PendingCall& call);
+		bool take(uint32_t xid, PendingCall& call);
+		bool forget(uint32_t xid);
+		void wakeAll();
+		uint64_t nextTimer(const PendingCall& call, uint64_t now) const;
+		void delay(uint32_t xid, PendingCall&& call, uint64_t now);
+		void resubmit(uint32_t xid, PendingCall&& call, uint64_t now);
+		static bool keepCopy(PendingCall& call, uint32_t xid, const struct iovec* request, int32_t count);
+
+		Connection* connection; // Owner of this engine, always outlives it
+		uint32_t depth;
+		const RetransmitPolicy policy;
+		bool reaping;
+		std::atomic<int32_t> sentCount; // Calls in the table that were sent, only changed with their shard locked
+		std::atomic<int32_t> delayedCount; // Calls in the table waiting out NFS3ERR_JUKEBOX
+		std::atomic<uint64_t> latencyNs;
+		std::atomic<uint64_t> retransmits;
+		std::atomic<uint64_t> majorTimeouts;
+		std::atomic<uint64_t> jukeboxRetries;
+		XidTable<PendingCall> pending;
+		TimerWheel timers; // One live timer per pending call, keyed by xid
+		mutable std::mutex mutex;
+		std::condition_variable progress;
+};
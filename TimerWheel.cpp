@@ -0,0 +1,65 @@
+#include "TimerWheel.hpp"
+#include "Utils.hpp"
+
+void TimerWheel::schedule(uint32_t id, uint64_t at) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (count == 0) {
+		uint64_t now = getClockNs() / RESOLUTION_NS;
+		current = (now > current) ? now : current; // Idle wheels do not advance, catch up before placing relative to them
+	}
+	placeLocked({id, at});
+	++count;
+}
+
+// Called with the lock held. Puts the timer on the finest wheel whose reach covers it, relative to the current tick.
+void TimerWheel::placeLocked(const Timer& timer) {
+	uint64_t tick = (timer.at + RESOLUTION_NS - 1) / RESOLUTION_NS; // Never fire before at
+	if (tick <= current) {
+		ready.push_back(timer);
+		return;
+	}
+	uint64_t delta = tick - current;
+	for (uint32_t level = 0; level < LEVELS; ++level) {
+		if (delta < (1UL << (SLOT_BITS * (level + 1)))) {
+			wheels[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(timer);
+			return;
+		}
+	}
+	// Beyond the horizon, waits in the last slot the top wheel reaches and is placed again from there
+	uint64_t horizon = current + (1UL << (SLOT_BITS * LEVELS)) - 1;
+	wheels[LEVELS - 1][(horizon >> (SLOT_BITS * (LEVELS - 1))) & (SLOTS - 1)].push_back(timer);
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer>& due) {
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t target = now / RESOLUTION_NS;
+	auto before = due.size();
+
+	due.insert(due.end(), ready.begin(), ready.end());
+	ready.clear();
+	if (count == due.size() - before) {
+		current = target; // Nothing left on the wheels, skip the empty ticks
+	}
+
+	std::vector<Timer> cascade;
+	while (current < target) {
+		++current;
+		// Whenever a wheel comes round, the next slot of the coarser one is spread over the finer ones
+		for (uint32_t level = 1; level < LEVELS; ++level) {
+			if ((current & ((1UL << (SLOT_BITS * level)) - 1)) != 0) {
+				break;
+			}
+			cascade.swap(wheels[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+			for (auto& timer : cascade) {
+				placeLocked(timer);
+			}
+			cascade.clear();
+		}
+		auto& slot = wheels[0][current & (SLOTS - 1)];
+		due.insert(due.end(), slot.begin(), slot.end());
+		slot.clear();
+		due.insert(due.end(), ready.begin(), ready.end()); // Early horizon timers cascaded onto the current tick
+		ready.clear();
+	}
+	count -= due.size() - before;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel of LEVELS wheels with SLOTS slots each, the first ticking every RESOLUTION_NS. Scheduling and
+ * firing a timer are O(1) whatever the number of timers, a timer only moves to a finer wheel when its slot comes up.
+ * Timers further out than the wheels reach wait at the horizon and are placed again when it comes up.
+ *
+ * A timer is an id and the time it is due. Timers are never cancelled: when one fires, its owner checks whether it is
+ * still the one it wants and ignores it otherwise.
+ */
+class TimerWheel {
+	public:
+		constexpr static uint32_t SLOT_BITS = 8;
+		constexpr static uint32_t SLOTS = 1 << SLOT_BITS;
+		constexpr static uint32_t LEVELS = 4; // Reaches SLOTS^LEVELS ticks, about 49 days
+		constexpr static uint64_t RESOLUTION_NS = 1000000UL;
+
+		struct Timer {
+			uint32_t id;
+			uint64_t at; // ns on the getClockNs() clock
+		};
+
+		TimerWheel() : current(0UL), count(0) {}
+
+		template<typename T>
+		TimerWheel(T&&) = delete;
+		template<typename T>
+		TimerWheel& operator=(T&&) = delete;
+
+		void schedule(uint32_t id, uint64_t at);
+		// Moves every timer due at or before now into due
+		void advance(uint64_t now, std::vector<Timer>& due);
+
+		size_t size() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return count;
+		}
+
+	private:
+		void placeLocked(const Timer& timer);
+
+		std::vector<Timer> wheels[LEVELS][SLOTS];
+		std::vector<Timer> ready; // Scheduled at or before the current tick
+		uint64_t current; // Last tick advanced to
+		size_t count;
+		mutable std::mutex mutex;
+};
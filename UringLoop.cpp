@@ -0,0 +1,494 @@
+#include "UringLoop.hpp"
+#include "RpcEngine.hpp"
+
+#include "logging/Logging.hpp"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static int32_t io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+	return (int32_t)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int32_t io_uring_enter(int32_t ringFd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) {
+	return (int32_t)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int32_t io_uring_register(int32_t ringFd, uint32_t opcode, void* arg, uint32_t nrArgs) {
+	return (int32_t)syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+}
+
+UringLoop::UringLoop(uint32_t maxConnections) : maxConnections(maxConnections), ringFd(-1), wakeFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED),
+		sqRingSize(0), cqRingSize(0), sqes(nullptr), sqesSize(0), toSubmit(0), arena(nullptr), arenaSize(0), fixedBuffers(false),
+		fixedFiles(false), slots(maxConnections), wakeCount(0UL), wakeArmed(false), tickArmed(false), watched(maxConnections) {
+	for (uint32_t slot = maxConnections; slot > 0; --slot) {
+		freeSlots.push_back(slot - 1);
+	}
+
+	// Every connection has at most one read and one write in flight, plus the wakeup read and the tick
+	if (setupRing(2 * maxConnections + 2) != 0) {
+		return;
+	}
+
+	std::vector<int32_t> files(maxConnections, -1); // Sparse, slots are bound as connections arrive
+	fixedFiles = io_uring_register(ringFd, IORING_REGISTER_FILES, files.data(), maxConnections) == 0;
+	if (not fixedFiles) {
+		DEBUG_LOG(CRITICAL) << "Failed to register io_uring file table : " << strerror(errno);
+		return;
+	}
+
+	wakeFd = eventfd(0, EFD_CLOEXEC); // Blocking on purpose, the ring polls it
+	if (wakeFd < 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to create wakeup eventfd : " << strerror(errno);
+		return;
+	}
+
+	arenaSize = (size_t)maxConnections * 2 * SLOT_SIZE;
+	void* memory = mmap(nullptr, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		DEBUG_LOG(CRITICAL) << "Failed to map " << arenaSize << " bytes of I/O arena : " << strerror(errno);
+		return;
+	}
+	arena = static_cast<uchar_t*>(memory);
+
+	struct iovec region;
+	region.iov_base = arena;
+	region.iov_len = arenaSize;
+	fixedBuffers = io_uring_register(ringFd, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+	if (not fixedBuffers) {
+		DEBUG_LOG(CRITICAL) << "Could not register I/O arena with io_uring, using unregistered buffers : " << strerror(errno);
+	}
+}
+
+UringLoop::~UringLoop() {
+	stop();
+	if (ringFd >= 0) {
+		close(ringFd); // Cancels whatever is still in flight before the arena goes away
+	}
+	if (arena) {
+		munmap(arena, arenaSize);
+	}
+	if (sqes) {
+		munmap(sqes, sqesSize);
+	}
+	if (cqRing != MAP_FAILED && cqRing != sqRing) {
+		munmap(cqRing, cqRingSize);
+	}
+	if (sqRing != MAP_FAILED) {
+		munmap(sqRing, sqRingSize);
+	}
+	if (wakeFd >= 0) {
+		close(wakeFd);
+	}
+}
+
+int32_t UringLoop::setupRing(uint32_t entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof (params));
+
+	ringFd = io_uring_setup(entries, &params);
+	if (ringFd < 0) {
+		DEBUG_LOG(CRITICAL) << "io_uring_setup failed : " << strerror(errno);
+		return -1;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sqRingSize = cqRingSize = (sqRingSize > cqRingSize) ? sqRingSize : cqRingSize;
+	}
+
+	sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED) {
+		DEBUG_LOG(CRITICAL) << "Failed to map submission ring : " << strerror(errno);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqRing = sqRing;
+	} else {
+		cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED) {
+			DEBUG_LOG(CRITICAL) << "Failed to map completion ring : " << strerror(errno);
+			return -1;
+		}
+	}
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqeMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (sqeMemory == MAP_FAILED) {
+		DEBUG_LOG(CRITICAL) << "Failed to map submission entries : " << strerror(errno);
+		return -1;
+	}
+	sqes = static_cast<struct io_uring_sqe*>(sqeMemory);
+
+	auto sqBase = static_cast<uchar_t*>(sqRing);
+	sqHead = reinterpret_cast<uint32_t*>(sqBase + params.sq_off.head);
+	sqTail = reinterpret_cast<uint32_t*>(sqBase + params.sq_off.tail);
+	sqArray = reinterpret_cast<uint32_t*>(sqBase + params.sq_off.array);
+	sqMask = *reinterpret_cast<uint32_t*>(sqBase + params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+
+	auto cqBase = static_cast<uchar_t*>(cqRing);
+	cqHead = reinterpret_cast<uint32_t*>(cqBase + params.cq_off.head);
+	cqTail = reinterpret_cast<uint32_t*>(cqBase + params.cq_off.tail);
+	cqMask = *reinterpret_cast<uint32_t*>(cqBase + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cqBase + params.cq_off.cqes);
+	return 0;
+}
+
+// Runs on the thread owning fd, while fd is guaranteed to still be the socket of connection
+int32_t UringLoop::watch(const Connection_p& connection, int32_t fd, uint32_t generation) {
+	std::lock_guard<std::mutex> lock(requestMutex);
+	if (freeSlots.empty()) {
+		DEBUG_LOG(CRITICAL) << "All " << maxConnections << " io_uring connection slots are in use";
+		return -1;
+	}
+	auto slot = freeSlots.back();
+	if (bindFile(slot, fd) != 0) {
+		return -1;
+	}
+	freeSlots.pop_back();
+	slotOfFd[fd] = slot;
+	watched[slot] = {connection, generation};
+	requests.emplace_back(REQUEST::WATCH, slot);
+	wakeup();
+	return 0;
+}
+
+void UringLoop::unwatch(int32_t fd) {
+	std::lock_guard<std::mutex> lock(requestMutex);
+	auto iter = slotOfFd.find(fd);
+	if (iter == slotOfFd.end()) {
+		return;
+	}
+	requests.emplace_back(REQUEST::UNWATCH, iter->second);
+	slotOfFd.erase(iter);
+	wakeup();
+}
+
+bool UringLoop::requestFlush(int32_t fd) {
+	std::lock_guard<std::mutex> lock(requestMutex);
+	auto iter = slotOfFd.find(fd);
+	if (iter != slotOfFd.end()) {
+		requests.emplace_back(REQUEST::FLUSH, iter->second);
+		wakeup();
+	}
+	return true;
+}
+
+// Points the slot's fixed file entry at fd, or clears it for fd -1. The ring keeps its own reference to the socket.
+int32_t UringLoop::bindFile(uint32_t slot, int32_t fd) {
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof (update));
+	update.offset = slot;
+	update.fds = reinterpret_cast<uint64_t>(&fd);
+	if (io_uring_register(ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+		DEBUG_LOG(CRITICAL) << "Failed to bind fd : " << fd << " to io_uring slot : " << slot << " : " << strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+void UringLoop::wakeup() {
+	uint64_t one = 1;
+	if (wakeFd >= 0 && write(wakeFd, &one, sizeof (one)) < 0) {
+		DEBUG_LOG(CRITICAL) << "Failed to wake event loop : " << strerror(errno);
+	}
+}
+
+int32_t UringLoop::runOnce(uint32_t timeoutMs) {
+	handleRequests();
+
+	if (not wakeArmed) {
+		queueWake();
+	}
+	if (not tickArmed) {
+		queueTick(timeoutMs);
+	}
+
+	auto submitted = io_uring_enter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+	if (submitted < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+			return 0;
+		}
+		DEBUG_LOG(CRITICAL) << "io_uring_enter failed : " << strerror(errno);
+		return -1;
+	}
+	toSubmit -= submitted;
+
+	// Reap the whole batch first. Requests queued before any of these completed, such as the unwatch that precedes the
+	// shutdown of a socket, must be applied before the completions are looked at.
+	std::vector<std::pair<uint64_t, int32_t>> completed;
+	uint32_t head = *cqHead;
+	uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		auto& cqe = cqes[head & cqMask];
+		completed.emplace_back(cqe.user_data, cqe.res);
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+	handleRequests();
+	for (auto& entry : completed) {
+		handleCompletion(entry.first, entry.second);
+	}
+	return completed.size();
+}
+
+void UringLoop::handleRequests() {
+	std::vector<std::pair<REQUEST, uint32_t>> work;
+	std::vector<std::pair<std::weak_ptr<Connection>, uint32_t>> arrived;
+	{
+		std::lock_guard<std::mutex> lock(requestMutex);
+		work.swap(requests);
+		for (auto& request : work) {
+			if (request.first == REQUEST::WATCH) {
+				arrived.push_back(watched[request.second]);
+				watched[request.second].first.reset();
+			}
+		}
+	}
+
+	auto next = arrived.begin();
+	for (auto& request : work) {
+		auto slot = request.second;
+		auto& state = slots[slot];
+		switch (request.first) {
+			case REQUEST::WATCH:
+				state = {next->first, next->second, true, false, false, 0, 0};
+				++next;
+				queueRead(slot);
+				break;
+			case REQUEST::UNWATCH:
+				state.open = false;
+				release(slot);
+				break;
+			case REQUEST::FLUSH:
+				if (state.open && not state.writing) {
+					fillAndWrite(slot);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+void UringLoop::handleCompletion(uint64_t userData, int32_t result) {
+	auto operation = static_cast<OPERATION>(userData & 0xff);
+	auto slot = static_cast<uint32_t>(userData >> 8);
+
+	switch (operation) {
+		case OPERATION::READ:
+			readDone(slot, result);
+			break;
+		case OPERATION::WRITE:
+			writeDone(slot, result);
+			break;
+		case OPERATION::WAKE:
+			wakeArmed = false;
+			break;
+		case OPERATION::TICK:
+			tickArmed = false;
+			break;
+		default:
+			DEBUG_LOG(CRITICAL) << "Unexpected io_uring completion : " << OPERATIONImage::printEnum(operation);
+			break;
+	}
+}
+
+void UringLoop::readDone(uint32_t slot, int32_t result) {
+	auto& state = slots[slot];
+	state.reading = false;
+	if (not state.open) {
+		release(slot);
+		return;
+	}
+
+	if (result == -EINTR || result == -EAGAIN) {
+		queueRead(slot);
+		return;
+	}
+
+	auto connection = state.connection.lock();
+	if (not connection) {
+		// Gone without its disconnect unwatching the slot, dropped like EventLoop::lookup() does so that the slot is freed
+		int32_t fd = -1;
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			for (auto& entry : slotOfFd) {
+				if (entry.second == slot) {
+					fd = entry.first;
+					break;
+				}
+			}
+		}
+		if (fd >= 0) {
+			remove(fd);
+		}
+		return;
+	}
+
+	if (result <= 0) {
+		DEBUG_LOG(CRITICAL) << "Receive in slot : " << slot << " ended : " << ((result < 0) ? strerror(-result) : "closed by server");
+		connection->abandon(state.generation);
+		return;
+	}
+
+	auto engine = connection->getRpcEngine();
+	if (connection->ingest(recvBuffer(slot), result, [&engine](uchar_t* reply, int32_t replySize) {
+			engine->dispatch(reply, replySize);
+		}) < 0) {
+		connection->abandon(state.generation); // The stream can not be read past a bad record, its calls are failed
+		return;
+	}
+	if (state.open && not state.reading) {
+		queueRead(slot);
+	}
+}
+
+void UringLoop::writeDone(uint32_t slot, int32_t result) {
+	auto& state = slots[slot];
+	state.writing = false;
+	if (not state.open) {
+		release(slot);
+		return;
+	}
+
+	if (result < 0 && result != -EINTR && result != -EAGAIN) {
+		DEBUG_LOG(CRITICAL) << "Send failure in slot : " << slot << " : " << strerror(-result);
+		auto connection = state.connection.lock();
+		if (connection) {
+			connection->abandon(state.generation);
+		}
+		return;
+	}
+
+	if (result > 0) {
+		state.sendOffset += result;
+	}
+	if (state.sendOffset < state.sendLength) {
+		queueWrite(slot);
+	} else {
+		fillAndWrite(slot);
+	}
+}
+
+void UringLoop::fillAndWrite(uint32_t slot) {
+	auto& state = slots[slot];
+	auto connection = state.connection.lock();
+	if (not connection) {
+		return;
+	}
+	auto length = connection->takeQueued(sendBuffer(slot), SLOT_SIZE);
+	if (length == 0) {
+		return;
+	}
+	state.sendLength = length;
+	state.sendOffset = 0;
+	queueWrite(slot);
+}
+
+// A closed connection keeps its slot, and the buffers in it, until the kernel is done with both of its operations
+void UringLoop::release(uint32_t slot) {
+	auto& state = slots[slot];
+	if (state.open || state.reading || state.writing) {
+		return;
+	}
+	state.connection.reset();
+	bindFile(slot, -1);
+
+	std::lock_guard<std::mutex> lock(requestMutex);
+	freeSlots.push_back(slot);
+}
+
+struct io_uring_sqe* UringLoop::nextSqe() {
+	if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+		auto submitted = io_uring_enter(ringFd, toSubmit, 0, 0);
+		if (submitted > 0) {
+			toSubmit -= submitted;
+		}
+		if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+			return nullptr;
+		}
+	}
+	auto sqe = &sqes[*sqTail & sqMask];
+	memset(sqe, 0, sizeof (*sqe));
+	return sqe;
+}
+
+void UringLoop::queueSqe() {
+	auto tail = *sqTail;
+	sqArray[tail & sqMask] = tail & sqMask;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	++toSubmit;
+}
+
+void UringLoop::queueRead(uint32_t slot) {
+	auto sqe = nextSqe();
+	if (not sqe) {
+		DEBUG_LOG(CRITICAL) << "Submission ring full, can not read slot : " << slot;
+		return;
+	}
+	sqe->opcode = fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = slot;
+	sqe->addr = reinterpret_cast<uint64_t>(recvBuffer(slot));
+	sqe->len = SLOT_SIZE;
+	sqe->buf_index = 0;
+	sqe->user_data = ((uint64_t)slot << 8) | static_cast<uint64_t>(OPERATION::READ);
+	queueSqe();
+	slots[slot].reading = true;
+}
+
+void UringLoop::queueWrite(uint32_t slot) {
+	auto sqe = nextSqe();
+	if (not sqe) {
+		DEBUG_LOG(CRITICAL) << "Submission ring full, can not write slot : " << slot;
+		return;
+	}
+	auto& state = slots[slot];
+	sqe->opcode = fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = slot;
+	sqe->addr = reinterpret_cast<uint64_t>(sendBuffer(slot) + state.sendOffset);
+	sqe->len = state.sendLength - state.sendOffset;
+	sqe->buf_index = 0;
+	sqe->user_data = ((uint64_t)slot << 8) | static_cast<uint64_t>(OPERATION::WRITE);
+	queueSqe();
+	state.writing = true;
+}
+
+void UringLoop::queueWake() {
+	auto sqe = nextSqe();
+	if (not sqe) {
+		return;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = wakeFd;
+	sqe->addr = reinterpret_cast<uint64_t>(&wakeCount);
+	sqe->len = sizeof (wakeCount);
+	sqe->user_data = static_cast<uint64_t>(OPERATION::WAKE);
+	queueSqe();
+	wakeArmed = true;
+}
+
+void UringLoop::queueTick(uint32_t timeoutMs) {
+	auto sqe = nextSqe();
+	if (not sqe) {
+		return;
+	}
+	if (timeoutMs > TICK_MS) {
+		timeoutMs = TICK_MS;
+	}
+	tickSpec.tv_sec = timeoutMs / 1000;
+	tickSpec.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = reinterpret_cast<uint64_t>(&tickSpec);
+	sqe->len = 1;
+	sqe->user_data = static_cast<uint64_t>(OPERATION::TICK);
+	queueSqe();
+	tickArmed = true;
+}
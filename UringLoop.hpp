@@ -0,0 +1,137 @@
+#pragma once
+
+#include "EventLoop.hpp"
+
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * io_uring backend. Reads and writes of every connection are queued on one ring and submitted together with a single
+ * io_uring_enter per loop pass, and their completions are reaped in one batch.
+ *
+ * Each connection gets a slot: an entry in the ring's fixed file table, bound on the thread that owns the socket so
+ * that a closed and reused fd number can never be confused with it, and a receive and a send buffer in one arena
+ * registered with the kernel, so I/O uses READ_FIXED/WRITE_FIXED without per call page pinning. If buffer registration
+ * is refused (e.g. RLIMIT_MEMLOCK) the same arena is used with plain READ/WRITE.
+ */
+class UringLoop : public EventLoop {
+	public:
+		constexpr static uint32_t DEFAULT_MAX_CONNECTIONS = 256;
+		constexpr static uint32_t SLOT_SIZE = 64 * 1024;
+
+		UringLoop(uint32_t maxConnections = DEFAULT_MAX_CONNECTIONS);
+		~UringLoop() override;
+
+		int32_t runOnce(uint32_t timeoutMs) override;
+		bool requestFlush(int32_t fd) override;
+
+		bool ownsWrites() const override {
+			return true;
+		}
+
+		bool wantsNonBlocking() const override {
+			return false; // The ring waits for readiness itself, O_NONBLOCK would only turn that into -EAGAIN
+		}
+
+	protected:
+		bool ready() const override {
+			return ringFd >= 0 && wakeFd >= 0 && arena != nullptr && fixedFiles;
+		}
+		int32_t watch(const Connection_p& connection, int32_t fd, uint32_t generation) override;
+		void unwatch(int32_t fd) override;
+		void wakeup() override;
+
+	private:
+		DESC_CLASS_ENUM(OPERATION, uint64_t,
+			None,
+			READ,
+			WRITE,
+			WAKE,
+			TICK
+		);
+
+		DESC_CLASS_ENUM(REQUEST, uint32_t,
+			None,
+			WATCH,
+			UNWATCH,
+			FLUSH
+		);
+
+		struct Slot {
+			std::weak_ptr<Connection> connection;
+			uint32_t generation;
+			bool open;
+			bool reading;
+			bool writing;
+			uint32_t sendLength;
+			uint32_t sendOffset;
+		};
+
+		int32_t setupRing(uint32_t entries);
+		int32_t bindFile(uint32_t slot, int32_t fd);
+		void handleRequests();
+		void handleCompletion(uint64_t userData, int32_t result);
+		void readDone(uint32_t slot, int32_t result);
+		void writeDone(uint32_t slot, int32_t result);
+		void fillAndWrite(uint32_t slot);
+		void release(uint32_t slot);
+
+		struct io_uring_sqe* nextSqe();
+		void queueSqe();
+		void queueRead(uint32_t slot);
+		void queueWrite(uint32_t slot);
+		void queueWake();
+		void queueTick(uint32_t timeoutMs);
+
+		uchar_t* recvBuffer(uint32_t slot) {
+			return &arena[(size_t)slot * 2 * SLOT_SIZE];
+		}
+		uchar_t* sendBuffer(uint32_t slot) {
+			return &arena[((size_t)slot * 2 + 1) * SLOT_SIZE];
+		}
+
+		uint32_t maxConnections;
+		int32_t ringFd;
+		int32_t wakeFd;
+
+		// Ring memory shared with the kernel
+		void* sqRing;
+		void* cqRing;
+		size_t sqRingSize;
+		size_t cqRingSize;
+		struct io_uring_sqe* sqes;
+		size_t sqesSize;
+		uint32_t* sqHead;
+		uint32_t* sqTail;
+		uint32_t* sqArray;
+		uint32_t sqMask;
+		uint32_t sqEntries;
+		uint32_t* cqHead;
+		uint32_t* cqTail;
+		uint32_t cqMask;
+		struct io_uring_cqe* cqes;
+		uint32_t toSubmit;
+
+		uchar_t* arena;
+		size_t arenaSize;
+		bool fixedBuffers;
+		bool fixedFiles;
+
+		// Owned by the loop thread
+		std::vector<Slot> slots;
+		uint64_t wakeCount;
+		struct __kernel_timespec tickSpec;
+		bool wakeArmed;
+		bool tickArmed;
+
+		// Shared with the threads owning the sockets. Requests name slots, never fds, and are applied in order.
+		std::map<int32_t, uint32_t> slotOfFd;
+		std::vector<uint32_t> freeSlots;
+		std::vector<std::pair<REQUEST, uint32_t>> requests;
+		std::vector<std::pair<std::weak_ptr<Connection>, uint32_t>> watched; // Connection and generation of each WATCH request, by slot
+		std::mutex requestMutex;
+};
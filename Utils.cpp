@@ -23,6 +23,9 @@
 
 #include <memory>
 #include "Context.hpp"
+#include "EpollLoop.hpp"
+#include "UringLoop.hpp"
+#include "BufferPool.hpp"
 #include <iostream>
 
 #include <unistd.h>
@@ -31,14 +34,110 @@
 #include <string.h>
 #include <iomanip>
 
-int parseArgs(int argc, char** argv, ServerContexts& sContexts) {
+/*
+ * Parses timeo=N,retrans=N,soft|hard,jukebox=N,rsize=N,readahead=N,rwindow=N,wsize=N,wwindow=N,stable=how,gather|nogather,
+ * gatherage=N,cache=N,actimeo=N the way mount options are written, timeo, jukebox and gatherage in tenths of a second,
+ * actimeo in seconds, rsize and wsize in bytes up to 1 MB, readahead in KB like read_ahead_kb and cache in MB. rwindow and wwindow
+ * are the number of READs and WRITEs kept outstanding per file, and stable is unstable, datasync or filesync.
+ */
+static bool parseMountOptions(char* options, RetransmitPolicy& policy, ReadPolicy& readPolicy, WritePolicy& writePolicy, CachePolicy& cachePolicy) {
+	char* saved = nullptr;
+	for (char* option = strtok_r(options, ",", &saved); option; option = strtok_r(nullptr, ",", &saved)) {
+		if (strncmp(option, "timeo=", 6) == 0 && atoi(option + 6) > 0) {
+			policy.timeoMs = atoi(option + 6) * 100;
+		} else if (strncmp(option, "retrans=", 8) == 0 && atoi(option + 8) >= 0) {
+			policy.retrans = atoi(option + 8);
+		} else if (strncmp(option, "jukebox=", 8) == 0 && atoi(option + 8) >= 0) {
+			policy.jukeboxMs = atoi(option + 8) * 100;
+		} else if (strcmp(option, "soft") == 0) {
+			policy.soft = true;
+		} else if (strcmp(option, "hard") == 0) {
+			policy.soft = false;
+		} else if (strncmp(option, "rsize=", 6) == 0 && atoi(option + 6) > 0 && atoi(option + 6) <= (int)ReadPolicy::MAX_RSIZE) {
+			readPolicy.rsize = atoi(option + 6);
+		} else if (strncmp(option, "readahead=", 10) == 0 && atoi(option + 10) >= 0) {
+			readPolicy.readaheadMax = atoi(option + 10) * 1024UL;
+		} else if (strncmp(option, "rwindow=", 8) == 0 && atoi(option + 8) > 0) {
+			readPolicy.window = atoi(option + 8);
+		} else if (strncmp(option, "wsize=", 6) == 0 && atoi(option + 6) > 0 && atoi(option + 6) <= (int)WritePolicy::MAX_WSIZE) {
+			writePolicy.wsize = atoi(option + 6);
+		} else if (strncmp(option, "wwindow=", 8) == 0 && atoi(option + 8) > 0) {
+			writePolicy.window = atoi(option + 8);
+		} else if (strcmp(option, "stable=unstable") == 0) {
+			writePolicy.stable = nfs3::stable_how::UNSTABLE;
+		} else if (strcmp(option, "stable=datasync") == 0) {
+			writePolicy.stable = nfs3::stable_how::DATA_SYNC;
+		} else if (strcmp(option, "stable=filesync") == 0) {
+			writePolicy.stable = nfs3::stable_how::FILE_SYNC;
+		} else if (strcmp(option, "gather") == 0) {
+			writePolicy.gather = true;
+		} else if (strcmp(option, "nogather") == 0) {
+			writePolicy.gather = false;
+		} else if (strncmp(option, "gatherage=", 10) == 0 && atoi(option + 10) >= 0) {
+			writePolicy.gatherAgeMs = atoi(option + 10) * 100;
+		} else if (strncmp(option, "cache=", 6) == 0 && atoi(option + 6) >= 0) {
+			cachePolicy.budget = atoi(option + 6) * 1024UL * 1024UL;
+		} else if (strncmp(option, "actimeo=", 8) == 0 && atoi(option + 8) >= 0) {
+			cachePolicy.attrTimeoutMs = atoi(option + 8) * 1000;
+		} else {
+			return false;
+		}
+	}
+	if (policy.maxTimeoMs < policy.timeoMs) {
+		policy.maxTimeoMs = policy.timeoMs;
+	}
+	return true;
+}
+
+// Parses file,bytes[,bytes of each call]. Returns the number of bytes, or -1.
+static int64_t parseStream(const char* arg, std::string& file, int64_t& ioSize) {
+	const char* comma = strchr(arg, ',');
+	if (not comma || comma == arg || atoll(comma + 1) < 0) {
+		return -1;
+	}
+	file = std::string(arg, comma - arg);
+	const char* io = strchr(comma + 1, ',');
+	ioSize = io ? atoll(io + 1) : 0;
+	return (ioSize < 0) ? -1 : atoll(comma + 1);
+}
+
+int parseArgs(int argc, char** argv, ServerContexts& sContexts, Workload& workload) {
 	int opt;
 	std::string server;
 	int port = -1;
 	int optCorrect = false;
 	int numServers = 0;
+	int inflightDepth = Context::DEFAULT_INFLIGHT_DEPTH;
+	EventLoop::LOOP_TYPE loopType = EventLoop::LOOP_TYPE::None;
+	int fragmentSize = 0;
+	int nconnect = 1;
+	Context::SHARDING sharding = Context::SHARDING::ROUND_ROBIN;
+	ServerContexts::GetContextStrategy strategy = ServerContexts::GetContextStrategy::Iterate;
+	GenericEnums::PROTOCOL_TYPE protocol = GenericEnums::PROTOCOL_TYPE::IPPROTO_TCP;
+	bool protocolCorrect = true;
+	RetransmitPolicy retransmitPolicy;
+	ReadPolicy readPolicy;
+	WritePolicy writePolicy;
+	CachePolicy cachePolicy;
+	bool mountOptionsCorrect = true;
+	std::string readFile;
+	int64_t readSize = 0;
+	std::string writeFile;
+	int64_t writeSize = 0;
+	int64_t readIoSize = 0;
+	int64_t writeIoSize = 0;
+	bool duplex = false;
+
+#ifdef NFSCLISIM_COROUTINES
+	const char* options = "s:d:e:f:n:m:p:t:o:r:w:HDc:";
+	const char* clientsUsage = " [-c simulated clients, run as coroutines]";
+#else
+	const char* options = "s:d:e:f:n:m:p:t:o:r:w:HD";
+	const char* clientsUsage = "";
+#endif
+	int clients = 0;
 
-	while ((opt = getopt(argc, argv, "s:")) != -1) {
+	while ((opt = getopt(argc, argv, options)) != -1) {
 		switch (opt) {
 			case 's':
 				{
@@ -59,17 +158,127 @@ int parseArgs(int argc, char** argv, ServerContexts& sContexts) {
 					}
 				}
 				break;
+			case 'd':
+				inflightDepth = atoi(optarg);
+				break;
+			case 'e':
+				if (strcmp(optarg, "epoll") == 0) {
+					loopType = EventLoop::LOOP_TYPE::EPOLL;
+				} else if (strcmp(optarg, "io_uring") == 0) {
+					loopType = EventLoop::LOOP_TYPE::IO_URING;
+				} else {
+					loopType = EventLoop::LOOP_TYPE::UNKNOWN;
+				}
+				break;
+			case 'f':
+				fragmentSize = atoi(optarg);
+				break;
+			case 'n':
+				nconnect = atoi(optarg);
+				break;
+			case 'm':
+				if (strcmp(optarg, "roundrobin") == 0) {
+					sharding = Context::SHARDING::ROUND_ROBIN;
+				} else if (strcmp(optarg, "handle") == 0) {
+					sharding = Context::SHARDING::HANDLE_HASH;
+				} else {
+					sharding = Context::SHARDING::UNKNOWN;
+				}
+				break;
+			case 'p':
+				if (strcmp(optarg, "random") == 0) {
+					strategy = ServerContexts::GetContextStrategy::Random;
+				} else if (strcmp(optarg, "iterate") == 0) {
+					strategy = ServerContexts::GetContextStrategy::Iterate;
+				} else if (strcmp(optarg, "fixed") == 0) {
+					strategy = ServerContexts::GetContextStrategy::Fixed;
+				} else if (strcmp(optarg, "p2c") == 0) {
+					strategy = ServerContexts::GetContextStrategy::PowerOfTwo;
+				} else {
+					strategy = ServerContexts::GetContextStrategy::UNKNOWN;
+				}
+				break;
+			case 't':
+				if (strcmp(optarg, "tcp") == 0) {
+					protocol = GenericEnums::PROTOCOL_TYPE::IPPROTO_TCP;
+				} else if (strcmp(optarg, "udp") == 0) {
+					protocol = GenericEnums::PROTOCOL_TYPE::IPPROTO_UDP;
+				} else {
+					protocolCorrect = false;
+				}
+				break;
+			case 'o':
+				mountOptionsCorrect = parseMountOptions(optarg, retransmitPolicy, readPolicy, writePolicy, cachePolicy) && mountOptionsCorrect;
+				break;
+			case 'r':
+				readSize = parseStream(optarg, readFile, readIoSize);
+				break;
+			case 'w':
+				writeSize = parseStream(optarg, writeFile, writeIoSize);
+				break;
+			case 'H':
+				BufferPool::setHugePages(true);
+				break;
+			case 'D':
+				duplex = true;
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
 			default:
 				break;
 		}
 	}
 
 
-	if (!optCorrect) {
-		fprintf(stderr, "Usage: %s [-s, multiple switches are allowed] server,port\n", argv[0]);
+	if (!optCorrect || inflightDepth <= 0 || loopType == EventLoop::LOOP_TYPE::UNKNOWN || nconnect <= 0 || nconnect > (int)Context::MAX_NCONNECT || sharding == Context::SHARDING::UNKNOWN || strategy == ServerContexts::GetContextStrategy::UNKNOWN || !protocolCorrect || !mountOptionsCorrect || (fragmentSize != 0 && fragmentSize < (int)Connection::MIN_FRAGMENT_SIZE) || clients < 0 || readSize < 0 || writeSize < 0) {
+		fprintf(stderr, "Usage: %s [-s, multiple switches are allowed] server,port"
+				" [-d RPCs in flight per connection] [-e epoll|io_uring, drive all connections from one thread]"
+				" [-f largest record fragment sent over TCP, at least %u, 0 sends records whole]"
+				" [-n NFS connections per server, at most %u] [-m roundrobin|handle, how NFS calls are spread over them]"
+				" [-p random|iterate|fixed|p2c, how servers are picked, fixed uses the first] [-t tcp|udp]"
+				" [-o timeo=tenths,retrans=count,soft|hard,jukebox=tenths, when calls are sent again or given up,"
+				" rsize=bytes,readahead=KB,rwindow=READs in flight, how files are read,"
+				" wsize=bytes,wwindow=WRITEs in flight,stable=unstable|datasync|filesync,gather|nogather,gatherage=tenths, how files are written,"
+				" cache=MB,actimeo=seconds, how much file data is cached and how long its attributes are trusted]"
+				" [-r file,bytes[,bytes per read], read that much of file sequentially after mounting, rsize per read by default]"
+				" [-w file,bytes[,bytes per write], write that much of file sequentially after mounting and close it, wsize per write by default]"
+				" [-H back large buffers with huge pages] [-D full duplex blocking connections, a reader thread each and senders that never wait on each other]"
+				"%s\n", argv[0], Connection::MIN_FRAGMENT_SIZE, Context::MAX_NCONNECT, clientsUsage);
 		exit(-1);
 	}
 
+	sContexts.setInflightDepth(inflightDepth);
+	sContexts.setProtocol(protocol);
+	sContexts.setFragmentSize(fragmentSize);
+	sContexts.setRetransmitPolicy(retransmitPolicy);
+	sContexts.setDuplex(duplex);
+	sContexts.setReadPolicy(readPolicy);
+	sContexts.setWritePolicy(writePolicy);
+	sContexts.setCachePolicy(cachePolicy);
+	sContexts.setNconnect(nconnect, sharding);
+	sContexts.setStrategy(strategy);
+	workload.read.file = readFile;
+	workload.read.size = readSize;
+	workload.read.ioSize = readIoSize;
+	workload.write.file = writeFile;
+	workload.write.size = writeSize;
+	workload.write.ioSize = writeIoSize;
+	workload.clients = clients;
+	if (loopType != EventLoop::LOOP_TYPE::None) {
+		std::shared_ptr<EventLoop> loop;
+		if (loopType == EventLoop::LOOP_TYPE::IO_URING) {
+			loop = std::make_shared<UringLoop>();
+		} else {
+			loop = std::make_shared<EpollLoop>();
+		}
+		if (loop->start() != 0) {
+			fprintf(stderr, "Failed to start event loop\n");
+			exit(-1);
+		}
+		sContexts.setEventLoop(loop);
+	}
+
 	return numServers;
 }
 
@@ -91,6 +300,24 @@ uint64_t getMonotonic(int64_t seed) {
 	return __atomic_fetch_add(&sequential, 1, __ATOMIC_RELAXED);
 }
 
+uint32_t nextXid() {
+	static uint32_t nextBlock = (uint32_t)getMonotonic(0L) & ~(XID_BLOCK - 1);
+	thread_local uint32_t xid = 0;
+	thread_local uint32_t left = 0;
+	if (left == 0) {
+		xid = __atomic_fetch_add(&nextBlock, XID_BLOCK, __ATOMIC_RELAXED);
+		left = XID_BLOCK;
+	}
+	--left;
+	return xid++;
+}
+
+uint64_t getClockNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
 #define HOSTNAME_SZ		1024
 static const std::string getLocalHostname() {
 	struct addrinfo hints, *info, *p;
@@ -21,6 +21,7 @@
 #include "descriptiveenum/DescriptiveEnum.hpp"
 
 #include "Context.hpp"
+#include "Workload.hpp"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,17 +33,24 @@
 
 #define MEM_ALLOC_FAILURE(a, b)	DEBUG_LOG(CRITICAL) << (a) << " in method : " << (b)
 
-int parseArgs(int argc, char** argv, ServerContexts& sContexts);
+// Sets up sContexts from the command line, and fills workload with what main() is to do after mounting
+int parseArgs(int argc, char** argv, ServerContexts& sContexts, Workload& workload);
 
 int64_t getRandomNumber(uint32_t seed);
 
 uint64_t getMonotonic(int64_t seed);
 
+// xids are handed to each thread in blocks of XID_BLOCK, so drawing one touches no shared state most of the time
+#define XID_BLOCK	4096
+uint32_t nextXid();
+
+uint64_t getClockNs();
+
 class ScopedMemoryHandler {
 	public:
 		ScopedMemoryHandler(uchar_t *memptr) : rawPtr(memptr), memoryFreed(false) {}
+		// Owned by one scope, so no lock is needed
 		void freeMemory() {
-			std::lock_guard<std::mutex> lock(mutex);
 			if (not memoryFreed && rawPtr) {
 				memoryFreed = true;
 				delete [] rawPtr;
@@ -53,9 +61,8 @@ class ScopedMemoryHandler {
 			freeMemory();
 		}
 	private:
-		bool memoryFreed;
-		mutable std::mutex mutex;
 		uchar_t* rawPtr;
+		bool memoryFreed;
 };
 
 static const std::string getLocalHostname();
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+/*
+ * What main() does once it mounted, as the command line asks for it. A stream is a file read or written from its start,
+ * size bytes of it in calls of ioSize bytes, 0 for rsize or wsize. Nothing happens for a stream of size 0.
+ */
+struct Workload {
+	struct Stream {
+		std::string file;
+		uint64_t size;
+		uint64_t ioSize;
+
+		Stream() : size(0), ioSize(0) {}
+	};
+
+	Stream read;
+	Stream write;
+	uint32_t clients; // Simulated clients the coroutine build runs, 0 for the single client of main()
+
+	Workload() : clients(0) {}
+};
@@ -0,0 +1,368 @@
+#include "WriteEngine.hpp"
+#include "WriteFlusher.hpp"
+#include "RpcEngine.hpp"
+#include "Utils.hpp"
+#include "rpc.hpp"
+
+#include "logging/Logging.hpp"
+#include "descriptiveenum/DescriptiveEnum.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+WriteEngine::WriteEngine(const Context_p& context, const handle_p& file, GenericEnums::AUTH_TYPE authType, const WritePolicy& policy) : context(context), file(file), authType(authType), policy(policy), cache(context->getBlockCache()), uncommittedBytes(0UL), verifier(), verifierKnown(false), failed(false), dirtySince(0UL), lastTimeout(0), writes(0UL), commits(0UL), resends(0UL), gathered(0UL) {
+	if (this->policy.wsize == 0) {
+		this->policy.wsize = 1;
+	} else if (this->policy.wsize > WritePolicy::MAX_WSIZE) {
+		this->policy.wsize = WritePolicy::MAX_WSIZE;
+	}
+	if (context->getProtocol() == GenericEnums::PROTOCOL_TYPE::IPPROTO_UDP && this->policy.wsize > MAX_UDP_WSIZE) {
+		this->policy.wsize = MAX_UDP_WSIZE;
+	}
+	if (this->policy.window == 0) {
+		this->policy.window = 1;
+	}
+	if (cache) {
+		fileId.server = context->getServer();
+		fileId.file = *file;
+	}
+	if (this->policy.gather) {
+		flusher = context->getWriteFlusher();
+		if (flusher) {
+			flusher->add(this);
+		}
+	}
+}
+
+// A range still gathered is sent, its reply is not waited for
+WriteEngine::~WriteEngine() {
+	if (flusher) {
+		flusher->remove(this);
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	sendDirty(lastTimeout);
+}
+
+int64_t WriteEngine::write(uint32_t timeout, uint64_t offset, uint64_t size, const uchar_t* src) {
+	std::lock_guard<std::mutex> lock(mutex);
+	lastTimeout = timeout;
+	if (cache) {
+		cache->invalidate(fileId);
+	}
+	if (uncommittedBytes >= policy.commitAfter && commitLocked(timeout, 0, 0) != 0) {
+		failed = true; // Still reported by the commit the caller asks for
+	}
+	if (policy.gather) {
+		return (gather(timeout, offset, size, src) == 0) ? (int64_t)size : -1;
+	}
+
+	uint64_t done = 0;
+	while (done < size) {
+		uint32_t count = std::min<uint64_t>(size - done, policy.wsize);
+		if (sendAgain(timeout) != 0 || waitForSlot(timeout) != 0) {
+			return -1;
+		}
+		auto chunk = std::make_shared<Chunk>(offset + done, count);
+		if (not chunk->data.reserve(count)) {
+			MEM_ALLOC_FAILURE("Failed to allocate memory in ", __FUNCTION__);
+			return -1;
+		}
+		memcpy(chunk->data.data(), src + done, count);
+		if (send(timeout, chunk) != 0) {
+			return -1;
+		}
+		done += count;
+	}
+	return size;
+}
+
+int32_t WriteEngine::commit(uint32_t timeout, uint64_t offset, uint64_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return commitLocked(timeout, offset, size);
+}
+
+int32_t WriteEngine::close(uint32_t timeout) {
+	return commit(timeout, 0UL, 0UL);
+}
+
+int32_t WriteEngine::commitLocked(uint32_t timeout, uint64_t offset, uint64_t size) {
+	uint64_t end = size ? offset + size : UINT64_MAX;
+	auto inRange = [offset, end](const Chunk_p& chunk) {
+		return chunk->offset < end && chunk->offset + chunk->size > offset;
+	};
+
+	sendDirty(timeout); // A failure shows up below
+	int32_t status = 0;
+	for (uint32_t attempt = 0; ; ++attempt) {
+		if (drain(timeout) != 0) {
+			status = -1;
+			break;
+		}
+		uint64_t low = UINT64_MAX;
+		uint64_t high = 0;
+		for (auto& chunk : uncommitted) {
+			if (inRange(chunk)) {
+				low = std::min(low, chunk->offset);
+				high = std::max(high, chunk->offset + chunk->size);
+			}
+		}
+		if (low == UINT64_MAX) {
+			break; // Nothing waits for a COMMIT
+		}
+		if (attempt == MAX_COMMITS) {
+			DEBUG_LOG(CRITICAL) << "Giving up on COMMIT after " << attempt << " tries, the write verifier keeps changing";
+			status = -1;
+			break;
+		}
+
+		nfs3::COMMIT3args args;
+		args.file.data = *file;
+		args.offset = (offset == 0 && size == 0) ? 0 : low; // Offset and count 0 commit the whole file
+		args.count = (size == 0 || high - low > UINT32_MAX) ? 0 : high - low;
+		RPC::Procedure procedure = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(Context::NFSPROG::NFSPROC3_COMMIT), "COMMIT"};
+		nfs3::COMMIT3res result;
+		auto connection = context->connectNfsPort(timeout, file.get());
+		if (not connection || RPC::callRPC(connection, timeout, procedure, args, result) != 0) {
+			DEBUG_LOG(CRITICAL) << "COMMIT of " << high - low << " bytes at offset : " << low << " failed";
+			status = -1;
+			break;
+		}
+		commits.fetch_add(1UL, std::memory_order_relaxed);
+		auto nfsStatus = static_cast<Context::NFSPROGERR>(result.status);
+		if (nfsStatus != Context::NFSPROGERR::NFS3_OK) {
+			DEBUG_LOG(CRITICAL) << "COMMIT result : " << Context::NFSPROGERRImage::printEnum(nfsStatus);
+			status = -1;
+			break;
+		}
+
+		// Anything written under another verifier goes to lost, whatever is left in range is durable now
+		noteVerifier(result.ok.verf);
+		auto durable = std::partition(uncommitted.begin(), uncommitted.end(), [&inRange](const Chunk_p& chunk) { return not inRange(chunk); });
+		for (auto chunk = durable; chunk != uncommitted.end(); ++chunk) {
+			uncommittedBytes -= (*chunk)->size;
+		}
+		uncommitted.erase(durable, uncommitted.end());
+		if (lost.empty()) {
+			break;
+		}
+	}
+
+	if (failed) {
+		failed = false;
+		status = -1;
+	}
+	return status;
+}
+
+// Merges [offset, offset + size) into the dirty range, sending every block it fills
+int32_t WriteEngine::gather(uint32_t timeout, uint64_t offset, uint64_t size, const uchar_t* src) {
+	uint64_t done = 0;
+	while (done < size) {
+		uint64_t at = offset + done;
+		uint64_t blockEnd = (at / policy.wsize + 1) * policy.wsize;
+		uint32_t count = std::min(size - done, blockEnd - at);
+		if (dirty) {
+			// Only a write that overlaps or continues the range in the same block joins it
+			if (at < dirty->offset || at > dirty->offset + dirty->size || at / policy.wsize != dirty->offset / policy.wsize) {
+				if (sendDirty(timeout) != 0) {
+					return -1;
+				}
+			} else {
+				gathered.fetch_add(1UL, std::memory_order_relaxed);
+			}
+		}
+		if (not dirty) {
+			dirty = std::make_shared<Chunk>(at, 0);
+			if (not dirty->data.reserve(blockEnd - at)) {
+				MEM_ALLOC_FAILURE("Failed to allocate memory in ", __FUNCTION__);
+				dirty.reset();
+				return -1;
+			}
+			dirtySince = getClockNs();
+		}
+
+		memcpy(dirty->data.data() + (at - dirty->offset), src + done, count);
+		dirty->size = std::max<uint64_t>(dirty->size, at + count - dirty->offset);
+		done += count;
+		if (dirty->offset + dirty->size == blockEnd || getClockNs() >= dirtySince + policy.gatherAgeMs * 1000000UL) {
+			if (sendDirty(timeout) != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Sends the dirty range as one WRITE. Its data was taken already, so a failure is reported by the next commit.
+int32_t WriteEngine::sendDirty(uint32_t timeout) {
+	if (not dirty) {
+		return 0;
+	}
+	auto chunk = std::move(dirty);
+	dirty.reset();
+	if (sendAgain(timeout) != 0 || waitForSlot(timeout) != 0 || send(timeout, chunk) != 0) {
+		failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+// Called by the flusher
+void WriteEngine::flushAged(uint64_t now) {
+	std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+	if (lock.owns_lock() && dirty && now >= dirtySince + policy.gatherAgeMs * 1000000UL) {
+		sendDirty(lastTimeout);
+	}
+}
+
+int32_t WriteEngine::send(uint32_t timeout, const Chunk_p& chunk) {
+	chunk->connection = context->connectNfsPort(timeout, file.get());
+	if (not chunk->connection) {
+		return -1;
+	}
+
+	uint32_t count = chunk->size - chunk->acked;
+	nfs3::WRITE3args_head args;
+	args.file.data = *file;
+	args.offset = chunk->offset + chunk->acked;
+	args.count = count;
+	args.stable = policy.stable;
+
+	RPC::Procedure procedure = {GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::RPC_PROGRAM::NFS, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION3, authType, static_cast<uint32_t>(Context::NFSPROG::NFSPROC3_WRITE), "WRITE"};
+	// Runs on the thread that reaped the reply
+	auto written = [chunk, count](int32_t status, nfs3::WRITE3res& result) {
+		if (status != 0 || result.status != static_cast<uint32_t>(Context::NFSPROGERR::NFS3_OK) || result.ok.count == 0) {
+			chunk->status = (status != 0) ? status : (result.status ? static_cast<int32_t>(result.status) : -EIO);
+			chunk->state.store(static_cast<int32_t>(CHUNK_STATE::FAILED), std::memory_order_release);
+			return;
+		}
+		if (chunk->acked && result.ok.verf != chunk->verf) {
+			// The server restarted after taking the first part, which it may have lost
+			chunk->acked = 0;
+			chunk->committed = nfs3::stable_how::FILE_SYNC;
+		} else {
+			chunk->acked += std::min(result.ok.count, count);
+		}
+		chunk->committed = std::min(chunk->committed, result.ok.committed);
+		chunk->verf = result.ok.verf;
+		chunk->state.store(static_cast<int32_t>(CHUNK_STATE::WRITTEN), std::memory_order_release);
+	};
+	chunk->status = 0;
+	chunk->state.store(static_cast<int32_t>(CHUNK_STATE::INFLIGHT), std::memory_order_relaxed);
+	// The payload goes out from the chunk, which stays untouched until the reply
+	if (RPC::runRPC<nfs3::WRITE3res>(chunk->connection, timeout, procedure, args, chunk->data.data() + chunk->acked, count, chunk, written) != 0) {
+		return -1;
+	}
+	inflight.push_back(chunk);
+	writes.fetch_add(1UL, std::memory_order_relaxed);
+	return 0;
+}
+
+// Takes in the WRITEs that finished
+void WriteEngine::settle() {
+	for (auto it = inflight.begin(); it != inflight.end();) {
+		auto chunk = *it;
+		auto state = chunk->getState();
+		if (state == CHUNK_STATE::INFLIGHT) {
+			++it;
+			continue;
+		}
+		it = inflight.erase(it);
+
+		if (state == CHUNK_STATE::FAILED) {
+			if (chunk->status < 0) {
+				DEBUG_LOG(CRITICAL) << "WRITE of " << chunk->size << " bytes at offset : " << chunk->offset << " failed : " << chunk->status;
+			} else {
+				DEBUG_LOG(CRITICAL) << "WRITE result : " << Context::NFSPROGERRImage::printEnum(static_cast<Context::NFSPROGERR>(chunk->status));
+			}
+			failed = true;
+			continue;
+		}
+		noteVerifier(chunk->verf);
+		if (chunk->acked < chunk->size) {
+			lost.push_back(chunk); // Short WRITE, the rest is sent again
+		} else if (chunk->committed == nfs3::stable_how::UNSTABLE) {
+			uncommitted.push_back(chunk);
+			uncommittedBytes += chunk->size;
+		}
+	}
+}
+
+// A new verifier means the server restarted, the WRITEs made under the old one are sent again
+void WriteEngine::noteVerifier(const nfs3::writeverf3& verf) {
+	if (verifierKnown && verf == verifier) {
+		return;
+	}
+	if (verifierKnown) {
+		DEBUG_LOG(CRITICAL) << "Write verifier changed, the server restarted. Sending uncommitted data again.";
+	}
+	verifier = verf;
+	verifierKnown = true;
+
+	auto stale = std::partition(uncommitted.begin(), uncommitted.end(), [&verf](const Chunk_p& chunk) { return chunk->verf == verf; });
+	for (auto chunk = stale; chunk != uncommitted.end(); ++chunk) {
+		(*chunk)->acked = 0;
+		(*chunk)->committed = nfs3::stable_how::FILE_SYNC;
+		uncommittedBytes -= (*chunk)->size;
+		lost.push_back(*chunk);
+	}
+	uncommitted.erase(stale, uncommitted.end());
+}
+
+int32_t WriteEngine::sendAgain(uint32_t timeout) {
+	while (not lost.empty()) {
+		if (waitForSlot(timeout) != 0) {
+			return -1;
+		}
+		auto chunk = lost.front();
+		lost.pop_front();
+		resends.fetch_add(1UL, std::memory_order_relaxed);
+		if (send(timeout, chunk) != 0) {
+			failed = true; // Its data is gone for good
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int32_t WriteEngine::waitFor(uint32_t timeout, const Chunk_p& chunk) {
+	if (chunk->getState() != CHUNK_STATE::INFLIGHT) {
+		return 0;
+	}
+	auto done = [&chunk]() {
+		return chunk->getState() != CHUNK_STATE::INFLIGHT;
+	};
+	if (chunk->connection->getRpcEngine()->waitUntil(done, timeout) != 0) {
+		DEBUG_LOG(CRITICAL) << "Timed out waiting for a WRITE at offset : " << chunk->offset;
+		return -1;
+	}
+	return 0;
+}
+
+// Waits for the oldest WRITE outstanding while the window is full
+int32_t WriteEngine::waitForSlot(uint32_t timeout) {
+	settle();
+	while (inflight.size() >= policy.window) {
+		if (waitFor(timeout, inflight.front()) != 0) {
+			return -1;
+		}
+		settle();
+	}
+	return 0;
+}
+
+// Waits until every WRITE sent, and sent again, got its reply
+int32_t WriteEngine::drain(uint32_t timeout) {
+	while (true) {
+		settle();
+		if (sendAgain(timeout) != 0) {
+			return -1;
+		}
+		if (inflight.empty()) {
+			return 0;
+		}
+		if (waitFor(timeout, inflight.front()) != 0) {
+			return -1;
+		}
+	}
+}
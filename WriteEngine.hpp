@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Context.hpp"
+#include "Connection.hpp"
+#include "BufferPool.hpp"
+#include "WritePolicy.hpp"
+#include "BlockCache.hpp"
+#include "NfsTypes.hpp"
+#include "GenericEnums.hpp"
+#include "types.hpp"
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Writes one file behind the caller. A write is copied into WRITEs of at most wsize bytes and returns once they are sent,
+ * with up to window of them outstanding. A WRITE that failed is reported by the next commit() or close(), as fsync() and
+ * close() report it on Linux.
+ *
+ * The server answers an UNSTABLE WRITE with its write verifier, and its data is kept until a COMMIT answered with the same
+ * verifier. A verifier that changed means the server restarted and lost what was not committed yet: every WRITE made under
+ * the old one is sent again, and so is the COMMIT. commit() covers a range with one COMMIT, close() the whole file.
+ *
+ * With gathering on, small writes wait in a dirty range and go out together as one WRITE, see WritePolicy. The WriteFlusher
+ * of the context sends the ranges that got too old for files nobody writes to anymore.
+ *
+ * A write drops the blocks of the file from the BlockCache of the context, they are read from the server again.
+ */
+class WriteFlusher;
+
+class WriteEngine {
+	public:
+		// Times a COMMIT is sent again for WRITEs a restarted server lost before giving up
+		constexpr static uint32_t MAX_COMMITS = 4;
+		// Largest WRITE over UDP, the call has to fit into one datagram. Same as the Linux client.
+		constexpr static uint32_t MAX_UDP_WSIZE = 32 * 1024;
+
+		WriteEngine(const Context_p& context, const handle_p& file, GenericEnums::AUTH_TYPE authType, const WritePolicy& policy);
+		~WriteEngine();
+
+		template<typename T>
+		WriteEngine(T&&) = delete;
+		template<typename T>
+		WriteEngine& operator=(T&&) = delete;
+
+		// Writes size bytes of src at offset. src can be reused once it returned. Returns size, or -1 if a WRITE could not be sent.
+		int64_t write(uint32_t timeout, uint64_t offset, uint64_t size, const uchar_t* src);
+		// Makes what was written to [offset, offset + size) durable, size 0 runs to the end of the file. Returns 0, or -1 if that or an earlier WRITE failed.
+		int32_t commit(uint32_t timeout, uint64_t offset, uint64_t size);
+		// Same for the whole file
+		int32_t close(uint32_t timeout);
+
+		// WRITEs and COMMITs sent, WRITEs sent again after the verifier changed, and bytes waiting for a COMMIT
+		uint64_t getWrites() const {
+			return writes.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getCommits() const {
+			return commits.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getResends() const {
+			return resends.load(std::memory_order_relaxed);
+		}
+
+		// Writes that went into a dirty range already there instead of starting one
+		uint64_t getGathered() const {
+			return gathered.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getUncommitted() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return uncommittedBytes;
+		}
+
+	private:
+		DESC_CLASS_ENUM(CHUNK_STATE, int32_t,
+			INFLIGHT,
+			WRITTEN,
+			FAILED
+		);
+
+		// Data of one WRITE. Its completion fills in the reply and publishes state last.
+		struct Chunk {
+			std::atomic<int32_t> state;
+			WireBuffer data;
+			uint64_t offset;
+			uint32_t size;
+			uint32_t acked; // Bytes the server took so far, a short WRITE sends the rest again
+			int32_t status; // Of the call, or the NFS status of a reply that failed
+			nfs3::stable_how committed; // Least durable of the replies
+			nfs3::writeverf3 verf;
+			Connection_p connection;
+
+			Chunk(uint64_t offset, uint32_t size) : state(static_cast<int32_t>(CHUNK_STATE::INFLIGHT)), offset(offset), size(size), acked(0), status(0), committed(nfs3::stable_how::FILE_SYNC), verf() {}
+
+			CHUNK_STATE getState() const {
+				return static_cast<CHUNK_STATE>(state.load(std::memory_order_acquire));
+			}
+		};
+		using Chunk_p = std::shared_ptr<Chunk>;
+
+		int32_t commitLocked(uint32_t timeout, uint64_t offset, uint64_t size);
+		int32_t gather(uint32_t timeout, uint64_t offset, uint64_t size, const uchar_t* src);
+		int32_t sendDirty(uint32_t timeout);
+		void flushAged(uint64_t now);
+		int32_t send(uint32_t timeout, const Chunk_p& chunk);
+		void settle();
+		void noteVerifier(const nfs3::writeverf3& verf);
+		int32_t sendAgain(uint32_t timeout);
+		int32_t waitFor(uint32_t timeout, const Chunk_p& chunk);
+		int32_t waitForSlot(uint32_t timeout);
+		int32_t drain(uint32_t timeout);
+
+		Context_p context;
+		handle_p file;
+		GenericEnums::AUTH_TYPE authType;
+		WritePolicy policy;
+		std::shared_ptr<BlockCache> cache;
+		BlockCache::FileId fileId;
+
+		mutable std::mutex mutex; // Held for a whole write or commit, writes of one file go one at a time
+		std::list<Chunk_p> inflight; // In send order
+		std::vector<Chunk_p> uncommitted; // Written UNSTABLE, kept for the COMMIT
+		std::deque<Chunk_p> lost; // To be sent again, after a short WRITE or a restart of the server
+		uint64_t uncommittedBytes;
+		nfs3::writeverf3 verifier; // Of the last reply
+		bool verifierKnown;
+		bool failed; // A WRITE failed since the last commit
+		Chunk_p dirty; // Gathered, not sent yet
+		uint64_t dirtySince;
+		uint32_t lastTimeout; // Of the last write, for the WRITE the flusher sends
+		std::shared_ptr<WriteFlusher> flusher; // Of the context while gathering, kept until the engine is removed from it
+
+		std::atomic<uint64_t> writes;
+		std::atomic<uint64_t> commits;
+		std::atomic<uint64_t> resends;
+		std::atomic<uint64_t> gathered;
+
+		friend class WriteFlusher;
+};
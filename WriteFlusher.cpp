@@ -0,0 +1,55 @@
+#include "WriteFlusher.hpp"
+#include "WriteEngine.hpp"
+#include "Utils.hpp"
+
+#include <vector>
+
+WriteFlusher::~WriteFlusher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+void WriteFlusher::add(WriteEngine* engine) {
+	std::lock_guard<std::mutex> lock(mutex);
+	engines.insert(engine);
+	if (not worker.joinable()) {
+		worker = std::thread(&WriteFlusher::run, this);
+	}
+}
+
+void WriteFlusher::remove(WriteEngine* engine) {
+	std::unique_lock<std::mutex> lock(mutex);
+	engines.erase(engine);
+	while (flushing == engine) {
+		flushed.wait(lock);
+	}
+}
+
+void WriteFlusher::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not stopping) {
+		wake.wait_for(lock, std::chrono::milliseconds(static_cast<uint32_t>(TICK_MS)));
+		auto now = getClockNs();
+		std::vector<WriteEngine*> snapshot(engines.begin(), engines.end());
+		for (auto engine : snapshot) {
+			if (stopping) {
+				break;
+			}
+			if (not engines.count(engine)) {
+				continue; // Removed while another engine was flushed
+			}
+			flushing = engine;
+			lock.unlock();
+			engine->flushAged(now);
+			lock.lock();
+			flushing = nullptr;
+			flushed.notify_all();
+		}
+	}
+}
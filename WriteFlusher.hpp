@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <stdint.h>
+
+class WriteEngine;
+
+/*
+ * Sends the dirty ranges of gathering WriteEngines once they are too old, as the writeback threads of Linux do. A Context
+ * writing with gather owns one, whose thread serves the engines of its files and is started with the first of them. An
+ * engine busy with a write is skipped, that write looks at the age itself.
+ *
+ * The ranges are sent without the flusher's lock, so engines come and go while a slow server holds up a flush. remove()
+ * waits out a flush of its own engine only.
+ */
+class WriteFlusher {
+	public:
+		constexpr static uint32_t TICK_MS = 100;
+
+		WriteFlusher() : flushing(nullptr), stopping(false) {}
+		~WriteFlusher();
+
+		template<typename T>
+		WriteFlusher(T&&) = delete;
+		template<typename T>
+		WriteFlusher& operator=(T&&) = delete;
+
+		void add(WriteEngine* engine);
+		// Once it returns the engine is not looked at anymore
+		void remove(WriteEngine* engine);
+
+	private:
+		void run();
+
+		std::set<WriteEngine*> engines;
+		WriteEngine* flushing; // Engine the thread is flushing without the lock
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable flushed;
+		std::thread worker;
+		bool stopping;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "NfsTypes.hpp"
+
+#include <stdint.h>
+
+/*
+ * How a file is written, after the wsize mount option of the Linux client. A write is split into WRITEs of at most wsize
+ * bytes, and up to window of them are kept outstanding per file. UNSTABLE WRITEs are kept until a COMMIT made them
+ * durable, and once commitAfter bytes wait for one a COMMIT is sent without being asked for. DATA_SYNC and FILE_SYNC
+ * WRITEs are durable on their own, they are there to compare with. wsize is at most MAX_WSIZE.
+ *
+ * With gather, writes are first merged into a dirty range within one wsize aligned block, which is sent as one WRITE once
+ * the block is full, a write does not continue the range, it is gatherAgeMs old, or the file is committed or closed.
+ */
+struct WritePolicy {
+	constexpr static uint32_t MAX_WSIZE = 1024 * 1024; // Same as the Linux client
+	uint32_t wsize;
+	uint32_t window;
+	nfs3::stable_how stable;
+	uint64_t commitAfter;
+	bool gather;
+	uint32_t gatherAgeMs;
+
+	WritePolicy() : wsize(1024 * 1024), window(16), stable(nfs3::stable_how::UNSTABLE), commitAfter(64 * 1024 * 1024), gather(false), gatherAgeMs(5000) {}
+};
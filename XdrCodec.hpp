@@ -0,0 +1,820 @@
+#pragma once
+
+#include "types.hpp"
+#include "XdrSwap.hpp"
+
+#include <array>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * XDR (RFC 4506) marshalling generated from type descriptions. A struct lists its fields once with XDR_FIELDS and gets
+ * an encoder and a decoder made of the codecs of its fields, in order.
+ *
+ * Every codec has a fixedSize, the encoded size of the type if it never varies and 0 otherwise. It is a compile time
+ * constant, and so is that of a struct made only of fixed size fields. Such a struct is bounds checked once as a whole
+ * and then stored or loaded field by field without further checks. Types of variable size check as they go. A fixed
+ * size struct made only of 32 and 64 bit fields, like fattr3, is byte swapped as a whole by the XdrSwap kernels, and
+ * so are arrays of unsigned words and hypers.
+ *
+ * Encoding and decoding never write or read outside the buffer they were given. They return false once anything did
+ * not fit, or did not decode, and every later call on the same encoder or decoder fails as well.
+ */
+
+inline void xdrPut32(uchar_t* dst, uint32_t value) {
+	dst[0] = (uchar_t)(value >> 24);
+	dst[1] = (uchar_t)(value >> 16);
+	dst[2] = (uchar_t)(value >> 8);
+	dst[3] = (uchar_t)value;
+}
+
+inline uint32_t xdrGet32(const uchar_t* src) {
+	return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+inline void xdrPut64(uchar_t* dst, uint64_t value) {
+	xdrPut32(dst, (uint32_t)(value >> 32));
+	xdrPut32(dst + 4, (uint32_t)value);
+}
+
+inline uint64_t xdrGet64(const uchar_t* src) {
+	return ((uint64_t)xdrGet32(src) << 32) | xdrGet32(src + 4);
+}
+
+constexpr uint32_t xdrPadded(uint32_t size) {
+	return (size + 3) & ~3u;
+}
+
+class XdrEncoder {
+	public:
+		XdrEncoder(uchar_t* buffer, uint32_t capacity, uint32_t offset = 0) : buffer(buffer), capacity(capacity), offset(offset), failed(offset > capacity), full(offset > capacity) {}
+
+		// Returns where the next size bytes go, or nullptr if they do not fit
+		uchar_t* reserve(uint32_t size) {
+			if (failed || size > capacity - offset) {
+				full = not failed;
+				failed = true;
+				return nullptr;
+			}
+			auto at = &buffer[offset];
+			offset += size;
+			return at;
+		}
+
+		// Copies size bytes and zero pads them to a multiple of four
+		bool putBytes(const uchar_t* bytes, uint32_t size) {
+			auto at = reserve(xdrPadded(size));
+			if (not at) {
+				return false;
+			}
+			memcpy(at, bytes, size);
+			memset(at + size, 0, xdrPadded(size) - size);
+			return true;
+		}
+
+		// Marks the value unencodable, e.g. longer than its type allows
+		bool fail() {
+			failed = true;
+			return false;
+		}
+
+		template<typename T>
+		bool put(const T& value);
+
+		uint32_t size() const {
+			return offset;
+		}
+
+		bool ok() const {
+			return not failed;
+		}
+
+		// True if encoding failed only for want of room, i.e. a larger buffer would take the value
+		bool overflowed() const {
+			return full;
+		}
+
+	private:
+		uchar_t* buffer;
+		uint32_t capacity;
+		uint32_t offset;
+		bool failed;
+		bool full;
+};
+
+// Cursor over a received message. Fields of variable size may be decoded as views into the message instead of copies.
+class XdrDecoder {
+	public:
+		XdrDecoder(const uchar_t* buffer, uint32_t length, uint32_t offset = 0) : buffer(buffer), length(length), offset(offset), failed(false), reason(nullptr), failedAt(0) {
+			if (buffer == nullptr) {
+				fail("no message");
+			} else if (offset > length) {
+				fail("offset beyond the message");
+			}
+		}
+
+		// Returns the next size bytes, or nullptr if the message ends before them
+		const uchar_t* take(uint32_t size) {
+			if (failed) {
+				return nullptr;
+			}
+			if (size > length - offset) {
+				fail("message ends inside a field");
+				return nullptr;
+			}
+			auto at = &buffer[offset];
+			offset += size;
+			return at;
+		}
+
+		// Marks the data undecodable, e.g. a length beyond what the type allows. Only the first failure is kept.
+		bool fail(const char* why = "malformed field") {
+			if (not failed) {
+				failed = true;
+				reason = why;
+				failedAt = offset;
+			}
+			return false;
+		}
+
+		template<typename T>
+		bool get(T& value);
+
+		const uchar_t* position() const {
+			return &buffer[offset];
+		}
+
+		uint32_t consumed() const {
+			return offset;
+		}
+
+		uint32_t remaining() const {
+			return length - offset;
+		}
+
+		bool ok() const {
+			return not failed;
+		}
+
+		// Why and where decoding failed, nullptr while it has not
+		const char* error() const {
+			return reason;
+		}
+
+		uint32_t errorOffset() const {
+			return failedAt;
+		}
+
+	private:
+		const uchar_t* buffer;
+		uint32_t length;
+		uint32_t offset;
+		bool failed;
+		const char* reason;
+		uint32_t failedAt;
+};
+
+// Lists the fields of a struct in wire order, as the last thing in its body
+#define XDR_FIELDS(...) \
+	auto xdrTie() -> decltype(std::tie(__VA_ARGS__)) { \
+		return std::tie(__VA_ARGS__); \
+	} \
+	auto xdrTie() const -> decltype(std::tie(__VA_ARGS__)) { \
+		return std::tie(__VA_ARGS__); \
+	}
+
+template<typename T, typename Enable = void>
+struct XdrCodec;
+
+template<typename T>
+bool XdrEncoder::put(const T& value) {
+	return XdrCodec<T>::encode(*this, value) && not failed;
+}
+
+template<typename T>
+bool XdrDecoder::get(T& value) {
+	return XdrCodec<T>::decode(*this, value) && not failed;
+}
+
+// Codec of a fixed size type, which only has to say how to store and load itself on memory already bounds checked
+template<typename T>
+struct XdrFixedCodec {
+	static bool encode(XdrEncoder& encoder, const T& value) {
+		auto at = encoder.reserve(XdrCodec<T>::fixedSize);
+		if (not at) {
+			return false;
+		}
+		XdrCodec<T>::store(at, value);
+		return true;
+	}
+
+	static bool decode(XdrDecoder& decoder, T& value) {
+		auto at = decoder.take(XdrCodec<T>::fixedSize);
+		if (not at) {
+			return false;
+		}
+		XdrCodec<T>::load(at, value);
+		return true;
+	}
+};
+
+// Whether a type is a run of 32 bit words on the wire, which its codec then also loads from words already byte swapped
+template<typename T, typename Enable = void>
+struct XdrIsWords : std::false_type {
+};
+
+template<typename T>
+struct XdrIsWords<T, typename std::enable_if<XdrCodec<T>::words>::type> : std::true_type {
+};
+
+inline void xdrSwapRun(const uchar_t* src, uint32_t* dst, size_t count) {
+	xdrSwapWords(src, dst, count);
+}
+
+inline void xdrSwapRun(const uchar_t* src, uint64_t* dst, size_t count) {
+	xdrSwapHypers(src, dst, count);
+}
+
+template<>
+struct XdrCodec<uint32_t> : XdrFixedCodec<uint32_t> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 4;
+	static uchar_t* store(uchar_t* dst, uint32_t value) {
+		xdrPut32(dst, value);
+		return dst + 4;
+	}
+	static const uchar_t* load(const uchar_t* src, uint32_t& value) {
+		value = xdrGet32(src);
+		return src + 4;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, uint32_t& value) {
+		value = words[0];
+		return words + 1;
+	}
+};
+
+template<>
+struct XdrCodec<int32_t> : XdrFixedCodec<int32_t> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 4;
+	static uchar_t* store(uchar_t* dst, int32_t value) {
+		xdrPut32(dst, (uint32_t)value);
+		return dst + 4;
+	}
+	static const uchar_t* load(const uchar_t* src, int32_t& value) {
+		value = (int32_t)xdrGet32(src);
+		return src + 4;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, int32_t& value) {
+		value = (int32_t)words[0];
+		return words + 1;
+	}
+};
+
+template<>
+struct XdrCodec<uint64_t> : XdrFixedCodec<uint64_t> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 8;
+	static uchar_t* store(uchar_t* dst, uint64_t value) {
+		xdrPut64(dst, value);
+		return dst + 8;
+	}
+	static const uchar_t* load(const uchar_t* src, uint64_t& value) {
+		value = xdrGet64(src);
+		return src + 8;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, uint64_t& value) {
+		value = ((uint64_t)words[0] << 32) | words[1];
+		return words + 2;
+	}
+};
+
+template<>
+struct XdrCodec<int64_t> : XdrFixedCodec<int64_t> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 8;
+	static uchar_t* store(uchar_t* dst, int64_t value) {
+		xdrPut64(dst, (uint64_t)value);
+		return dst + 8;
+	}
+	static const uchar_t* load(const uchar_t* src, int64_t& value) {
+		value = (int64_t)xdrGet64(src);
+		return src + 8;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, int64_t& value) {
+		value = (int64_t)(((uint64_t)words[0] << 32) | words[1]);
+		return words + 2;
+	}
+};
+
+template<>
+struct XdrCodec<bool> : XdrFixedCodec<bool> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 4;
+	static uchar_t* store(uchar_t* dst, bool value) {
+		xdrPut32(dst, value ? 1 : 0);
+		return dst + 4;
+	}
+	static const uchar_t* load(const uchar_t* src, bool& value) {
+		value = xdrGet32(src) != 0;
+		return src + 4;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, bool& value) {
+		value = words[0] != 0;
+		return words + 1;
+	}
+};
+
+// Enumerations go on the wire as their 32 bit value
+template<typename T>
+struct XdrCodec<T, typename std::enable_if<std::is_enum<T>::value>::type> : XdrFixedCodec<T> {
+	static constexpr bool words = true;
+	static constexpr uint32_t fixedSize = 4;
+	static uchar_t* store(uchar_t* dst, T value) {
+		xdrPut32(dst, static_cast<uint32_t>(value));
+		return dst + 4;
+	}
+	static const uchar_t* load(const uchar_t* src, T& value) {
+		value = static_cast<T>(xdrGet32(src));
+		return src + 4;
+	}
+	static const uint32_t* loadWords(const uint32_t* words, T& value) {
+		value = static_cast<T>(words[0]);
+		return words + 1;
+	}
+};
+
+// Fixed length opaque, e.g. a verifier
+template<size_t N>
+struct XdrCodec<std::array<uchar_t, N>> : XdrFixedCodec<std::array<uchar_t, N>> {
+	static constexpr uint32_t fixedSize = xdrPadded(N);
+	static uchar_t* store(uchar_t* dst, const std::array<uchar_t, N>& value) {
+		memcpy(dst, value.data(), N);
+		memset(dst + N, 0, fixedSize - N);
+		return dst + fixedSize;
+	}
+	static const uchar_t* load(const uchar_t* src, std::array<uchar_t, N>& value) {
+		memcpy(value.data(), src, N);
+		return src + fixedSize;
+	}
+};
+
+// Takes the length and the padded bytes of an opaque or a string, returns them or nullptr
+inline const uchar_t* xdrTakeCounted(XdrDecoder& decoder, uint32_t& size) {
+	if (not decoder.get(size)) {
+		return nullptr;
+	}
+	if (size > decoder.remaining()) {
+		decoder.fail("length beyond the end of the message");
+		return nullptr;
+	}
+	return decoder.take(xdrPadded(size));
+}
+
+// Variable length opaque
+template<>
+struct XdrCodec<std::vector<uchar_t>> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const std::vector<uchar_t>& value) {
+		return encoder.put((uint32_t)value.size()) && encoder.putBytes(value.data(), value.size());
+	}
+	static bool decode(XdrDecoder& decoder, std::vector<uchar_t>& value) {
+		uint32_t size;
+		auto at = xdrTakeCounted(decoder, size);
+		if (not at) {
+			return false;
+		}
+		value.assign(at, at + size);
+		return true;
+	}
+};
+
+template<>
+struct XdrCodec<std::string> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const std::string& value) {
+		return encoder.put((uint32_t)value.size()) && encoder.putBytes(reinterpret_cast<const uchar_t*>(value.data()), value.size());
+	}
+	static bool decode(XdrDecoder& decoder, std::string& value) {
+		uint32_t size;
+		auto at = xdrTakeCounted(decoder, size);
+		if (not at) {
+			return false;
+		}
+		value.assign(reinterpret_cast<const char*>(at), size);
+		return true;
+	}
+};
+
+// Counted array of any other type
+template<typename T>
+struct XdrCodec<std::vector<T>, typename std::enable_if<not std::is_same<T, uchar_t>::value>::type> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const std::vector<T>& value) {
+		if (not encoder.put((uint32_t)value.size())) {
+			return false;
+		}
+		for (auto& element : value) {
+			if (not encoder.put(element)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	static bool decode(XdrDecoder& decoder, std::vector<T>& value) {
+		uint32_t count;
+		if (not decoder.get(count)) {
+			return false;
+		}
+		uint32_t smallest = XdrCodec<T>::fixedSize ? XdrCodec<T>::fixedSize : sizeof(uint32_t);
+		if (count > decoder.remaining() / smallest) {
+			return decoder.fail("more elements than the message can hold"); // Do not size the vector by a bogus count
+		}
+		value.resize(count);
+		return decodeElements(decoder, value, std::integral_constant<bool, std::is_same<T, uint32_t>::value || std::is_same<T, uint64_t>::value>());
+	}
+
+	private:
+		// Arrays of unsigned words or hypers are swapped in one run
+		static bool decodeElements(XdrDecoder& decoder, std::vector<T>& value, std::true_type) {
+			auto at = decoder.take(value.size() * sizeof(T));
+			if (not at) {
+				return false;
+			}
+			xdrSwapRun(at, value.data(), value.size());
+			return true;
+		}
+
+		static bool decodeElements(XdrDecoder& decoder, std::vector<T>& value, std::false_type) {
+			for (auto& element : value) {
+				if (not decoder.get(element)) {
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+// XDR optional data (a pointer in the RFC), a boolean followed by the value if it is true
+template<typename T>
+struct XdrOptional {
+	bool present;
+	T value;
+
+	XdrOptional() : present(false), value() {}
+	XdrOptional(const T& value) : present(true), value(value) {}
+};
+
+template<typename T>
+struct XdrCodec<XdrOptional<T>> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const XdrOptional<T>& optional) {
+		return encoder.put(optional.present) && (not optional.present || encoder.put(optional.value));
+	}
+	static bool decode(XdrDecoder& decoder, XdrOptional<T>& optional) {
+		return decoder.get(optional.present) && (not optional.present || decoder.get(optional.value));
+	}
+};
+
+// Linked list as XDR encodes it, every element preceded by a true and the end marked by a false
+template<typename T>
+struct XdrList {
+	std::vector<T> elements;
+};
+
+template<typename T>
+struct XdrCodec<XdrList<T>> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const XdrList<T>& list) {
+		for (auto& element : list.elements) {
+			if (not encoder.put(true) || not encoder.put(element)) {
+				return false;
+			}
+		}
+		return encoder.put(false);
+	}
+	static bool decode(XdrDecoder& decoder, XdrList<T>& list) {
+		list.elements.clear();
+		bool follows;
+		while (decoder.get(follows) && follows) {
+			list.elements.emplace_back();
+			if (not decoder.get(list.elements.back())) {
+				return false;
+			}
+		}
+		return decoder.ok();
+	}
+};
+
+// Result of a procedure: a status, then Ok if the status is 0 (NFS3_OK, MNT3_OK), else Fail
+template<typename Ok, typename Fail>
+struct XdrResult {
+	uint32_t status;
+	Ok ok;
+	Fail fail;
+
+	XdrResult() : status(0), ok(), fail() {}
+};
+
+template<typename Ok, typename Fail>
+struct XdrCodec<XdrResult<Ok, Fail>> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const XdrResult<Ok, Fail>& result) {
+		return encoder.put(result.status) && (result.status == 0 ? encoder.put(result.ok) : encoder.put(result.fail));
+	}
+	static bool decode(XdrDecoder& decoder, XdrResult<Ok, Fail>& result) {
+		return decoder.get(result.status) && (result.status == 0 ? decoder.get(result.ok) : decoder.get(result.fail));
+	}
+};
+
+// Nothing on the wire, e.g. the resfail arm of procedures that return no data on failure
+struct XdrVoid {
+};
+
+template<>
+struct XdrCodec<XdrVoid> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder&, const XdrVoid&) {
+		return true;
+	}
+	static bool decode(XdrDecoder&, XdrVoid&) {
+		return true;
+	}
+};
+
+// Variable length opaque left where it is in the message, valid as long as the message buffer is
+struct XdrBytesView {
+	const uchar_t* data;
+	uint32_t size;
+
+	XdrBytesView() : data(nullptr), size(0) {}
+	XdrBytesView(const uchar_t* data, uint32_t size) : data(data), size(size) {}
+
+	std::vector<uchar_t> copy() const {
+		return std::vector<uchar_t>(data, data + size);
+	}
+};
+
+// Same for a string, which is not NUL terminated in the message
+struct XdrStringView {
+	const char* data;
+	uint32_t size;
+
+	XdrStringView() : data(nullptr), size(0) {}
+	XdrStringView(const char* data, uint32_t size) : data(data), size(size) {}
+
+	std::string str() const {
+		return std::string(data, size);
+	}
+
+	bool operator==(const std::string& other) const {
+		return other.size() == size && memcmp(other.data(), data, size) == 0;
+	}
+};
+
+template<>
+struct XdrCodec<XdrBytesView> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const XdrBytesView& value) {
+		return encoder.put(value.size) && encoder.putBytes(value.data, value.size);
+	}
+	static bool decode(XdrDecoder& decoder, XdrBytesView& value) {
+		auto at = xdrTakeCounted(decoder, value.size);
+		value.data = at;
+		return at != nullptr;
+	}
+};
+
+template<>
+struct XdrCodec<XdrStringView> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool encode(XdrEncoder& encoder, const XdrStringView& value) {
+		return encoder.put(value.size) && encoder.putBytes(reinterpret_cast<const uchar_t*>(value.data), value.size);
+	}
+	static bool decode(XdrDecoder& decoder, XdrStringView& value) {
+		auto at = xdrTakeCounted(decoder, value.size);
+		value.data = reinterpret_cast<const char*>(at);
+		return at != nullptr;
+	}
+};
+
+/*
+ * XDR linked list left in the message. Decoding it checks every element and counts them without storing any, forEach
+ * then decodes them one at a time into the same element. With elements made of views, e.g. directory entries, a list
+ * of any length is decoded without allocating.
+ */
+template<typename T>
+struct XdrListView {
+	const uchar_t* data;
+	uint32_t size; // Bytes of the list in the message, the final false included
+	uint32_t count;
+
+	XdrListView() : data(nullptr), size(0), count(0) {}
+
+	// Calls onElement(const T&) for every element in order
+	template<typename F>
+	void forEach(F onElement) const {
+		XdrDecoder decoder(data, size);
+		T element;
+		bool follows;
+		while (decoder.get(follows) && follows && decoder.get(element)) {
+			onElement(static_cast<const T&>(element));
+		}
+	}
+};
+
+template<typename T>
+struct XdrCodec<XdrListView<T>> {
+	static constexpr uint32_t fixedSize = 0;
+	static bool decode(XdrDecoder& decoder, XdrListView<T>& list) {
+		list.data = decoder.position();
+		list.count = 0;
+		auto start = decoder.consumed();
+		T element;
+		bool follows;
+		while (decoder.get(follows) && follows) {
+			if (not decoder.get(element)) {
+				return false;
+			}
+			++list.count;
+		}
+		list.size = decoder.consumed() - start;
+		return decoder.ok();
+	}
+};
+
+// Walks the fields of a struct, as returned by its xdrTie(), from field I on
+template<size_t I, size_t N>
+struct XdrFields {
+	template<typename Tuple>
+	using Field = typename std::decay<typename std::tuple_element<I, Tuple>::type>::type;
+
+	template<typename Tuple>
+	static constexpr uint32_t size() {
+		return XdrCodec<Field<Tuple>>::fixedSize + XdrFields<I + 1, N>::template size<Tuple>();
+	}
+
+	template<typename Tuple>
+	static constexpr bool fixed() {
+		return XdrCodec<Field<Tuple>>::fixedSize != 0 && XdrFields<I + 1, N>::template fixed<Tuple>();
+	}
+
+	template<typename Tuple>
+	static constexpr bool words() {
+		return XdrIsWords<Field<Tuple>>::value && XdrFields<I + 1, N>::template words<Tuple>();
+	}
+
+	template<typename Tuple>
+	static const uint32_t* loadWords(const uint32_t* src, const Tuple& fields) {
+		return XdrFields<I + 1, N>::loadWords(XdrCodec<Field<Tuple>>::loadWords(src, std::get<I>(fields)), fields);
+	}
+
+	template<typename Tuple>
+	static uchar_t* store(uchar_t* dst, const Tuple& fields) {
+		return XdrFields<I + 1, N>::store(XdrCodec<Field<Tuple>>::store(dst, std::get<I>(fields)), fields);
+	}
+
+	template<typename Tuple>
+	static const uchar_t* load(const uchar_t* src, const Tuple& fields) {
+		return XdrFields<I + 1, N>::load(XdrCodec<Field<Tuple>>::load(src, std::get<I>(fields)), fields);
+	}
+
+	template<typename Tuple>
+	static bool encode(XdrEncoder& encoder, const Tuple& fields) {
+		return encoder.put(std::get<I>(fields)) && XdrFields<I + 1, N>::encode(encoder, fields);
+	}
+
+	template<typename Tuple>
+	static bool decode(XdrDecoder& decoder, const Tuple& fields) {
+		return decoder.get(std::get<I>(fields)) && XdrFields<I + 1, N>::decode(decoder, fields);
+	}
+};
+
+template<size_t N>
+struct XdrFields<N, N> {
+	template<typename Tuple>
+	static constexpr uint32_t size() {
+		return 0;
+	}
+
+	template<typename Tuple>
+	static constexpr bool fixed() {
+		return true;
+	}
+
+	template<typename Tuple>
+	static constexpr bool words() {
+		return true;
+	}
+
+	template<typename Tuple>
+	static const uint32_t* loadWords(const uint32_t* src, const Tuple&) {
+		return src;
+	}
+
+	template<typename Tuple>
+	static uchar_t* store(uchar_t* dst, const Tuple&) {
+		return dst;
+	}
+
+	template<typename Tuple>
+	static const uchar_t* load(const uchar_t* src, const Tuple&) {
+		return src;
+	}
+
+	template<typename Tuple>
+	static bool encode(XdrEncoder&, const Tuple&) {
+		return true;
+	}
+
+	template<typename Tuple>
+	static bool decode(XdrDecoder&, const Tuple&) {
+		return true;
+	}
+};
+
+template<typename T>
+struct XdrHasFields {
+	template<typename U>
+	static std::true_type test(decltype(std::declval<U&>().xdrTie())*);
+	template<typename U>
+	static std::false_type test(...);
+
+	static constexpr bool value = decltype(test<T>(nullptr))::value;
+};
+
+// Any struct described with XDR_FIELDS
+template<typename T>
+struct XdrCodec<T, typename std::enable_if<XdrHasFields<T>::value>::type> {
+	using Tie = decltype(std::declval<T&>().xdrTie());
+	using Walk = XdrFields<0, std::tuple_size<Tie>::value>;
+
+	static constexpr uint32_t fixedSize = Walk::template fixed<Tie>() ? Walk::template size<Tie>() : 0;
+	static constexpr bool words = fixedSize != 0 && Walk::template words<Tie>();
+	static constexpr uint32_t BULK_WORDS = 8; // Shorter runs are not worth a call into the swap kernels
+
+	static uchar_t* store(uchar_t* dst, const T& value) {
+		return Walk::store(dst, value.xdrTie());
+	}
+
+	static const uchar_t* load(const uchar_t* src, T& value) {
+		return load(src, value, std::integral_constant<bool, words && fixedSize / sizeof(uint32_t) >= BULK_WORDS>());
+	}
+
+	static const uint32_t* loadWords(const uint32_t* src, T& value) {
+		return Walk::loadWords(src, value.xdrTie());
+	}
+
+	static bool encode(XdrEncoder& encoder, const T& value) {
+		return encode(encoder, value, std::integral_constant<bool, fixedSize != 0>());
+	}
+
+	static bool decode(XdrDecoder& decoder, T& value) {
+		return decode(decoder, value, std::integral_constant<bool, fixedSize != 0>());
+	}
+
+	private:
+		// Made only of words, e.g. fattr3. Swapped in one run, then the fields are taken from the swapped words.
+		static const uchar_t* load(const uchar_t* src, T& value, std::true_type) {
+			uint32_t swapped[fixedSize / sizeof(uint32_t)];
+			xdrSwapWords(src, swapped, fixedSize / sizeof(uint32_t));
+			loadWords(swapped, value);
+			return src + fixedSize;
+		}
+
+		static const uchar_t* load(const uchar_t* src, T& value, std::false_type) {
+			return Walk::load(src, value.xdrTie());
+		}
+
+		// Fixed size, one bounds check for the whole struct
+		static bool encode(XdrEncoder& encoder, const T& value, std::true_type) {
+			auto at = encoder.reserve(fixedSize);
+			if (not at) {
+				return false;
+			}
+			store(at, value);
+			return true;
+		}
+
+		static bool decode(XdrDecoder& decoder, T& value, std::true_type) {
+			auto at = decoder.take(fixedSize);
+			if (not at) {
+				return false;
+			}
+			load(at, value);
+			return true;
+		}
+
+		static bool encode(XdrEncoder& encoder, const T& value, std::false_type) {
+			return Walk::encode(encoder, value.xdrTie());
+		}
+
+		static bool decode(XdrDecoder& decoder, T& value, std::false_type) {
+			return Walk::decode(decoder, value.xdrTie());
+		}
+};
@@ -0,0 +1,119 @@
+#include "XdrSwap.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XDR_SWAP_X86 1
+#endif
+
+namespace {
+
+using SwapKernel = void (*)(const uchar_t*, uchar_t*, size_t, size_t);
+
+// Swaps count elements of width 4 or 8 bytes
+void swapScalar(const uchar_t* src, uchar_t* dst, size_t count, size_t width) {
+	if (width == sizeof(uint32_t)) {
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t word;
+			memcpy(&word, src + i * sizeof(word), sizeof(word));
+			word = __builtin_bswap32(word);
+			memcpy(dst + i * sizeof(word), &word, sizeof(word));
+		}
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t hyper;
+			memcpy(&hyper, src + i * sizeof(hyper), sizeof(hyper));
+			hyper = __builtin_bswap64(hyper);
+			memcpy(dst + i * sizeof(hyper), &hyper, sizeof(hyper));
+		}
+	}
+}
+
+#ifdef XDR_SWAP_X86
+
+// Shuffle reversing the bytes within every 4 or 8 byte lane of 16 bytes
+__attribute__((target("ssse3")))
+__m128i swapMask128(size_t width) {
+	return (width == sizeof(uint32_t)) ? _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+		: _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+}
+
+__attribute__((target("ssse3")))
+void swapSsse3(const uchar_t* src, uchar_t* dst, size_t count, size_t width) {
+	size_t bytes = count * width;
+	size_t i = 0;
+	auto mask = swapMask128(width);
+	for (; i + 16 <= bytes; i += 16) {
+		auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(block, mask));
+	}
+	swapScalar(src + i, dst + i, (bytes - i) / width, width);
+}
+
+__attribute__((target("avx2")))
+void swapAvx2(const uchar_t* src, uchar_t* dst, size_t count, size_t width) {
+	size_t bytes = count * width;
+	size_t i = 0;
+	auto lane = swapMask128(width);
+	auto mask = _mm256_broadcastsi128_si256(lane); // vpshufb shuffles within each 16 byte half
+	for (; i + 32 <= bytes; i += 32) {
+		auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(block, mask));
+	}
+	if (i + 16 <= bytes) {
+		auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(block, lane));
+		i += 16;
+	}
+	swapScalar(src + i, dst + i, (bytes - i) / width, width);
+}
+
+#endif
+
+struct Kernel {
+	SwapKernel swap;
+	const char* name;
+};
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+// Big endian hosts have nothing to swap
+void copyOnly(const uchar_t* src, uchar_t* dst, size_t count, size_t width) {
+	memcpy(dst, src, count * width);
+}
+#endif
+
+Kernel pickKernel() {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return {copyOnly, "copy"};
+#endif
+#ifdef XDR_SWAP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return {swapAvx2, "avx2"};
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return {swapSsse3, "ssse3"};
+	}
+#endif
+	return {swapScalar, "scalar"};
+}
+
+const Kernel& kernel() {
+	static const Kernel picked = pickKernel();
+	return picked;
+}
+
+}
+
+void xdrSwapWords(const uchar_t* src, uint32_t* dst, size_t count) {
+	kernel().swap(src, reinterpret_cast<uchar_t*>(dst), count, sizeof(uint32_t));
+}
+
+void xdrSwapHypers(const uchar_t* src, uint64_t* dst, size_t count) {
+	kernel().swap(src, reinterpret_cast<uchar_t*>(dst), count, sizeof(uint64_t));
+}
+
+const char* xdrSwapKernel() {
+	return kernel().name;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bulk conversion of runs of big-endian XDR words to host order, for the fixed layout parts of replies such as fattr3.
+ * On x86 the runs are byte swapped with AVX2 or SSSE3 shuffles when the CPU has them, picked once at first use, and
+ * word by word otherwise. The source needs no alignment.
+ */
+
+// count 32 bit words from src into dst
+void xdrSwapWords(const uchar_t* src, uint32_t* dst, size_t count);
+// count 64 bit hypers from src into dst
+void xdrSwapHypers(const uchar_t* src, uint64_t* dst, size_t count);
+
+// Which kernel the two use, for logging
+const char* xdrSwapKernel();
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Outstanding calls keyed by xid, split over SHARDS independently locked hash maps. A reply only locks the shard of its
+ * xid, so replies for different calls, in whatever order the server sends them, are matched without contending with
+ * each other or with submitters. A thread draws consecutive xids (see nextXid()), which fall into consecutive shards.
+ *
+ * Callbacks run with their shard locked and must not call back into the table.
+ */
+template<typename T>
+class XidTable {
+	public:
+		constexpr static uint32_t SHARDS = 32;
+
+		XidTable() : count(0) {}
+
+		template<typename U>
+		XidTable(U&&) = delete;
+		template<typename U>
+		XidTable& operator=(U&&) = delete;
+
+		// Returns false if xid is already present, value is left as it was then
+		bool insert(uint32_t xid, T&& value) {
+			auto& shard = shardOf(xid);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			if (shard.entries.count(xid)) {
+				return false;
+			}
+			shard.entries.emplace(xid, std::move(value));
+			++count;
+			return true;
+		}
+
+		// Moves the entry of xid out into value. Returns false if xid is not present.
+		bool take(uint32_t xid, T& value) {
+			auto& shard = shardOf(xid);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto iter = shard.entries.find(xid);
+			if (iter == shard.entries.end()) {
+				return false;
+			}
+			value = std::move(iter->second);
+			shard.entries.erase(iter);
+			--count;
+			return true;
+		}
+
+		// Moves the entry of xid out into value if select(T&) returns true for it. select may modify an entry it keeps.
+		template<typename F>
+		bool takeIf(uint32_t xid, F select, T& value) {
+			auto& shard = shardOf(xid);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto iter = shard.entries.find(xid);
+			if (iter == shard.entries.end() || not select(iter->second)) {
+				return false;
+			}
+			value = std::move(iter->second);
+			shard.entries.erase(iter);
+			--count;
+			return true;
+		}
+
+		// Runs update(T&) on the entry of xid. Returns false if xid is not present.
+		template<typename F>
+		bool update(uint32_t xid, F update) {
+			auto& shard = shardOf(xid);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto iter = shard.entries.find(xid);
+			if (iter == shard.entries.end()) {
+				return false;
+			}
+			update(iter->second);
+			return true;
+		}
+
+		// Moves out every entry for which select(xid, T&) returns true, one shard at a time. select may modify the entries it keeps.
+		template<typename F>
+		void takeIf(F select, std::vector<std::pair<uint32_t, T>>& taken) {
+			for (auto& shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				for (auto iter = shard.entries.begin(); iter != shard.entries.end();) {
+					if (not select(iter->first, iter->second)) {
+						++iter;
+						continue;
+					}
+					taken.emplace_back(iter->first, std::move(iter->second));
+					iter = shard.entries.erase(iter);
+					--count;
+				}
+			}
+		}
+
+		void takeAll(std::vector<std::pair<uint32_t, T>>& taken) {
+			takeIf([](uint32_t, T&) { return true; }, taken);
+		}
+
+		size_t size() const {
+			return count.load(std::memory_order_relaxed);
+		}
+
+		bool empty() const {
+			return size() == 0;
+		}
+
+	private:
+		struct alignas(64) Shard {
+			std::mutex mutex;
+			std::unordered_map<uint32_t, T> entries;
+		};
+
+		Shard& shardOf(uint32_t xid) {
+			return shards[xid % SHARDS];
+		}
+
+		Shard shards[SHARDS];
+		std::atomic<size_t> count;
+};
@@ -31,29 +31,114 @@
 #include "Mount.hpp"
 #include "FSTree.hpp"
 #include "rpc.hpp"
+#include "BufferPool.hpp"
+#include "XdrSwap.hpp"
 #include <iomanip>
 
 #define RECV_TIMEOUT		5
 
+// Reads size bytes of file under root front to back, in reads of ioSize or rsize, and reports the throughput. With a block
+// cache the file is closed and read a second time, which the cache serves as far as it holds the file.
+static void readFile(Context_p& context, const Context::Inode_p& root, const iName& file, uint64_t size, uint64_t ioSize) {
+	uint64_t chunk = ioSize ? ioSize : context->getReadPolicy().rsize;
+	WireBuffer buffer(chunk);
+	if (not buffer.data()) {
+		return;
+	}
+	auto cache = context->getBlockCache();
+	for (uint32_t pass = 0; pass < (cache ? 2U : 1U); ++pass) {
+		uint64_t done = 0;
+		auto start = getClockNs();
+		while (done < size) {
+			uint64_t want = (size - done < chunk) ? size - done : chunk;
+			auto got = Context::Inode::read(context, RECV_TIMEOUT, file, root, done, want, buffer.data(), GenericEnums::AUTH_TYPE::AUTH_SYS);
+			if (got <= 0) {
+				break;
+			}
+			done += got;
+		}
+		Context::Inode::close(RECV_TIMEOUT, file, root);
+		auto elapsedNs = getClockNs() - start;
+		DEBUG_LOG(CRITICAL) << "Read " << done << " bytes of " << file << " in " << elapsedNs / 1000000UL << " ms, " << (elapsedNs ? done * 1000UL / elapsedNs : 0UL) << " MB/s";
+		if (cache) {
+			DEBUG_LOG(CRITICAL) << "Block cache : " << cache->getHits() << " hits, " << cache->getMisses() << " misses, " << cache->getBytes() / 1024UL << " KB cached";
+		}
+	}
+}
+
+// Writes size bytes to file under root front to back, in writes of ioSize or wsize, closes it and reports the throughput
+static void writeFile(Context_p& context, const Context::Inode_p& root, const iName& file, uint64_t size, uint64_t ioSize) {
+	uint64_t chunk = ioSize ? ioSize : context->getWritePolicy().wsize;
+	WireBuffer buffer(chunk);
+	if (not buffer.data()) {
+		return;
+	}
+	for (uint64_t i = 0; i < chunk; ++i) {
+		buffer.data()[i] = i & 0xff;
+	}
+	uint64_t done = 0;
+	auto start = getClockNs();
+	while (done < size) {
+		uint64_t want = (size - done < chunk) ? size - done : chunk;
+		if (Context::Inode::write(context, RECV_TIMEOUT, file, root, done, want, buffer.data(), GenericEnums::AUTH_TYPE::AUTH_SYS) < 0) {
+			break;
+		}
+		done += want;
+	}
+	auto status = Context::Inode::close(RECV_TIMEOUT, file, root);
+	auto elapsedNs = getClockNs() - start;
+	DEBUG_LOG(CRITICAL) << "Wrote " << done << " bytes of " << file << " in " << elapsedNs / 1000000UL << " ms, " << (elapsedNs ? done * 1000UL / elapsedNs : 0UL) << " MB/s, close : " << status;
+}
+
+#ifdef NFSCLISIM_COROUTINES
+#include "Coroutines.hpp"
+#include <atomic>
+#include <thread>
+
+#define CLIENT_ROUNDS		16
+
+// One simulated client, looks up the root and reads its attributes CLIENT_ROUNDS times
+static Task<void> simulateClient(Context_p context, handle_p root, std::atomic<uint32_t>* failures) {
+	for (uint32_t i = 0; i < CLIENT_ROUNDS; ++i) {
+		auto self = co_await CoInode::lookup(context, RECV_TIMEOUT, root, ".", GenericEnums::AUTH_TYPE::AUTH_SYS);
+		if (not self || co_await CoInode::getattr(context, RECV_TIMEOUT, self, nullptr, GenericEnums::AUTH_TYPE::AUTH_SYS) != 0) {
+			++*failures;
+		}
+	}
+}
+
+static void runClients(const Context_p& context, const handle& rootHandle, uint32_t clients) {
+	Executor executor(std::thread::hardware_concurrency());
+	auto root = std::make_shared<handle>(rootHandle);
+	std::atomic<uint32_t> failures(0);
+	auto start = getClockNs();
+	for (uint32_t i = 0; i < clients; ++i) {
+		executor.spawn(simulateClient(context, root, &failures));
+	}
+	executor.join();
+	DEBUG_LOG(CRITICAL) << clients << " clients made " << clients * CLIENT_ROUNDS * 2 << " calls in " << (getClockNs() - start) / 1000000UL << " ms, failed rounds : " << failures.load();
+}
+#endif
+
 int main (int argc, char** argv)
 {
 	ServerContexts sContexts;
+	Workload workload;
 
-	if (parseArgs(argc, argv, sContexts) <= 0) {
+	if (parseArgs(argc, argv, sContexts, workload) <= 0) {
 		exit(-1);
 	}
 
-	Context_p context1 = sContexts.getContext(0);
-
-	PortMapperContext portMapper(context1, GenericEnums::RPC_VERSION::RPC_VERSION2, GenericEnums::PROGRAM_VERSION::PROGRAM_VERSION2, GenericEnums::AUTH_TYPE::AUTH_SYS);
-
-	auto mountPort = portMapper.getMountPort(RECV_TIMEOUT);
-	DEBUG_LOG(CRITICAL) << "Mount port : " << mountPort;
-	auto nfsPort = portMapper.getNfsPort(RECV_TIMEOUT);
-	DEBUG_LOG(CRITICAL) << "NFS port : " << nfsPort;
+	if (sContexts.bringUp(RECV_TIMEOUT) <= 0) {
+		DEBUG_LOG(CRITICAL) << "No server could be brought up";
+		exit(-1);
+	}
 
-	context1->setMountPort(mountPort);
-	context1->setNfsPort(nfsPort);
+	int32_t index = -1;
+	Context_p context1 = sContexts.selectContext(index);
+	DEBUG_LOG(CRITICAL) << "Mount port : " << context1->getMountPort();
+	DEBUG_LOG(CRITICAL) << "NFS port : " << context1->getNfsPort();
+	DEBUG_LOG(CRITICAL) << "XDR swap kernel : " << xdrSwapKernel();
 
 	MountContext mount(context1);
 	FSTree fsTree;
@@ -71,9 +156,22 @@ int main (int argc, char** argv)
 
 	Context::Inode::lookup(context1, RECV_TIMEOUT, ".", root, GenericEnums::AUTH_TYPE::AUTH_SYS);
 
+	if (workload.write.size) {
+		writeFile(context1, root, workload.write.file, workload.write.size, workload.write.ioSize);
+	}
+	if (workload.read.size) {
+		readFile(context1, root, workload.read.file, workload.read.size, workload.read.ioSize);
+	}
+
+#ifdef NFSCLISIM_COROUTINES
+	if (workload.clients) {
+		runClients(context1, handle, workload.clients);
+	}
+#endif
+
 	mount.makeUmountCall(5, remote, 3, GenericEnums::AUTH_TYPE::AUTH_SYS);
 
-	sContexts.putContext(0);
+	sContexts.putContext(index);
 
 	return 0;
 
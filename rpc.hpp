@@ -1,6 +1,13 @@
 #include "Context.hpp"
+#include "Utils.hpp"
 #include "xdr.hpp"
+#include "XdrCodec.hpp"
 #include "PortMapperContext.hpp"
+#include "RpcEngine.hpp"
+#include "RpcCallTemplate.hpp"
+
+#include <functional>
+#include <memory>
 
 #pragma once
 
@@ -9,6 +16,24 @@ class RPC {
 		RPC() = default;
 
 		constexpr static uint32_t HOSTNAME_LEN = 256;
+		constexpr static uint32_t INITIAL_REQUEST_SIZE = 1024;
+
+		// What a call goes to. The program, versions and flavor pick its header template.
+		struct Procedure {
+			GenericEnums::RPC_VERSION rpcVersion;
+			GenericEnums::RPC_PROGRAM program;
+			GenericEnums::PROGRAM_VERSION programVersion;
+			GenericEnums::AUTH_TYPE authType;
+			uint32_t procedure;
+			const char* name; // For logging
+		};
+
+		// Outcome of a call as a coroutine gets it: status 0 and the decoded result, or a negative status
+		template<typename Result>
+		struct Reply {
+			int32_t status;
+			Result result;
+		};
 
 		static uint32_t makeRPC(uint32_t xid, GenericEnums::RPCTYPE rpcType, GenericEnums::RPC_VERSION rpcVersion, GenericEnums::RPC_PROGRAM rpcProgram, GenericEnums::PROGRAM_VERSION programVersion, uchar_t* wireBytes) {
 			uint32_t size = 0;
@@ -63,69 +88,203 @@ class RPC {
 		}
 
 		static uchar_t* parseAndStripRPC(uchar_t* wireResponse, uint32_t responseSize, uint32_t xid) {
-			uint32_t parsedOffset = 0;
-			auto recvXid = xdr_decode_u32(wireResponse, parsedOffset);
+			uint32_t payloadSize;
+			return parseAndStripRPC(wireResponse, responseSize, xid, payloadSize);
+		}
+
+		// Same, and sets payloadSize to the number of bytes from the returned payload to the end of the response
+		static uchar_t* parseAndStripRPC(uchar_t* wireResponse, uint32_t responseSize, uint32_t xid, uint32_t& payloadSize) {
+			payloadSize = 0;
+			XdrDecoder decoder(wireResponse, responseSize);
+			uint32_t recvXid;
+			uint32_t rpcType;
+			uint32_t replyType;
+			if (not decoder.get(recvXid) || not decoder.get(rpcType) || not decoder.get(replyType)) {
+				DEBUG_LOG(CRITICAL) << "Truncated RPC reply of : " << responseSize << " bytes";
+				return nullptr;
+			}
 
 			if (recvXid != xid) {
 				DEBUG_LOG(CRITICAL) << "Received response xid :" << recvXid << " does not match passed xid :" << xid;
 				return nullptr;
 			}
 
-			GenericEnums::RPCTYPE rpcType;
-			if ((rpcType = static_cast<GenericEnums::RPCTYPE>(xdr_decode_u32(wireResponse, parsedOffset))) != GenericEnums::RPCTYPE::REPLY) {
-				DEBUG_LOG(CRITICAL) << "Received wrong RPC message type :" << GenericEnums::RPCTYPEImage::printEnum(rpcType);
+			if (static_cast<GenericEnums::RPCTYPE>(rpcType) != GenericEnums::RPCTYPE::REPLY) {
+				DEBUG_LOG(CRITICAL) << "Received wrong RPC message type :" << GenericEnums::RPCTYPEImage::printEnum(static_cast<GenericEnums::RPCTYPE>(rpcType));
 			}
 
-			RPC_REPLY replyType;
-			if ((replyType = static_cast<RPC_REPLY>(xdr_decode_u32(wireResponse, parsedOffset))) != RPC_REPLY::MSG_ACCEPTED) {
-				DEBUG_LOG(CRITICAL) << "RPC response message denied :" << RPC_REPLYImage::printEnum(replyType);
+			if (static_cast<RPC_REPLY>(replyType) != RPC_REPLY::MSG_ACCEPTED) {
+				DEBUG_LOG(CRITICAL) << "RPC response message denied :" << RPC_REPLYImage::printEnum(static_cast<RPC_REPLY>(replyType));
 			}
 
-			if (replyType == RPC_REPLY::MSG_DENIED) {
-				RPC_REJECTED rejectionType;
-
-				if ((rejectionType = static_cast<RPC_REJECTED>(xdr_decode_u32(wireResponse, parsedOffset))) == RPC_REJECTED::RPC_MISMATCH) {
-					uint32_t low;
-					uint32_t high;
-					low = xdr_decode_u32(wireResponse, parsedOffset);
-					high = xdr_decode_u32(wireResponse, parsedOffset);
-					DEBUG_LOG(CRITICAL) << "RPC message denied reason :" << RPC_REJECTEDImage::printEnum(rejectionType) << " Supported versions from : " << low << " to : " << high;
-					return nullptr;
-				} else {
-					DASSERT(rejectionType == RPC_REJECTED::AUTH_ERROR);
-					RPC_AUTH_ERROR authError;
-					authError = static_cast<RPC_AUTH_ERROR>(xdr_decode_u32(wireResponse, parsedOffset));
-					DEBUG_LOG(CRITICAL) << "RPC message denied reason : " << RPC_AUTH_ERRORImage::printEnum(authError);
-					return nullptr;
+			if (static_cast<RPC_REPLY>(replyType) == RPC_REPLY::MSG_DENIED) {
+				uint32_t rejectionType;
+				uint32_t low = 0;
+				uint32_t high = 0;
+				uint32_t authError = 0;
+				decoder.get(rejectionType);
+				if (decoder.ok() && static_cast<RPC_REJECTED>(rejectionType) == RPC_REJECTED::RPC_MISMATCH) {
+					decoder.get(low);
+					decoder.get(high);
+					DEBUG_LOG(CRITICAL) << "RPC message denied reason :" << RPC_REJECTEDImage::printEnum(RPC_REJECTED::RPC_MISMATCH) << " Supported versions from : " << low << " to : " << high;
+				} else if (decoder.get(authError)) {
+					DEBUG_LOG(CRITICAL) << "RPC message denied reason : " << RPC_AUTH_ERRORImage::printEnum(static_cast<RPC_AUTH_ERROR>(authError));
 				}
-			} else { /* MSG_ACCEPTED */
-				uint32_t verifierType = xdr_decode_u32(wireResponse, parsedOffset); // Ignore the verifier
-				uint32_t verifierOpague = xdr_decode_u32(wireResponse, parsedOffset); // Ignore the opague data
-
-				RPC_SUCCESS successType;
-				successType = static_cast<RPC_SUCCESS>(xdr_decode_u32(wireResponse, parsedOffset));
-				if (successType == RPC_SUCCESS::SUCCESS) {
-						uchar_t* returnValue = &wireResponse[parsedOffset];
-						return returnValue;
-				} else {
-					if (successType == RPC_SUCCESS::PROG_MISMATCH) {
-						uint32_t low;
-						uint32_t high;
-						low = xdr_decode_u32(wireResponse, parsedOffset);
-						high = xdr_decode_u32(wireResponse, parsedOffset);
-						DEBUG_LOG(CRITICAL) << "RPC program mismatch :" << RPC_SUCCESSImage::printEnum(successType) << " Supported versions from : " << low << " to : " << high;
-					} else {
-						DEBUG_LOG(CRITICAL) << "RPC server side failure reason : " << RPC_SUCCESSImage::printEnum(successType);
-					}
-					return nullptr;
+				if (not decoder.ok()) {
+					DEBUG_LOG(CRITICAL) << "Malformed RPC rejection : " << decoder.error() << " at offset : " << decoder.errorOffset();
+				}
+				return nullptr;
+			}
+
+			/* MSG_ACCEPTED */
+			uint32_t verifierType;
+			XdrBytesView verifier; // Ignored, but its body may not be empty
+			uint32_t successType;
+			if (not decoder.get(verifierType) || not decoder.get(verifier) || not decoder.get(successType)) {
+				DEBUG_LOG(CRITICAL) << "Malformed RPC reply : " << decoder.error() << " at offset : " << decoder.errorOffset();
+				return nullptr;
+			}
+
+			if (static_cast<RPC_SUCCESS>(successType) == RPC_SUCCESS::SUCCESS) {
+				payloadSize = decoder.remaining();
+				return &wireResponse[decoder.consumed()];
+			}
+			if (static_cast<RPC_SUCCESS>(successType) == RPC_SUCCESS::PROG_MISMATCH) {
+				uint32_t low = 0;
+				uint32_t high = 0;
+				decoder.get(low);
+				decoder.get(high);
+				DEBUG_LOG(CRITICAL) << "RPC program mismatch :" << RPC_SUCCESSImage::printEnum(RPC_SUCCESS::PROG_MISMATCH) << " Supported versions from : " << low << " to : " << high;
+			} else {
+				DEBUG_LOG(CRITICAL) << "RPC server side failure reason : " << RPC_SUCCESSImage::printEnum(static_cast<RPC_SUCCESS>(successType));
+			}
+			return nullptr;
+		}
+
+		/*
+		 * The one way a procedure is called. Encodes args behind the call header of procedure, sends the call with a fresh
+		 * xid through the RpcEngine of connection, and on the reply checks its RPC header and decodes the Result of the
+		 * procedure. completion gets status 0 and the result, or the engine's negative status, or -EPROTO if the server
+		 * did not accept the call or its reply does not decode, in which case the result is not valid. Views in the
+		 * result point into the reply and are valid only while completion runs.
+		 *
+		 * Returns 0 once the call is in flight, otherwise -1 and completion never runs. completion runs on whichever thread
+		 * reaps the reply: on a blocking connection that is the caller, through RpcEngine::reap() or drain().
+		 */
+		template<typename Result, typename Args>
+		static int32_t runRPC(const Connection_p& connection, uint32_t timeout, const Procedure& procedure, const Args& args, std::function<void(int32_t status, Result& result)> completion) {
+			uint32_t xid = nextXid();
+			auto request = std::make_shared<WireBuffer>(); // The engine reads it until completion ran
+			auto requestSize = encodeCall(procedure, xid, args, *request);
+			if (requestSize == 0) {
+				return -1;
+			}
+
+			auto onReply = [procedure, xid, completion, request](int32_t status, uchar_t* reply, int32_t replySize) {
+				Result result;
+				if (status == 0) {
+					status = decodeReply(procedure, xid, reply, replySize, result);
 				}
+				completion(status, result);
+			};
+			return connection->getRpcEngine()->submit(timeout, xid, request->data(), requestSize, onReply);
+		}
+
+		/*
+		 * Same, for a call whose args end in opaque data: args is what comes before it, and the size bytes at data go out
+		 * behind the encoded call as they are, not copied into it. keep owns data and is held until completion ran.
+		 */
+		template<typename Result, typename Args>
+		static int32_t runRPC(const Connection_p& connection, uint32_t timeout, const Procedure& procedure, const Args& args, const uchar_t* data, uint32_t size, const std::shared_ptr<const void>& keep, std::function<void(int32_t status, Result& result)> completion) {
+			static const uchar_t zeros[sizeof(uint32_t)] = {};
+			uint32_t xid = nextXid();
+			auto request = std::make_shared<WireBuffer>();
+			auto requestSize = encodeCall(procedure, xid, args, *request, true, size);
+			if (requestSize == 0) {
+				return -1;
 			}
 
+			auto onReply = [procedure, xid, completion, request, keep](int32_t status, uchar_t* reply, int32_t replySize) {
+				Result result;
+				if (status == 0) {
+					status = decodeReply(procedure, xid, reply, replySize, result);
+				}
+				completion(status, result);
+			};
+			struct iovec pieces[3] = {{request->data(), requestSize}, {const_cast<uchar_t*>(data), size}, {const_cast<uchar_t*>(zeros), xdrPadded(size) - size}};
+			return connection->getRpcEngine()->submit(timeout, xid, pieces, (pieces[2].iov_len ? 3 : 2), onReply);
 		}
 
-		int runRPC();
+		// Same, and waits for the reply. Returns the status completion would get. The reply is gone by then, so Result must own its data.
+		template<typename Result, typename Args>
+		static int32_t callRPC(const Connection_p& connection, uint32_t timeout, const Procedure& procedure, const Args& args, Result& result) {
+			uint32_t xid = nextXid();
+			WireBuffer request;
+			auto requestSize = encodeCall(procedure, xid, args, request);
+			if (requestSize == 0) {
+				return -1;
+			}
+
+			int32_t decoded = -1;
+			auto onReply = [&](int32_t status, uchar_t* reply, int32_t replySize) {
+				decoded = (status == 0) ? decodeReply(procedure, xid, reply, replySize, result) : status;
+			};
+			auto status = connection->getRpcEngine()->call(timeout, xid, request.data(), requestSize, onReply);
+			return (status != 0) ? status : decoded;
+		}
 
 	private:
+		/*
+		 * Encodes the call of procedure with args, record mark included, into request, growing it as args need. With
+		 * withData, opaque data of dataSize bytes is sent behind the call: its length is encoded after args, and the
+		 * record mark counts the data and its padding. Returns the size of the call without the data, or 0.
+		 */
+		template<typename Args>
+		static uint32_t encodeCall(const Procedure& procedure, uint32_t xid, const Args& args, WireBuffer& request, bool withData = false, uint32_t dataSize = 0) {
+			auto callTemplate = RpcCallTemplate::find(procedure.rpcVersion, procedure.program, procedure.programVersion, procedure.authType);
+			if (not callTemplate) {
+				DEBUG_LOG(CRITICAL) << "Auth type not supported : " << GenericEnums::AUTH_TYPEImage::printEnum(procedure.authType);
+				return 0;
+			}
+
+			for (uint32_t capacity = INITIAL_REQUEST_SIZE; capacity <= BufferPool::MAX_SIZE; capacity *= 4) {
+				if (not request.reserve(capacity)) {
+					MEM_ALLOC_FAILURE("Failed to allocate memory in ", __FUNCTION__);
+					return 0;
+				}
+				uchar_t* wireRequest = request.data();
+				XdrEncoder encoder(wireRequest, request.capacity(), callTemplate->build(wireRequest, xid, procedure.procedure));
+				if (encoder.put(args) && (not withData || encoder.put(dataSize))) {
+					uint32_t requestSize = encoder.size();
+					uint32_t recordSize = requestSize - sizeof(uint32_t) + (withData ? xdrPadded(dataSize) : 0);
+					xdr_encode_u32(&wireRequest[0], recordSize); // Without the first uint32_t containing LAST_FRAGMENT
+					xdr_encode_lastFragment(wireRequest);
+					return requestSize;
+				}
+				if (not encoder.overflowed()) {
+					break;
+				}
+			}
+			DEBUG_LOG(CRITICAL) << "Arguments of " << procedure.name << " can not be encoded";
+			return 0;
+		}
+
+		// Checks the RPC header of reply and decodes the result of procedure behind it. Returns 0, or -EPROTO.
+		template<typename Result>
+		static int32_t decodeReply(const Procedure& procedure, uint32_t xid, uchar_t* reply, int32_t replySize, Result& result) {
+			uint32_t payloadSize = 0;
+			uchar_t* payload = parseAndStripRPC(reply, replySize, xid, payloadSize);
+			if (not payload) {
+				return -EPROTO;
+			}
+			XdrDecoder decoder(payload, payloadSize);
+			if (not decoder.get(result)) {
+				DEBUG_LOG(CRITICAL) << "Malformed " << procedure.name << " reply : " << decoder.error() << " at offset : " << decoder.errorOffset();
+				return -EPROTO;
+			}
+			return 0;
+		}
+
 		DESC_CLASS_ENUM(RPC_REPLY, uint32_t,
 			MSG_ACCEPTED = 0,
 			MSG_DENIED = 1
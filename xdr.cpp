@@ -1,4 +1,5 @@
 #include "xdr.hpp"
+#include "XdrCodec.hpp"
 #include "logging/Logging.hpp"
 #include <iomanip>
 
@@ -92,7 +93,7 @@ uint32_t xdr_decode_u32(uchar_t* src, uint32_t& offset, bool trace) {
 
 uint64_t xdr_decode_u64(uchar_t* src, uint32_t& offset, bool trace) {
 	DASSERT(src);
-	uint32_t u64 = 0UL;
+	uint64_t u64 = 0UL;
 	if (trace) {
 		printf("decode64 decoding %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x.\n", src[offset+0], src[offset+1], src[offset+2], src[offset+3], src[offset+4], src[offset+5], src[offset+6], src[offset+7]);
 	}
@@ -108,38 +109,30 @@ uint64_t xdr_decode_u64(uchar_t* src, uint32_t& offset, bool trace) {
 	return u64;
 }
 
+// Takes the declared length of the string and its padding, the string is not NUL terminated on the wire
 int32_t xdr_decode_string(uchar_t* src, std::string& str, uint32_t maxStrLength, uint32_t& offset) {
 	auto strLen = xdr_decode_u32(src, offset);
-	if (strLen < maxStrLength) {
-		str = std::string(reinterpret_cast<const char *>(&src[offset]));
-		if (str.length() == strLen) {
-			offset += strLen;
-			return strLen;
-		} else {
-			DEBUG_LOG(CRITICAL) << "String length does not match length in XDR header : " << str << " Expected length : " << strLen;
-			return -1;
-		}
-	} else {
+	if (strLen > maxStrLength) {
 		DEBUG_LOG(CRITICAL) << "Bad string length. Maximum expected : " << maxStrLength << " but that in XDR header : " << strLen;
 		return -1;
 	}
+	str.assign(reinterpret_cast<const char *>(&src[offset]), strLen);
+	offset += xdrPadded(strLen);
+	return strLen;
 }
 
 int32_t xdr_decode_nBytes(uchar_t* src, std::vector<uchar_t>& bytes, uint32_t maxBytes, uint32_t& offset) {
 	auto byteLen = xdr_decode_u32(src, offset);
-	if (byteLen <= maxBytes) {
-		for (uint32_t i = 0; i < byteLen; ++i) {
-			bytes.push_back(src[offset+i]);
-		}
-		offset += byteLen;
-		return byteLen;
-	} else {
+	if (byteLen > maxBytes) {
 		DEBUG_LOG(CRITICAL) << "Bad byte stream length. Maximum expected : " << maxBytes << " but that in XDR header : " << byteLen;
 		return -1;
 	}
+	bytes.assign(&src[offset], &src[offset] + byteLen);
+	offset += xdrPadded(byteLen);
+	return byteLen;
 }
 
-template<typename T, typename std::enable_if<std::is_integral<T>::value, void>::type* = nullptr>
+template<typename T, typename std::enable_if<std::is_integral<T>::value, void>::type*>
 T getInteger(uchar_t* src) {
 	uchar_t* input = src;
 	uint64_t retValue = 0UL;
@@ -14,6 +14,7 @@ void xdr_encode_lastFragment(uchar_t * dst);
 
 uint32_t xdr_decode_u32(uchar_t *src, uint32_t& offset, bool trace = false);
 uint64_t xdr_decode_u64(uchar_t *src, uint32_t& offset, bool trace = false);
+// Both trust the buffer to hold what the length says, XdrDecoder checks it against the end of the message
 int32_t xdr_decode_string(uchar_t* dst, std::string& str, uint32_t maxStrLen, uint32_t& offset);
 int32_t xdr_decode_nBytes(uchar_t* src, std::vector<uchar_t>& bytes, uint32_t maxBytes, uint32_t& offset);
 